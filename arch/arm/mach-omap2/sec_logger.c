@@ -18,6 +18,7 @@
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
 #include <linux/rtc.h>
+#include <linux/spinlock.h>
 
 #include "../../../drivers/staging/android/logger.h"
 
@@ -104,6 +105,8 @@ struct sec_logger_log {
 	struct miscdevice misc;
 };
 
+/* logger_buf is shared by writers to all logs */
+static DEFINE_SPINLOCK(logger_buf_lock);
 static char logger_buf[1024];
 
 int sec_logger_add_log_ram_console(void *logp, size_t orig)
@@ -131,6 +134,7 @@ int sec_logger_add_log_ram_console(void *logp, size_t orig)
 		 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
 		 tm.tm_min, tm.tm_sec, entry->nsec / 1000000);
 
+	spin_lock(&logger_buf_lock);
 	snprintf(logger_buf, sizeof(logger_buf) - 1, "%s %5d %5d %c %-8s: %s",
 		 time, entry->pid, entry->tid, pri_to_char(pri), tag, message);
 	if (logger_buf[strlen(logger_buf) - 1] != '\n')
@@ -138,6 +142,7 @@ int sec_logger_add_log_ram_console(void *logp, size_t orig)
 		strcat(logger_buf, "\n");
 
 	sec_ram_console_write_ext(NULL, logger_buf, strlen(logger_buf));
+	spin_unlock(&logger_buf_lock);
 
 	return 0;
 }
@@ -193,6 +198,11 @@ static void __init sec_logger_ram_console_init(void)
 
 #endif /* CONFIG_SAMSUNG_PRINT_PLATFORM_LOG */
 
+/*
+ * Writers to all logs run in parallel, sec_klog_buf holds the last "!@"
+ * message until the next sec_logger_print_buffer() consumes it.
+ */
+static DEFINE_SPINLOCK(sec_klog_lock);
 static char sec_klog_buf[256];
 
 void sec_logger_update_buffer(const char *log_str, int count)
@@ -200,19 +210,30 @@ void sec_logger_update_buffer(const char *log_str, int count)
 	const int maxlen = ARRAY_SIZE(sec_klog_buf) - 1;
 	int len;
 
-	sec_klog_buf[0] = '\0';
+	if (likely(*(u16 *)"!@" != *(u16 *)log_str))
+		return;
 
-	if (unlikely(*(u16 *)"!@" == *(u16 *)log_str)) {
-		len = count < maxlen ? count : maxlen;
-		memcpy(sec_klog_buf, log_str, len);
-		sec_klog_buf[len] = '\0';
-	}
+	len = count < maxlen ? count : maxlen;
+	spin_lock(&sec_klog_lock);
+	memcpy(sec_klog_buf, log_str, len);
+	sec_klog_buf[len] = '\0';
+	spin_unlock(&sec_klog_lock);
 }
 
 void sec_logger_print_buffer(void)
 {
-	if (sec_klog_buf[0])
-		pr_info("%s\n", sec_klog_buf);
+	char buf[ARRAY_SIZE(sec_klog_buf)];
+
+	if (likely(!sec_klog_buf[0]))
+		return;
+
+	spin_lock(&sec_klog_lock);
+	strcpy(buf, sec_klog_buf);
+	sec_klog_buf[0] = '\0';
+	spin_unlock(&sec_klog_lock);
+
+	if (buf[0])
+		pr_info("%s\n", buf);
 }
 
 static void __init sec_logger_message_init(void)
@@ -31,15 +31,37 @@
 #include <linux/swap.h>
 #include <linux/mm_types.h>
 #include <linux/dma-contiguous.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/cma.h>
 
 #ifndef SZ_1M
 #define SZ_1M (1 << 20)
 #endif
 
+/*
+ * bitmap marks pages handed out to callers.  ready marks pages that the
+ * pool has already migrated out of the area and holds on to, so that an
+ * allocation covering only ready pages needs no migration at all.  A
+ * page is in the pool when it is set in ready and clear in bitmap;
+ * nr_ready counts such pages.  Pooled pages are not available to the page
+ * allocator, so the pool is given back under memory pressure and not
+ * refilled for a while after that (drained_at).
+ */
 struct cma {
 	unsigned long	base_pfn;
 	unsigned long	count;
 	unsigned long	*bitmap;
+	unsigned long	*ready;
+	unsigned long	*scratch;
+	unsigned long	nr_ready;
+	unsigned long	watermark;
+	unsigned long	refill_fail;
+	unsigned long	drained_at;
+	struct work_struct refill_work;
 };
 
 struct cma *dma_contiguous_default_area;
@@ -136,6 +158,174 @@ void __init dma_contiguous_reserve(phys_addr_t limit)
 };
 
 static DEFINE_MUTEX(cma_mutex);
+/* serialises alloc_contig_range() between allocations and pool refills */
+static DEFINE_MUTEX(cma_migrate_mutex);
+
+#ifdef CONFIG_CMA_POOL_MBYTES
+#define CMA_POOL_PAGES (CONFIG_CMA_POOL_MBYTES * (SZ_1M >> PAGE_SHIFT))
+#else
+#define CMA_POOL_PAGES 0
+#endif
+
+/* how long the pool stays empty after being drained by the shrinker */
+#define CMA_POOL_BACKOFF	(10 * HZ)
+
+static struct cma *cma_areas[MAX_CMA_AREAS];
+static unsigned cma_area_count;
+
+static bool cma_pool_backoff(struct cma *cma)
+{
+	return time_before(jiffies, cma->drained_at + CMA_POOL_BACKOFF);
+}
+
+/* Number of ready pages in [pageno, pageno + count). */
+static unsigned long cma_count_ready(struct cma *cma, unsigned long pageno,
+				     unsigned long count)
+{
+	unsigned long end = pageno + count, next, n = 0;
+
+	pageno = find_next_bit(cma->ready, end, pageno);
+	while (pageno < end) {
+		next = find_next_zero_bit(cma->ready, end, pageno);
+		n += next - pageno;
+		pageno = find_next_bit(cma->ready, end, next);
+	}
+	return n;
+}
+
+/*
+ * Evacuate the pages in [pageno, pageno + count) which are not ready yet,
+ * marking them ready as each run is done.  The caller owns the range in
+ * cma->bitmap, so nobody else touches the ready bits inside it.
+ */
+static int cma_migrate_range(struct cma *cma, unsigned long pageno,
+			     unsigned long count)
+{
+	unsigned long end = pageno + count, next;
+	int ret = 0;
+
+	mutex_lock(&cma_migrate_mutex);
+	pageno = find_next_zero_bit(cma->ready, end, pageno);
+	while (pageno < end) {
+		next = find_next_bit(cma->ready, end, pageno);
+		ret = alloc_contig_range(cma->base_pfn + pageno,
+					 cma->base_pfn + next, MIGRATE_CMA);
+		if (ret)
+			break;
+		mutex_lock(&cma_mutex);
+		bitmap_set(cma->ready, pageno, next - pageno);
+		mutex_unlock(&cma_mutex);
+		pageno = find_next_zero_bit(cma->ready, end, next);
+	}
+	mutex_unlock(&cma_migrate_mutex);
+	return ret;
+}
+
+static void cma_refill_pool(struct work_struct *work)
+{
+	struct cma *cma = container_of(work, struct cma, refill_work);
+	unsigned long mask = (1 << CONFIG_CMA_ALIGNMENT) - 1;
+	unsigned long pageno, pfn, chunk;
+	int ret;
+
+	for (;;) {
+		mutex_lock(&cma_mutex);
+		if (cma->nr_ready >= cma->watermark) {
+			mutex_unlock(&cma_mutex);
+			break;
+		}
+		chunk = min_t(unsigned long, cma->watermark - cma->nr_ready,
+			      pageblock_nr_pages);
+		bitmap_or(cma->scratch, cma->bitmap, cma->ready, cma->count);
+		pageno = bitmap_find_next_zero_area(cma->scratch, cma->count,
+						    0, chunk, mask);
+		if (pageno >= cma->count) {
+			mutex_unlock(&cma_mutex);
+			break;
+		}
+		/* hold the range while it is being evacuated */
+		bitmap_set(cma->bitmap, pageno, chunk);
+		mutex_unlock(&cma_mutex);
+
+		pfn = cma->base_pfn + pageno;
+		mutex_lock(&cma_migrate_mutex);
+		ret = alloc_contig_range(pfn, pfn + chunk, MIGRATE_CMA);
+		mutex_unlock(&cma_migrate_mutex);
+		trace_cma_pool_refill(pfn, chunk, ret);
+
+		mutex_lock(&cma_mutex);
+		bitmap_clear(cma->bitmap, pageno, chunk);
+		if (ret == 0) {
+			bitmap_set(cma->ready, pageno, chunk);
+			cma->nr_ready += chunk;
+		} else {
+			cma->refill_fail++;
+		}
+		mutex_unlock(&cma_mutex);
+
+		/* leave busy pages alone until the next allocation kicks us */
+		if (ret)
+			break;
+	}
+}
+
+static void cma_kick_refill(struct cma *cma)
+{
+	if (cma->nr_ready < cma->watermark && !cma_pool_backoff(cma))
+		queue_work(system_long_wq, &cma->refill_work);
+}
+
+/*
+ * Give up to nr_to_scan pooled pages back to the page allocator.  Caller
+ * needs to hold cma_mutex.
+ */
+static unsigned long cma_drain_pool(struct cma *cma, unsigned long nr_to_scan)
+{
+	unsigned long pageno, next, n, freed = 0;
+
+	bitmap_andnot(cma->scratch, cma->ready, cma->bitmap, cma->count);
+	pageno = find_first_bit(cma->scratch, cma->count);
+	while (pageno < cma->count && freed < nr_to_scan) {
+		next = find_next_zero_bit(cma->scratch, cma->count, pageno);
+		n = min(next - pageno, nr_to_scan - freed);
+		bitmap_clear(cma->ready, pageno, n);
+		cma->nr_ready -= n;
+		free_contig_range(cma->base_pfn + pageno, n);
+		freed += n;
+		pageno = find_next_bit(cma->scratch, cma->count, pageno + n);
+	}
+	if (freed)
+		cma->drained_at = jiffies;
+	return freed;
+}
+
+static int cma_pool_shrink(struct shrinker *shrinker,
+			   struct shrink_control *sc)
+{
+	unsigned long nr_to_scan = sc->nr_to_scan;
+	unsigned long nr_total = 0;
+	unsigned i;
+
+	/* allocations migrating pages may end up in reclaim themselves */
+	if (!mutex_trylock(&cma_mutex))
+		return nr_to_scan ? -1 : 0;
+
+	for (i = 0; i < cma_area_count; i++) {
+		struct cma *cma = cma_areas[i];
+
+		if (nr_to_scan)
+			nr_to_scan -= cma_drain_pool(cma, nr_to_scan);
+		nr_total += cma->nr_ready;
+	}
+	mutex_unlock(&cma_mutex);
+
+	return min_t(unsigned long, nr_total, INT_MAX);
+}
+
+static struct shrinker cma_pool_shrinker = {
+	.shrink = cma_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
 
 static __init int cma_activate_area(unsigned long base_pfn, unsigned long count)
 {
@@ -175,20 +365,28 @@ static __init struct cma *cma_create_area(unsigned long base_pfn,
 	cma->base_pfn = base_pfn;
 	cma->count = count;
 	cma->bitmap = kzalloc(bitmap_size, GFP_KERNEL);
-
-	if (!cma->bitmap)
+	cma->ready = kzalloc(bitmap_size, GFP_KERNEL);
+	cma->scratch = kmalloc(bitmap_size, GFP_KERNEL);
+	cma->nr_ready = 0;
+	cma->watermark = min_t(unsigned long, CMA_POOL_PAGES, count / 4);
+	cma->refill_fail = 0;
+	cma->drained_at = jiffies - CMA_POOL_BACKOFF - 1;
+	INIT_WORK(&cma->refill_work, cma_refill_pool);
+
+	if (!cma->bitmap || !cma->ready || !cma->scratch)
 		goto no_mem;
 
 	ret = cma_activate_area(base_pfn, count);
 	if (ret)
-		goto error;
+		goto no_mem;
 
 	pr_debug("%s: returned %p\n", __func__, (void *)cma);
 	return cma;
 
-error:
-	kfree(cma->bitmap);
 no_mem:
+	kfree(cma->scratch);
+	kfree(cma->ready);
+	kfree(cma->bitmap);
 	kfree(cma);
 	return ERR_PTR(ret);
 }
@@ -211,12 +409,17 @@ static int __init cma_init_reserved_areas(void)
 		struct cma *cma;
 		cma = cma_create_area(PFN_DOWN(r->start),
 				      r->size >> PAGE_SHIFT);
-		if (!IS_ERR(cma))
+		if (!IS_ERR(cma)) {
 			dev_set_cma_area(r->dev, cma);
-		else
+			cma_areas[cma_area_count++] = cma;
+			cma_kick_refill(cma);
+		} else {
 			printk(KERN_ERR "%s() cma_create_area error for %ud\n",
 					__func__, i);
+		}
 	}
+	if (CMA_POOL_PAGES && cma_area_count)
+		register_shrinker(&cma_pool_shrinker);
 	return 0;
 }
 core_initcall(cma_init_reserved_areas);
@@ -302,11 +505,189 @@ err:
 	return base;
 }
 
+#ifdef CONFIG_DEBUG_FS
+
+#define CMA_LATENCY_BUCKETS	20
+
+/*
+ * Per-device allocation statistics.  latency[i] counts allocations that
+ * took less than 2^i microseconds (and at least 2^(i-1)), the last bucket
+ * collects everything slower.
+ */
+struct cma_dev_stats {
+	struct list_head node;
+	struct device *dev;
+	char name[32];
+	unsigned long nr_alloc;
+	unsigned long nr_pooled;
+	unsigned long nr_fail;
+	unsigned long nr_migrate_fail;
+	unsigned long latency[CMA_LATENCY_BUCKETS];
+};
+
+static LIST_HEAD(cma_stats_head);
+/* protects cma_stats_head and the counters */
+static DEFINE_MUTEX(cma_stats_mutex);
+
+/* Called with cma_stats_mutex held. */
+static struct cma_dev_stats *cma_get_dev_stats(struct device *dev)
+{
+	struct cma_dev_stats *st;
+
+	list_for_each_entry(st, &cma_stats_head, node)
+		if (st->dev == dev)
+			return st;
+
+	st = kzalloc(sizeof *st, GFP_KERNEL);
+	if (!st)
+		return NULL;
+	st->dev = dev;
+	strlcpy(st->name, dev ? dev_name(dev) : "default", sizeof st->name);
+	list_add_tail(&st->node, &cma_stats_head);
+	return st;
+}
+
+static void cma_stat_alloc(struct device *dev, bool ok, bool pooled,
+			   s64 latency_us)
+{
+	struct cma_dev_stats *st;
+	int bucket = 0;
+
+	if (latency_us > 0)
+		bucket = min(fls64(latency_us), CMA_LATENCY_BUCKETS - 1);
+
+	mutex_lock(&cma_stats_mutex);
+	st = cma_get_dev_stats(dev);
+	if (st) {
+		if (ok) {
+			st->nr_alloc++;
+			st->nr_pooled += pooled;
+			st->latency[bucket]++;
+		} else {
+			st->nr_fail++;
+		}
+	}
+	mutex_unlock(&cma_stats_mutex);
+}
+
+static void cma_stat_migrate_fail(struct device *dev)
+{
+	struct cma_dev_stats *st;
+
+	mutex_lock(&cma_stats_mutex);
+	st = cma_get_dev_stats(dev);
+	if (st)
+		st->nr_migrate_fail++;
+	mutex_unlock(&cma_stats_mutex);
+}
+
+static int cma_stats_show(struct seq_file *s, void *unused)
+{
+	struct cma_dev_stats *st;
+	int i;
+
+	mutex_lock(&cma_stats_mutex);
+	list_for_each_entry(st, &cma_stats_head, node) {
+		seq_printf(s, "%s: alloc %lu pooled %lu fail %lu "
+			   "migrate_fail %lu\n", st->name, st->nr_alloc,
+			   st->nr_pooled, st->nr_fail, st->nr_migrate_fail);
+		for (i = 0; i < CMA_LATENCY_BUCKETS; i++) {
+			if (!st->latency[i])
+				continue;
+			if (i == CMA_LATENCY_BUCKETS - 1)
+				seq_printf(s, "  >= %8luus %lu\n",
+					   1UL << (i - 1), st->latency[i]);
+			else
+				seq_printf(s, "   < %8luus %lu\n",
+					   1UL << i, st->latency[i]);
+		}
+	}
+	mutex_unlock(&cma_stats_mutex);
+	return 0;
+}
+
+static int cma_pools_show(struct seq_file *s, void *unused)
+{
+	unsigned i;
+
+	mutex_lock(&cma_mutex);
+	for (i = 0; i < cma_area_count; i++) {
+		struct cma *cma = cma_areas[i];
+
+		seq_printf(s, "area %u: base_pfn %lx count %lu used %d "
+			   "pooled %lu watermark %lu refill_fail %lu\n", i,
+			   cma->base_pfn, cma->count,
+			   bitmap_weight(cma->bitmap, cma->count),
+			   cma->nr_ready, cma->watermark, cma->refill_fail);
+	}
+	mutex_unlock(&cma_mutex);
+	return 0;
+}
+
+static int cma_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cma_stats_show, NULL);
+}
+
+static int cma_pools_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cma_pools_show, NULL);
+}
+
+static const struct file_operations cma_stats_fops = {
+	.open		= cma_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations cma_pools_fops = {
+	.open		= cma_pools_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init cma_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("cma", NULL);
+	if (!dir)
+		return -ENOMEM;
+
+	debugfs_create_file("stats", S_IRUGO, dir, NULL, &cma_stats_fops);
+	debugfs_create_file("pools", S_IRUGO, dir, NULL, &cma_pools_fops);
+	return 0;
+}
+late_initcall(cma_debugfs_init);
+
+#else
+
+static inline void cma_stat_alloc(struct device *dev, bool ok, bool pooled,
+				  s64 latency_us) { }
+static inline void cma_stat_migrate_fail(struct device *dev) { }
+
+#endif
+
+static void cma_alloc_done(struct device *dev, struct page *page, int count,
+			   unsigned int align, bool pooled, ktime_t start)
+{
+	s64 latency_us = ktime_us_delta(ktime_get(), start);
+
+	trace_cma_alloc(dev ? dev_name(dev) : "default",
+			page ? page_to_pfn(page) : 0, count, align, pooled,
+			latency_us);
+	cma_stat_alloc(dev, page != NULL, pooled, latency_us);
+}
+
 static struct page *__dma_alloc_from_contiguous(struct device *dev, int count,
 				       unsigned int align)
 {
 	unsigned long mask, pfn, pageno, start = 0;
 	struct cma *cma = dev_get_cma_area(dev);
+	bool waited = false;
+	ktime_t begin;
 	int ret;
 
 	if (!cma || !cma->count)
@@ -328,12 +709,40 @@ static struct page *__dma_alloc_from_contiguous(struct device *dev, int count,
 		return NULL;
 
 	mask = (1 << align) - 1;
+	begin = ktime_get();
 
 	mutex_lock(&cma_mutex);
 
+	/* A range the pool has evacuated entirely needs no migration. */
+	bitmap_complement(cma->scratch, cma->ready, cma->count);
+	bitmap_or(cma->scratch, cma->scratch, cma->bitmap, cma->count);
+	pageno = bitmap_find_next_zero_area(cma->scratch, cma->count, 0,
+					    count, mask);
+	if (pageno < cma->count) {
+		bitmap_clear(cma->ready, pageno, count);
+		bitmap_set(cma->bitmap, pageno, count);
+		cma->nr_ready -= count;
+		mutex_unlock(&cma_mutex);
+
+		pfn = cma->base_pfn + pageno;
+		cma_alloc_done(dev, pfn_to_page(pfn), count, align, true, begin);
+		cma_kick_refill(cma);
+		pr_debug("%s(): returned pooled %p\n", __func__,
+			 pfn_to_page(pfn));
+		return pfn_to_page(pfn);
+	}
+
 	for (;;) {
 		pageno = bitmap_find_next_zero_area(cma->bitmap, cma->count,
 						    start, count, mask);
+		if (pageno >= cma->count && !waited) {
+			/* a refill may be holding part of the area */
+			mutex_unlock(&cma_mutex);
+			cancel_work_sync(&cma->refill_work);
+			mutex_lock(&cma_mutex);
+			waited = true;
+			continue;
+		}
 		if (pageno >= cma->count) {
 			printk(KERN_ERR "%s : cma->count is %lu, "
 					"pageno is %lu\n", __func__,
@@ -342,14 +751,31 @@ static struct page *__dma_alloc_from_contiguous(struct device *dev, int count,
 			goto error;
 		}
 
+		/*
+		 * Claim the range and take its ready pages out of the pool,
+		 * then migrate the rest without holding cma_mutex so that
+		 * pooled allocations and releases are not held up.
+		 */
+		bitmap_set(cma->bitmap, pageno, count);
+		cma->nr_ready -= cma_count_ready(cma, pageno, count);
+		mutex_unlock(&cma_mutex);
+
 		pfn = cma->base_pfn + pageno;
-		ret = alloc_contig_range(pfn, pfn + count, MIGRATE_CMA);
+		ret = cma_migrate_range(cma, pageno, count);
+
+		mutex_lock(&cma_mutex);
 		if (ret == 0) {
-			bitmap_set(cma->bitmap, pageno, count);
+			bitmap_clear(cma->ready, pageno, count);
 			break;
-		} else if (ret != -EBUSY && ret != -EAGAIN) {
-			goto error;
 		}
+		/* whatever got evacuated goes back to the pool */
+		bitmap_clear(cma->bitmap, pageno, count);
+		cma->nr_ready += cma_count_ready(cma, pageno, count);
+
+		trace_cma_migrate_fail(pfn, count, ret);
+		cma_stat_migrate_fail(dev);
+		if (ret != -EBUSY && ret != -EAGAIN)
+			goto error;
 		pr_debug("%s(): memory range at %p is busy, retrying\n",
 			 __func__, pfn_to_page(pfn));
 		/* try again with a bit different memory target */
@@ -363,11 +789,14 @@ static struct page *__dma_alloc_from_contiguous(struct device *dev, int count,
 
 	mutex_unlock(&cma_mutex);
 
+	cma_alloc_done(dev, pfn_to_page(pfn), count, align, false, begin);
+	cma_kick_refill(cma);
 	pr_debug("%s(): returned %p\n", __func__, pfn_to_page(pfn));
 	return pfn_to_page(pfn);
 error:
 	pr_err("%s(): returned error (%d)\n", __func__, ret);
 	mutex_unlock(&cma_mutex);
+	cma_alloc_done(dev, NULL, count, align, false, begin);
 	return NULL;
 }
 
@@ -490,6 +919,7 @@ bool dma_release_from_contiguous(struct device *dev, struct page *pages,
 {
 	struct cma *cma = dev_get_cma_area(dev);
 	unsigned long pfn;
+	bool pooled;
 
 	if (!cma || !pages)
 		return false;
@@ -507,8 +937,17 @@ bool dma_release_from_contiguous(struct device *dev, struct page *pages,
 
 	mutex_lock(&cma_mutex);
 	bitmap_clear(cma->bitmap, pfn - cma->base_pfn, count);
-	free_contig_range(pfn, count);
+	pooled = cma->nr_ready + count <= cma->watermark &&
+		 !cma_pool_backoff(cma);
+	if (pooled) {
+		/* keep the pages evacuated for the next allocation */
+		bitmap_set(cma->ready, pfn - cma->base_pfn, count);
+		cma->nr_ready += count;
+	} else {
+		free_contig_range(pfn, count);
+	}
 	mutex_unlock(&cma_mutex);
 
+	trace_cma_release(pfn, count, pooled);
 	return true;
 }
@@ -27,20 +27,69 @@
 
 #include <linux/anon_inodes.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/sync.h>
+
 static void sync_fence_signal_pt(struct sync_pt *pt);
 static int _sync_pt_has_signaled(struct sync_pt *pt);
 
+#ifdef CONFIG_DEBUG_FS
+/*
+ * The global lists only feed the debugfs dump, so the fast paths do not
+ * touch them otherwise.
+ */
 static LIST_HEAD(sync_timeline_list_head);
 static DEFINE_SPINLOCK(sync_timeline_list_lock);
 
 static LIST_HEAD(sync_fence_list_head);
 static DEFINE_SPINLOCK(sync_fence_list_lock);
 
+static void sync_timeline_debug_add(struct sync_timeline *obj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_timeline_list_lock, flags);
+	list_add_tail(&obj->sync_timeline_list, &sync_timeline_list_head);
+	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+}
+
+static void sync_timeline_debug_remove(struct sync_timeline *obj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_timeline_list_lock, flags);
+	list_del(&obj->sync_timeline_list);
+	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+}
+
+static void sync_fence_debug_add(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+
+static void sync_fence_debug_remove(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_del(&fence->sync_fence_list);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+#else
+static inline void sync_timeline_debug_add(struct sync_timeline *obj) {}
+static inline void sync_timeline_debug_remove(struct sync_timeline *obj) {}
+static inline void sync_fence_debug_add(struct sync_fence *fence) {}
+static inline void sync_fence_debug_remove(struct sync_fence *fence) {}
+#endif
+
 struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 					   int size, const char *name)
 {
 	struct sync_timeline *obj;
-	unsigned long flags;
 
 	if (size < sizeof(struct sync_timeline))
 		return NULL;
@@ -58,23 +107,17 @@ struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 	INIT_LIST_HEAD(&obj->active_list_head);
 	spin_lock_init(&obj->active_list_lock);
 
-	spin_lock_irqsave(&sync_timeline_list_lock, flags);
-	list_add_tail(&obj->sync_timeline_list, &sync_timeline_list_head);
-	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+	sync_timeline_debug_add(obj);
 
 	return obj;
 }
 
 static void sync_timeline_free(struct sync_timeline *obj)
 {
-	unsigned long flags;
-
 	if (obj->ops->release_obj)
 		obj->ops->release_obj(obj);
 
-	spin_lock_irqsave(&sync_timeline_list_lock, flags);
-	list_del(&obj->sync_timeline_list);
-	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+	sync_timeline_debug_remove(obj);
 
 	kfree(obj);
 }
@@ -131,19 +174,28 @@ void sync_timeline_signal(struct sync_timeline *obj)
 	unsigned long flags;
 	LIST_HEAD(signaled_pts);
 	struct list_head *pos, *n;
+	int nr_signaled = 0;
 
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
+	/*
+	 * The active list is in signaling order, so everything past the
+	 * first sync_pt that has not signaled has not signaled either.
+	 */
 	list_for_each_safe(pos, n, &obj->active_list_head) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, active_list);
 
-		if (_sync_pt_has_signaled(pt))
-			list_move(pos, &signaled_pts);
+		if (!_sync_pt_has_signaled(pt))
+			break;
+		list_move_tail(pos, &signaled_pts);
+		nr_signaled++;
 	}
 
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
 
+	trace_sync_timeline_signal(obj, nr_signaled);
+
 	list_for_each_safe(pos, n, &signaled_pts) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, active_list);
@@ -206,6 +258,7 @@ static struct sync_pt *sync_pt_dup(struct sync_pt *pt)
 static void sync_pt_activate(struct sync_pt *pt)
 {
 	struct sync_timeline *obj = pt->parent;
+	struct list_head *pos;
 	unsigned long flags;
 	int err;
 
@@ -215,7 +268,18 @@ static void sync_pt_activate(struct sync_pt *pt)
 	if (err != 0)
 		goto out;
 
-	list_add_tail(&pt->active_list, &obj->active_list_head);
+	/*
+	 * Insert in signaling order.  sync_pts are usually created in the
+	 * order they signal, so searching from the tail ends right away.
+	 */
+	list_for_each_prev(pos, &obj->active_list_head) {
+		struct sync_pt *prev =
+			container_of(pos, struct sync_pt, active_list);
+
+		if (obj->ops->compare(prev, pt) <= 0)
+			break;
+	}
+	list_add(&pt->active_list, pos);
 
 out:
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
@@ -236,7 +300,6 @@ static const struct file_operations sync_fence_fops = {
 static struct sync_fence *sync_fence_alloc(const char *name)
 {
 	struct sync_fence *fence;
-	unsigned long flags;
 
 	fence = kzalloc(sizeof(struct sync_fence), GFP_KERNEL);
 	if (fence == NULL)
@@ -254,10 +317,9 @@ static struct sync_fence *sync_fence_alloc(const char *name)
 	spin_lock_init(&fence->waiter_list_lock);
 
 	init_waitqueue_head(&fence->wq);
+	fence->create_time = ktime_get();
 
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_add(fence);
 
 	return fence;
 
@@ -381,10 +443,13 @@ struct sync_fence *sync_fence_merge(const char *name,
 		goto err;
 
 	fence->status = sync_fence_get_status(fence);
+	if (fence->status)
+		fence->signal_time = fence->create_time;
 
 	return fence;
 err:
 	sync_fence_free_pts(fence);
+	sync_fence_debug_remove(fence);
 	kfree(fence);
 	return NULL;
 }
@@ -409,6 +474,7 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 		list_for_each_safe(pos, n, &fence->waiter_list_head)
 			list_move(pos, &signaled_waiters);
 
+		fence->signal_time = ktime_get();
 		fence->status = status;
 	} else {
 		status = 0;
@@ -416,6 +482,9 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 	spin_unlock_irqrestore(&fence->waiter_list_lock, flags);
 
 	if (status) {
+		trace_sync_fence_signal(fence,
+			ktime_us_delta(fence->signal_time, fence->create_time));
+
 		list_for_each_safe(pos, n, &signaled_waiters) {
 			struct sync_fence_waiter *waiter =
 				container_of(pos, struct sync_fence_waiter,
@@ -461,6 +530,7 @@ out:
 
 int sync_fence_wait(struct sync_fence *fence, long timeout)
 {
+	bool was_active = fence->status == 0;
 	int err;
 
 	if (timeout) {
@@ -475,6 +545,10 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 	if (err < 0)
 		return err;
 
+	if (was_active && fence->status != 0)
+		trace_sync_fence_wake(fence,
+			ktime_us_delta(ktime_get(), fence->signal_time));
+
 	if (fence->status < 0)
 		return fence->status;
 
@@ -487,13 +561,9 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 static int sync_fence_release(struct inode *inode, struct file *file)
 {
 	struct sync_fence *fence = file->private_data;
-	unsigned long flags;
 
 	sync_fence_free_pts(fence);
-
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_del(&fence->sync_fence_list);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_remove(fence);
 
 	kfree(fence);
 
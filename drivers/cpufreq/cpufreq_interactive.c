@@ -29,6 +29,7 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/input.h>
+#include <linux/math64.h>
 #include <asm/cputime.h>
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/earlysuspend.h>
@@ -55,7 +56,15 @@ struct cpufreq_interactive_cpuinfo {
 	unsigned int floor_freq;
 	u64 floor_validate_time;
 	u64 hispeed_validate_time;
+	u64 decision_time;
 	int governor_enabled;
+	/* protects the target selection against the tick hook */
+	spinlock_t load_lock;
+	struct update_util_data update_util;
+	u64 util_time;
+	u64 util_busy;
+	u64 util_wall;
+	u64 util_idle;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -119,6 +128,15 @@ static struct cpufreq_interactive_inputopen inputopen;
 
 static int boost_val;
 
+/*
+ * Non-zero means busy CPUs are evaluated from the scheduler tick with the
+ * CFS and RT busy time the scheduler accounts, instead of from the
+ * sampling timer.  The timer is then only used to bring idle CPUs down,
+ * one tick after they go idle and then once min_sample_time allows it.
+ */
+static int sched_util_val;
+static DEFINE_MUTEX(sched_util_lock);
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -132,6 +150,123 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Ticks until the timer should next look at @pcpu, whose sample has just
+ * been restarted at pcpu->idle_exit_time.  In sched_util mode an idle CPU
+ * that is still above min after its first look is normally being held by
+ * min_sample_time, so sleep until that runs out rather than every tick.
+ */
+static unsigned long cpufreq_interactive_timer_delay(
+		struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	u64 expires;
+
+	if (sched_util_val && pcpu->idling) {
+		expires = pcpu->floor_validate_time + min_sample_time;
+		if (expires > pcpu->idle_exit_time)
+			return usecs_to_jiffies((unsigned int)
+				(expires - pcpu->idle_exit_time));
+	}
+
+	return usecs_to_jiffies(timer_rate);
+}
+
+/*
+ * Pick a new target speed for @cpu from @cpu_load, measured up to @now
+ * (usecs) when the CPU had been idle for @now_idle in total.  Returns
+ * false if the decision has to wait for above_hispeed_delay or
+ * min_sample_time, true once the target has been settled.  Called with
+ * pcpu->load_lock held.
+ */
+static bool cpufreq_interactive_update_target(unsigned long cpu,
+		struct cpufreq_interactive_cpuinfo *pcpu, int cpu_load,
+		u64 now, u64 now_idle)
+{
+	unsigned int new_freq;
+	unsigned int index;
+	unsigned long flags;
+
+	if (cpu_load >= go_hispeed_load || boost_val) {
+		if (pcpu->target_freq <= pcpu->policy->min) {
+			new_freq = hispeed_freq;
+		} else {
+			new_freq = pcpu->policy->max * cpu_load / 100;
+
+			if (new_freq < hispeed_freq)
+				new_freq = hispeed_freq;
+
+			if (pcpu->target_freq == hispeed_freq &&
+			    new_freq > hispeed_freq &&
+			    cputime64_sub(now, pcpu->hispeed_validate_time)
+			    < above_hispeed_delay_val) {
+				trace_cpufreq_interactive_notyet(cpu, cpu_load,
+								 pcpu->target_freq,
+								 new_freq);
+				return false;
+			}
+		}
+	} else {
+		new_freq = pcpu->policy->cur * cpu_load / 100;
+	}
+
+	if (new_freq <= hispeed_freq)
+		pcpu->hispeed_validate_time = now;
+
+	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+					   new_freq, CPUFREQ_RELATION_H,
+					   &index)) {
+		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
+			     (int) cpu);
+		return false;
+	}
+
+	new_freq = pcpu->freq_table[index].frequency;
+
+	/*
+	 * Do not scale below floor_freq unless we have been at or above the
+	 * floor frequency for the minimum sample time since last validated.
+	 */
+	if (new_freq < pcpu->floor_freq) {
+		if (cputime64_sub(now, pcpu->floor_validate_time)
+		    < min_sample_time) {
+			trace_cpufreq_interactive_notyet(cpu, cpu_load,
+					 pcpu->target_freq, new_freq);
+			return false;
+		}
+	}
+
+	pcpu->floor_freq = new_freq;
+	pcpu->floor_validate_time = now;
+
+	if (pcpu->target_freq == new_freq) {
+		trace_cpufreq_interactive_already(cpu, cpu_load,
+						  pcpu->target_freq, new_freq);
+		return true;
+	}
+
+	trace_cpufreq_interactive_target(cpu, cpu_load, pcpu->target_freq,
+					 new_freq);
+	pcpu->target_set_time_in_idle = now_idle;
+	pcpu->target_set_time = now;
+	pcpu->decision_time = now;
+
+	if (new_freq < pcpu->target_freq) {
+		pcpu->target_freq = new_freq;
+		spin_lock_irqsave(&down_cpumask_lock, flags);
+		cpumask_set_cpu(cpu, &down_cpumask);
+		spin_unlock_irqrestore(&down_cpumask_lock, flags);
+		queue_work(down_wq, &freq_scale_down_work);
+	} else {
+		pcpu->target_freq = new_freq;
+		spin_lock_irqsave(&up_cpumask_lock, flags);
+		cpumask_set_cpu(cpu, &up_cpumask);
+		spin_unlock_irqrestore(&up_cpumask_lock, flags);
+		wake_up_process(up_task);
+	}
+
+	return true;
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -143,8 +278,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 	struct cpufreq_interactive_cpuinfo *pcpu =
 		&per_cpu(cpuinfo, data);
 	u64 now_idle;
-	unsigned int new_freq;
-	unsigned int index;
+	bool settled;
 	unsigned long flags;
 
 	smp_rmb();
@@ -204,84 +338,14 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
-	if (cpu_load >= go_hispeed_load || boost_val) {
-		if (pcpu->target_freq <= pcpu->policy->min) {
-			new_freq = hispeed_freq;
-		} else {
-			new_freq = pcpu->policy->max * cpu_load / 100;
-
-			if (new_freq < hispeed_freq)
-				new_freq = hispeed_freq;
+	spin_lock_irqsave(&pcpu->load_lock, flags);
+	settled = cpufreq_interactive_update_target(data, pcpu, cpu_load,
+						    pcpu->timer_run_time,
+						    now_idle);
+	spin_unlock_irqrestore(&pcpu->load_lock, flags);
 
-			if (pcpu->target_freq == hispeed_freq &&
-			    new_freq > hispeed_freq &&
-			    cputime64_sub(pcpu->timer_run_time,
-					  pcpu->hispeed_validate_time)
-			    < above_hispeed_delay_val) {
-				trace_cpufreq_interactive_notyet(data, cpu_load,
-								 pcpu->target_freq,
-								 new_freq);
-				goto rearm;
-			}
-		}
-	} else {
-		new_freq = pcpu->policy->cur * cpu_load / 100;
-	}
-
-	if (new_freq <= hispeed_freq)
-		pcpu->hispeed_validate_time = pcpu->timer_run_time;
-
-	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
-					   new_freq, CPUFREQ_RELATION_H,
-					   &index)) {
-		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
-			     (int) data);
+	if (!settled)
 		goto rearm;
-	}
-
-	new_freq = pcpu->freq_table[index].frequency;
-
-	/*
-	 * Do not scale below floor_freq unless we have been at or above the
-	 * floor frequency for the minimum sample time since last validated.
-	 */
-	if (new_freq < pcpu->floor_freq) {
-		if (cputime64_sub(pcpu->timer_run_time,
-				  pcpu->floor_validate_time)
-		    < min_sample_time) {
-			trace_cpufreq_interactive_notyet(data, cpu_load,
-					 pcpu->target_freq, new_freq);
-			goto rearm;
-		}
-	}
-
-	pcpu->floor_freq = new_freq;
-	pcpu->floor_validate_time = pcpu->timer_run_time;
-
-	if (pcpu->target_freq == new_freq) {
-		trace_cpufreq_interactive_already(data, cpu_load,
-						  pcpu->target_freq, new_freq);
-		goto rearm_if_notmax;
-	}
-
-	trace_cpufreq_interactive_target(data, cpu_load, pcpu->target_freq,
-					 new_freq);
-	pcpu->target_set_time_in_idle = now_idle;
-	pcpu->target_set_time = pcpu->timer_run_time;
-
-	if (new_freq < pcpu->target_freq) {
-		pcpu->target_freq = new_freq;
-		spin_lock_irqsave(&down_cpumask_lock, flags);
-		cpumask_set_cpu(data, &down_cpumask);
-		spin_unlock_irqrestore(&down_cpumask_lock, flags);
-		queue_work(down_wq, &freq_scale_down_work);
-	} else {
-		pcpu->target_freq = new_freq;
-		spin_lock_irqsave(&up_cpumask_lock, flags);
-		cpumask_set_cpu(data, &up_cpumask);
-		spin_unlock_irqrestore(&up_cpumask_lock, flags);
-		wake_up_process(up_task);
-	}
 
 rearm_if_notmax:
 	/*
@@ -292,6 +356,10 @@ rearm_if_notmax:
 		goto exit;
 
 rearm:
+	/* Busy CPUs are evaluated from the scheduler tick instead. */
+	if (sched_util_val && !pcpu->idling)
+		goto exit;
+
 	if (!timer_pending(&pcpu->cpu_timer)) {
 		/*
 		 * If already at min: if that CPU is idle, don't set timer.
@@ -310,7 +378,7 @@ rearm:
 		pcpu->time_in_idle = get_cpu_idle_time_us(
 			data, &pcpu->idle_exit_time);
 		mod_timer(&pcpu->cpu_timer,
-			  jiffies + usecs_to_jiffies(timer_rate));
+			  jiffies + cpufreq_interactive_timer_delay(pcpu));
 	}
 
 exit:
@@ -344,8 +412,12 @@ static void cpufreq_interactive_idle_start(void)
 			pcpu->time_in_idle = get_cpu_idle_time_us(
 				smp_processor_id(), &pcpu->idle_exit_time);
 			pcpu->timer_idlecancel = 0;
-			mod_timer(&pcpu->cpu_timer,
-				  jiffies + usecs_to_jiffies(timer_rate));
+			/*
+			 * In sched_util mode the tick no longer looks at
+			 * this CPU, so take the first look after one tick.
+			 */
+			mod_timer(&pcpu->cpu_timer, jiffies + (sched_util_val ?
+				  1 : cpufreq_interactive_timer_delay(pcpu)));
 		}
 #endif
 	} else {
@@ -386,9 +458,10 @@ static void cpufreq_interactive_idle_end(void)
 	 * re-arm the timer for another interval when it's done, rather
 	 * than updating the interval start time to be "now", which doesn't
 	 * give the timer function enough time to make a decision on this
-	 * run.)
+	 * run.)  In sched_util mode the scheduler tick takes over instead.
 	 */
-	if (timer_pending(&pcpu->cpu_timer) == 0 &&
+	if (!sched_util_val &&
+	    timer_pending(&pcpu->cpu_timer) == 0 &&
 	    pcpu->timer_run_time >= pcpu->idle_exit_time &&
 	    pcpu->governor_enabled) {
 		pcpu->time_in_idle =
@@ -396,11 +469,140 @@ static void cpufreq_interactive_idle_end(void)
 					     &pcpu->idle_exit_time);
 		pcpu->timer_idlecancel = 0;
 		mod_timer(&pcpu->cpu_timer,
-			  jiffies + usecs_to_jiffies(timer_rate));
+			  jiffies + cpufreq_interactive_timer_delay(pcpu));
 	}
 
 }
 
+/*
+ * Scheduler tick hook for sched_util mode.  Runs in hard interrupt
+ * context on the CPU it was registered for, outside the runqueue lock.
+ */
+static void cpufreq_interactive_update_util(struct update_util_data *data,
+					    u64 time, u64 busy_time)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		container_of(data, struct cpufreq_interactive_cpuinfo,
+			     update_util);
+	int cpu = smp_processor_id();
+	u64 delta_time, delta_busy;
+	u64 delta_wall, delta_idle;
+	u64 now, now_idle;
+	int cpu_load, idle_load;
+
+	if (!pcpu->governor_enabled)
+		return;
+
+	spin_lock(&pcpu->load_lock);
+	now_idle = get_cpu_idle_time_us(cpu, &now);
+	if (now_idle == -1ULL)
+		now = ktime_to_us(ktime_get());
+
+	/* The first tick after (re)enabling only starts the window. */
+	if (!pcpu->util_time) {
+		pcpu->util_time = time;
+		pcpu->util_busy = busy_time;
+		pcpu->util_wall = now;
+		pcpu->util_idle = now_idle;
+		goto out;
+	}
+
+	delta_time = time - pcpu->util_time;
+	delta_busy = busy_time - pcpu->util_busy;
+	delta_wall = now - pcpu->util_wall;
+	delta_idle = now_idle - pcpu->util_idle;
+	pcpu->util_time = time;
+	pcpu->util_busy = busy_time;
+	pcpu->util_wall = now;
+	pcpu->util_idle = now_idle;
+
+	if (!delta_time)
+		goto out;
+
+	/*
+	 * Busy time cannot accrue while the tick is stopped in idle, so
+	 * after a tickless idle period look at the last tick's worth only.
+	 */
+	if (delta_time > TICK_NSEC)
+		delta_time = TICK_NSEC;
+
+	if (delta_busy >= delta_time)
+		cpu_load = 100;
+	else
+		cpu_load = div64_u64(100 * delta_busy, delta_time);
+
+	/*
+	 * Time in interrupts and softirqs is not charged to any task, so
+	 * also count everything the CPU did not spend idle.
+	 */
+	if (now_idle != -1ULL && delta_wall) {
+		delta_busy = delta_idle < delta_wall ?
+			delta_wall - delta_idle : 0;
+		if (delta_wall > TICK_NSEC / NSEC_PER_USEC)
+			delta_wall = TICK_NSEC / NSEC_PER_USEC;
+		if (delta_busy >= delta_wall)
+			idle_load = 100;
+		else
+			idle_load = div64_u64(100 * delta_busy, delta_wall);
+		if (idle_load > cpu_load)
+			cpu_load = idle_load;
+	}
+
+	cpufreq_interactive_update_target(cpu, pcpu, cpu_load, now, now_idle);
+out:
+	spin_unlock(&pcpu->load_lock);
+}
+
+/* Runs on the CPU being rearmed so the timer stays on that CPU. */
+static void cpufreq_interactive_rearm_timer(void *data)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu =
+		&per_cpu(cpuinfo, smp_processor_id());
+
+	if (!pcpu->governor_enabled || timer_pending(&pcpu->cpu_timer))
+		return;
+
+	pcpu->time_in_idle = get_cpu_idle_time_us(smp_processor_id(),
+						  &pcpu->idle_exit_time);
+	pcpu->timer_idlecancel = 0;
+	mod_timer(&pcpu->cpu_timer,
+		  jiffies + cpufreq_interactive_timer_delay(pcpu));
+}
+
+static void cpufreq_interactive_set_sched_util(int enable)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned int cpu;
+
+	mutex_lock(&sched_util_lock);
+	sched_util_val = enable;
+	for_each_possible_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+		if (!pcpu->governor_enabled)
+			continue;
+
+		pcpu->util_time = 0;
+		cpufreq_set_update_util_data(cpu,
+				enable ? &pcpu->update_util : NULL);
+	}
+	if (enable)
+		goto out;
+
+	synchronize_sched();
+
+	/*
+	 * Busy CPUs had no timer while the tick drove them, give them one
+	 * now rather than waiting for their next idle exit.
+	 */
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+		smp_call_function_single(cpu, cpufreq_interactive_rearm_timer,
+					 NULL, 1);
+	put_online_cpus();
+out:
+	mutex_unlock(&sched_util_lock);
+}
+
 static int cpufreq_interactive_up_task(void *data)
 {
 	unsigned int cpu;
@@ -457,6 +659,9 @@ static int cpufreq_interactive_up_task(void *data)
 			mutex_unlock(&set_speed_lock);
 			trace_cpufreq_interactive_up(cpu, pcpu->target_freq,
 						     pcpu->policy->cur);
+			trace_cpufreq_interactive_latency(cpu,
+				pcpu->target_freq, pcpu->policy->cur,
+				ktime_to_us(ktime_get()) - pcpu->decision_time);
 		}
 	}
 
@@ -502,6 +707,9 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 		mutex_unlock(&set_speed_lock);
 		trace_cpufreq_interactive_down(cpu, pcpu->target_freq,
 					       pcpu->policy->cur);
+		trace_cpufreq_interactive_latency(cpu, pcpu->target_freq,
+			pcpu->policy->cur,
+			ktime_to_us(ktime_get()) - pcpu->decision_time);
 	}
 }
 
@@ -523,6 +731,7 @@ static void cpufreq_interactive_boost(void)
 			pcpu->target_set_time_in_idle =
 				get_cpu_idle_time_us(i, &pcpu->target_set_time);
 			pcpu->hispeed_validate_time = pcpu->target_set_time;
+			pcpu->decision_time = pcpu->target_set_time;
 			anyboost = 1;
 		}
 
@@ -820,6 +1029,28 @@ static ssize_t store_boost(struct kobject *kobj, struct attribute *attr,
 
 define_one_global_rw(boost);
 
+static ssize_t show_sched_util(struct kobject *kobj, struct attribute *attr,
+			       char *buf)
+{
+	return sprintf(buf, "%d\n", sched_util_val);
+}
+
+static ssize_t store_sched_util(struct kobject *kobj, struct attribute *attr,
+				const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	cpufreq_interactive_set_sched_util(!!val);
+	return count;
+}
+
+define_one_global_rw(sched_util);
+
 static ssize_t store_boostpulse(struct kobject *kobj, struct attribute *attr,
 				const char *buf, size_t count)
 {
@@ -874,6 +1105,7 @@ static struct attribute *interactive_attributes[] = {
 	&input_boost.attr,
 	&boost.attr,
 	&boostpulse.attr,
+	&sched_util.attr,
 	NULL,
 };
 
@@ -888,6 +1120,20 @@ static int cpufreq_interactive_idle_notifier(struct notifier_block *nb,
 static struct notifier_block cpufreq_interactive_idle_nb = {
 	.notifier_call = cpufreq_interactive_idle_notifier,
 };
+
+/* Hook the policy's CPUs to the scheduler tick if sched_util is set. */
+static void cpufreq_interactive_start_sched_util(struct cpufreq_policy *policy)
+{
+	unsigned int j;
+
+	mutex_lock(&sched_util_lock);
+	if (sched_util_val)
+		for_each_cpu(j, policy->cpus)
+			cpufreq_set_update_util_data(j,
+				&per_cpu(cpuinfo, j).update_util);
+	mutex_unlock(&sched_util_lock);
+}
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
 {
@@ -921,6 +1167,8 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 				pcpu->target_set_time;
 			pcpu->hispeed_validate_time =
 				pcpu->target_set_time;
+			pcpu->decision_time = pcpu->target_set_time;
+			pcpu->util_time = 0;
 			pcpu->governor_enabled = 1;
 			smp_wmb();
 		}
@@ -932,8 +1180,10 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		 * Do not register the idle hook and create sysfs
 		 * entries if we have already done so.
 		 */
-		if (atomic_inc_return(&active_count) > 1)
+		if (atomic_inc_return(&active_count) > 1) {
+			cpufreq_interactive_start_sched_util(policy);
 			return 0;
+		}
 
 		up_task = kthread_create(cpufreq_interactive_up_task, NULL,
 				"kinteractiveup");
@@ -954,6 +1204,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 				__func__);
 
 		idle_notifier_register(&cpufreq_interactive_idle_nb);
+		cpufreq_interactive_start_sched_util(policy);
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	register_early_suspend(&interactive_early_suspend);
@@ -964,10 +1215,17 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 
 		idle_notifier_unregister(&cpufreq_interactive_idle_nb);
 
+		mutex_lock(&sched_util_lock);
+		for_each_cpu(j, policy->cpus) {
+			per_cpu(cpuinfo, j).governor_enabled = 0;
+			cpufreq_set_update_util_data(j, NULL);
+		}
+		smp_wmb();
+		synchronize_sched();
+		mutex_unlock(&sched_util_lock);
+
 		for_each_cpu(j, policy->cpus) {
 			pcpu = &per_cpu(cpuinfo, j);
-			pcpu->governor_enabled = 0;
-			smp_wmb();
 			del_timer_sync(&pcpu->cpu_timer);
 
 			/*
@@ -1045,6 +1303,8 @@ static int __init cpufreq_interactive_init(void)
 		init_timer(&pcpu->cpu_timer);
 		pcpu->cpu_timer.function = cpufreq_interactive_timer;
 		pcpu->cpu_timer.data = i;
+		spin_lock_init(&pcpu->load_lock);
+		pcpu->update_util.func = cpufreq_interactive_update_util;
 	}
 	/* No rescuer thread, bind to CPU queuing the work for possibly
 	   warm cache (probably doesn't matter much). */
@@ -40,6 +40,7 @@
 #include "exfat.h"
 
 #include <linux/blkdev.h>
+#include <linux/bitops.h>
 
 #define THERE_IS_MBR        0 
 
@@ -93,38 +94,6 @@ static INT8 *reserved_names[] = {
 	NULL
 };
 
-static UINT8 free_bit[] = {
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 7, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0          
-};
-
-static UINT8 used_bit[] = {
-	0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3,
-	2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 1, 2, 2, 3, 2, 3, 3, 4,
-	2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5,
-	4, 5, 5, 6, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-	2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 2, 3, 3, 4,
-	3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6,
-	4, 5, 5, 6, 5, 6, 6, 7, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4,
-	3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-	2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5,
-	4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 2, 3, 3, 4, 3, 4, 4, 5,
-	3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6,
-	5, 6, 6, 7, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-	4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8        
-};
-
 INT32 ffsInit(void)
 {
 	INT32 ret;
@@ -1681,8 +1650,11 @@ void fs_set_vol_flags(struct super_block *sb, UINT32 new_flag)
 
 void fs_sync(struct super_block *sb, INT32 do_sync)
 {
-	if (do_sync)
+	if (do_sync) {
+		FAT_sync(sb);
+		buf_sync(sb);
 		bdev_sync(sb);
+	}
 }
 
 void fs_error(struct super_block *sb)
@@ -1776,17 +1748,197 @@ INT32 fat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_chai
 	return(num_clusters);
 }
 
+static UINT32 amap_sector_bits(struct super_block *sb, INT32 i)
+{
+	UINT32 base, bits;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	bits = p_bd->sector_size << 3;
+	base = ((UINT32) i) << (p_bd->sector_size_bits + 3);
+
+	if (base >= (p_fs->num_clusters - 2))
+		return 0;
+	if ((base + bits) > (p_fs->num_clusters - 2))
+		bits = p_fs->num_clusters - 2 - base;
+
+	return(bits);
+}
+
+static void amap_count_extent(struct super_block *sb, INT32 i)
+{
+	UINT32 bits, start, end;
+	void *map;
+	AMAP_EXTENT_T *ext;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	ext = &(p_fs->vol_aext[i]);
+	map = p_fs->vol_amap[i]->b_data;
+	bits = amap_sector_bits(sb, i);
+
+	ext->num_free = 0;
+	ext->max_run = 0;
+	ext->max_start = 0;
+	ext->tail_run = 0;
+	ext->stale = 0;
+
+	start = find_next_zero_bit_le(map, bits, 0);
+	while (start < bits) {
+		end = find_next_bit_le(map, bits, start);
+
+		ext->num_free += (UINT16) (end - start);
+		if ((end - start) > ext->max_run) {
+			ext->max_run = (UINT16) (end - start);
+			ext->max_start = (UINT16) start;
+		}
+		if (end >= bits)
+			ext->tail_run = (UINT16) (end - start);
+
+		start = find_next_zero_bit_le(map, bits, end);
+	}
+}
+
+static AMAP_EXTENT_T *amap_get_extent(struct super_block *sb, INT32 i)
+{
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if (p_fs->vol_aext[i].stale)
+		amap_count_extent(sb, i);
+
+	return(&(p_fs->vol_aext[i]));
+}
+
+static UINT32 amap_run_len(struct super_block *sb, UINT32 clu, UINT32 max)
+{
+	INT32 i;
+	UINT32 b, bits, end, len = 0;
+	AMAP_EXTENT_T *ext;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	i = clu >> (p_bd->sector_size_bits + 3);
+	b = clu & ((p_bd->sector_size << 3) - 1);
+
+	while ((len < max) && (i < p_fs->map_sectors)) {
+		bits = amap_sector_bits(sb, i);
+		if (b >= bits)
+			break;
+
+		ext = amap_get_extent(sb, i);
+		if ((b == 0) && (ext->num_free == bits)) {
+			len += bits;
+		} else {
+			end = find_next_bit_le(p_fs->vol_amap[i]->b_data, bits, b);
+			len += end - b;
+			if (end < bits)
+				break;
+		}
+
+		i++;
+		b = 0;
+	}
+
+	return((len < max) ? len : max);
+}
+
+static UINT32 amap_find_extent(struct super_block *sb, UINT32 clu, UINT32 want, UINT32 *len)
+{
+	INT32 i, n, s;
+	UINT32 base, start, run, best = CLUSTER_32(~0), best_len = 0;
+	AMAP_EXTENT_T *ext;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	s = clu >> (p_bd->sector_size_bits + 3);
+	if (s >= p_fs->map_sectors)
+		s = 0;
+
+	for (n = 0; n < p_fs->map_sectors; n++) {
+		i = s + n;
+		if (i >= p_fs->map_sectors)
+			i -= p_fs->map_sectors;
+
+		ext = amap_get_extent(sb, i);
+		if (ext->num_free == 0)
+			continue;
+
+		base = ((UINT32) i) << (p_bd->sector_size_bits + 3);
+
+		if (ext->max_run >= want) {
+			*len = ext->max_run;
+			return(base + ext->max_start);
+		}
+		if (ext->max_run > best_len) {
+			best = base + ext->max_start;
+			best_len = ext->max_run;
+		}
+
+		if (ext->tail_run > 0) {
+			start = base + amap_sector_bits(sb, i) - ext->tail_run;
+			run = amap_run_len(sb, start, want);
+			if (run >= want) {
+				*len = run;
+				return(start);
+			}
+			if (run > best_len) {
+				best = start;
+				best_len = run;
+			}
+		}
+	}
+
+	*len = best_len;
+	return(best);
+}
+
+static INT32 amap_set_run(struct super_block *sb, UINT32 clu, UINT32 len)
+{
+	INT32 i, ret;
+	UINT32 b, n, sector;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	while (len > 0) {
+		i = clu >> (p_bd->sector_size_bits + 3);
+		b = clu & ((p_bd->sector_size << 3) - 1);
+
+		n = (p_bd->sector_size << 3) - b;
+		if (n > len)
+			n = len;
+
+		Bitmap_nbits_set((UINT8 *) p_fs->vol_amap[i]->b_data, b, n);
+		p_fs->vol_aext[i].stale = 1;
+
+		sector = START_SECTOR(p_fs->map_clu) + i;
+		ret = sector_write(sb, sector, p_fs->vol_amap[i], 0);
+		if (ret != FFS_SUCCESS)
+			return ret;
+
+		clu += n;
+		len -= n;
+	}
+
+	return FFS_SUCCESS;
+}
+
 INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_chain)
 {
 	INT32 num_clusters = 0;
 	UINT32 hint_clu, new_clu, last_clu = CLUSTER_32(~0);
+	UINT32 len, want;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
+	if (num_alloc <= 0)
+		return 0;
+
+	want = (num_alloc > ALLOC_MIN_EXTENT) ? num_alloc : ALLOC_MIN_EXTENT;
+
 	hint_clu = p_chain->dir;
 	if (hint_clu == CLUSTER_32(~0)) {
-		hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
+		hint_clu = amap_find_extent(sb, p_fs->clu_srch_ptr-2, want, &len);
 		if (hint_clu == CLUSTER_32(~0))
 			return 0;
+		hint_clu += 2;
 	} else if (hint_clu >= p_fs->num_clusters) {
 		hint_clu = 2;
 		p_chain->flags = 0x01;
@@ -1796,21 +1948,32 @@ INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_ch
 	
 	p_chain->dir = CLUSTER_32(~0);
 
-	while ((new_clu = test_alloc_bitmap(sb, hint_clu-2)) != CLUSTER_32(~0)) {
-		if (new_clu != hint_clu) {
+	while (num_alloc > 0) {
+		len = amap_run_len(sb, hint_clu-2, num_alloc);
+		if (len > 0) {
+			new_clu = hint_clu;
+		} else {
+			new_clu = amap_find_extent(sb, hint_clu-2, want, &len);
+			if (new_clu == CLUSTER_32(~0))
+				break;
+			new_clu += 2;
+			if (len > (UINT32) num_alloc)
+				len = num_alloc;
+
 			if (p_chain->flags == 0x03) {
 				exfat_chain_cont_cluster(sb, p_chain->dir, num_clusters);
 				p_chain->flags = 0x01;
 			}
 		}
 
-		if (set_alloc_bitmap(sb, new_clu-2) != FFS_SUCCESS)
+		if (amap_set_run(sb, new_clu-2, len) != FFS_SUCCESS)
 			return 0;
 
-		num_clusters++;
+		num_clusters += len;
+		num_alloc -= len;
 
 		if (p_chain->flags == 0x01)
-			FAT_write(sb, new_clu, CLUSTER_32(~0));
+			exfat_chain_cont_cluster(sb, new_clu, len);
 
 		if (p_chain->dir == CLUSTER_32(~0)) {
 			p_chain->dir = new_clu;
@@ -1818,22 +1981,13 @@ INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_ch
 			if (p_chain->flags == 0x01)
 				FAT_write(sb, last_clu, new_clu);
 		}
-		last_clu = new_clu;
-
-		if ((--num_alloc) == 0) {
-			p_fs->clu_srch_ptr = hint_clu;
-			if (p_fs->used_clusters != (UINT32) ~0)
-				p_fs->used_clusters += num_clusters;
-
-			p_chain->size += num_clusters;
-			return(num_clusters);
-		}
+		last_clu = new_clu + len - 1;
 
-		hint_clu = new_clu + 1;
+		hint_clu = last_clu + 1;
 		if (hint_clu >= p_fs->num_clusters) {
 			hint_clu = 2;
 
-			if (p_chain->flags == 0x03) {
+			if ((num_alloc > 0) && (p_chain->flags == 0x03)) {
 				exfat_chain_cont_cluster(sb, p_chain->dir, num_clusters);
 				p_chain->flags = 0x01;
 			}
@@ -2013,22 +2167,13 @@ INT32 fat_count_used_clusters(struct super_block *sb)
 
 INT32 exfat_count_used_clusters(struct super_block *sb)
 {
-	INT32 i, map_i, map_b, count = 0;
-	UINT8 k;
+	INT32 i, count;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
-	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
 
-	map_i = map_b = 0;
+	count = p_fs->num_clusters - 2;
 
-	for (i = 2; i < p_fs->num_clusters; i += 8) {
-		k = *(((UINT8 *) p_fs->vol_amap[map_i]->b_data) + map_b);
-		count += used_bit[k];
-
-		if ((++map_b) >= p_bd->sector_size) {
-			map_i++;
-			map_b = 0;
-		}
-	}
+	for (i = 0; i < p_fs->map_sectors; i++)
+		count -= amap_get_extent(sb, i)->num_free;
 
 	return(count);
 }
@@ -2101,6 +2246,19 @@ INT32 load_alloc_bitmap(struct super_block *sb)
 					}
 				}
 
+				p_fs->vol_aext = (AMAP_EXTENT_T *) MALLOC(sizeof(AMAP_EXTENT_T) * p_fs->map_sectors);
+				if (p_fs->vol_aext == NULL) {
+					for (j = 0; j < p_fs->map_sectors; j++)
+						brelse(p_fs->vol_amap[j]);
+
+					FREE(p_fs->vol_amap);
+					p_fs->vol_amap = NULL;
+					return FFS_MEMORYERR;
+				}
+
+				for (j = 0; j < p_fs->map_sectors; j++)
+					amap_count_extent(sb, j);
+
 				p_fs->pbr_bh = NULL;
 				return FFS_SUCCESS;
 			}
@@ -2126,6 +2284,8 @@ void free_alloc_bitmap(struct super_block *sb)
 
 	FREE(p_fs->vol_amap);
 	p_fs->vol_amap = NULL;
+	FREE(p_fs->vol_aext);
+	p_fs->vol_aext = NULL;
 }
 
 INT32 set_alloc_bitmap(struct super_block *sb, UINT32 clu)
@@ -2141,6 +2301,7 @@ INT32 set_alloc_bitmap(struct super_block *sb, UINT32 clu)
 	sector = START_SECTOR(p_fs->map_clu) + i;
 
 	Bitmap_set((UINT8 *) p_fs->vol_amap[i]->b_data, b);
+	p_fs->vol_aext[i].stale = 1;
 
 	return (sector_write(sb, sector, p_fs->vol_amap[i], 0));
 } 
@@ -2163,6 +2324,7 @@ INT32 clr_alloc_bitmap(struct super_block *sb, UINT32 clu)
 	sector = START_SECTOR(p_fs->map_clu) + i;
 
 	Bitmap_clear((UINT8 *) p_fs->vol_amap[i]->b_data, b);
+	p_fs->vol_aext[i].stale = 1;
 
 	return (sector_write(sb, sector, p_fs->vol_amap[i], 0));
 
@@ -2183,38 +2345,30 @@ INT32 clr_alloc_bitmap(struct super_block *sb, UINT32 clu)
 
 UINT32 test_alloc_bitmap(struct super_block *sb, UINT32 clu)
 {
-	INT32 i, map_i, map_b;
-	UINT32 clu_base, clu_free;
-	UINT8 k, clu_mask;
+	INT32 i, n, s;
+	UINT32 b, bits;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
 
-	clu_base = (clu & ~(0x7)) + 2;
-	clu_mask = (1 << (clu - clu_base + 2)) - 1;
+	s = clu >> (p_bd->sector_size_bits + 3);
+	b = clu & ((p_bd->sector_size << 3) - 1);
+	if (s >= p_fs->map_sectors)
+		s = b = 0;
 
-	map_i = clu >> (p_bd->sector_size_bits + 3);
-	map_b = (clu >> 3) & p_bd->sector_size_mask;
+	for (n = 0; n <= p_fs->map_sectors; n++) {
+		i = s + n;
+		if (i >= p_fs->map_sectors)
+			i -= p_fs->map_sectors;
+		if (n > 0)
+			b = 0;
 
-	for (i = 2; i < p_fs->num_clusters; i += 8) {
-		k = *(((UINT8 *) p_fs->vol_amap[map_i]->b_data) + map_b);
-		if (clu_mask > 0) {
-			k |= clu_mask;
-			clu_mask = 0;
-		}
-		if (k < 0xFF) {
-			clu_free = clu_base + free_bit[k];
-			if (clu_free < p_fs->num_clusters)
-				return(clu_free);
-		}
-		clu_base += 8;
+		if (amap_get_extent(sb, i)->num_free == 0)
+			continue;
 
-		if (((++map_b) >= p_bd->sector_size) || (clu_base >= p_fs->num_clusters)) {
-			if ((++map_i) >= p_fs->map_sectors) {
-				clu_base = 2;
-				map_i = 0;
-			}
-			map_b = 0;
-		}
+		bits = amap_sector_bits(sb, i);
+		b = find_next_zero_bit_le(p_fs->vol_amap[i]->b_data, bits, b);
+		if (b < bits)
+			return((((UINT32) i) << (p_bd->sector_size_bits + 3)) + b + 2);
 	}
 
 	return(CLUSTER_32(~0));
@@ -4948,3 +5102,28 @@ INT32 multi_sector_write(struct super_block *sb, UINT32 sec, struct buffer_head
 
 	return ret;
 } 
+
+void sector_readahead(struct super_block *sb, UINT32 sec, INT32 num_secs)
+{
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if ((p_fs->num_sectors > 0) && ((sec+num_secs) > (p_fs->PBR_sector+p_fs->num_sectors)))
+		num_secs = p_fs->PBR_sector + p_fs->num_sectors - sec;
+
+	if (!p_fs->dev_ejected && (num_secs > 0))
+		bdev_readahead(sb, sec, num_secs);
+}
+
+INT32 sector_sync_bhs(struct super_block *sb, struct buffer_head **bhs, INT32 num_bhs)
+{
+	INT32 ret = FFS_MEDIAERR;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if (!p_fs->dev_ejected) {
+		ret = bdev_write_bhs(sb, bhs, num_bhs);
+		if (ret != FFS_SUCCESS)
+			p_fs->dev_ejected = TRUE;
+	}
+
+	return ret;
+} 
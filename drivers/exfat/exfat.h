@@ -357,6 +357,14 @@ extern "C" {
 		CHAIN_T     clu;
 	} UENTRY_T;
 
+	typedef struct {
+		UINT16      num_free;               
+		UINT16      max_run;                
+		UINT16      max_start;              
+		UINT16      tail_run;               
+		UINT16      stale;                  
+	} AMAP_EXTENT_T;
+
 	typedef struct __FS_STRUCT_T {
 		UINT32      mounted;
 		struct super_block *sb;
@@ -421,6 +429,7 @@ extern "C" {
 		UINT32      map_clu;                
 		UINT32      map_sectors;            
 		struct buffer_head **vol_amap;      
+		AMAP_EXTENT_T *vol_aext;            
 
 		UINT16      **vol_utbl;               
 
@@ -432,13 +441,23 @@ extern "C" {
 
 		FS_FUNC_T	*fs_func;
 
-		BUF_CACHE_T FAT_cache_array[FAT_CACHE_SIZE];
+		BUF_CACHE_T *FAT_cache_array;
 		BUF_CACHE_T FAT_cache_lru_list;
-		BUF_CACHE_T FAT_cache_hash_list[FAT_CACHE_HASH_SIZE];
+		BUF_CACHE_T *FAT_cache_hash_list;
+		UINT32      FAT_cache_size;
+		UINT32      FAT_cache_hash_size;
+		UINT32      FAT_ra_start;
+		UINT32      FAT_ra_end;
 
-		BUF_CACHE_T buf_cache_array[BUF_CACHE_SIZE];
+		BUF_CACHE_T *buf_cache_array;
 		BUF_CACHE_T buf_cache_lru_list;
-		BUF_CACHE_T buf_cache_hash_list[BUF_CACHE_HASH_SIZE];
+		BUF_CACHE_T *buf_cache_hash_list;
+		UINT32      buf_cache_size;
+		UINT32      buf_cache_hash_size;
+		UINT32      buf_ra_start;
+		UINT32      buf_ra_end;
+
+		struct buffer_head **cache_sync_bhs;
 	} FS_INFO_T;
 
 #define ES_2_ENTRIES		2
@@ -590,6 +609,8 @@ extern "C" {
 	INT32   sector_write(struct super_block *sb, UINT32 sec, struct buffer_head *bh, INT32 sync);
 	INT32   multi_sector_read(struct super_block *sb, UINT32 sec, struct buffer_head **bh, INT32 num_secs, INT32 read);
 	INT32   multi_sector_write(struct super_block *sb, UINT32 sec, struct buffer_head *bh, INT32 num_secs, INT32 sync);
+	void    sector_readahead(struct super_block *sb, UINT32 sec, INT32 num_secs);
+	INT32   sector_sync_bhs(struct super_block *sb, struct buffer_head **bhs, INT32 num_bhs);
 
 #ifdef __cplusplus
 }
@@ -17,6 +17,7 @@
  */
 
 #include <linux/blkdev.h>
+#include <linux/sort.h>
 
 #include "exfat_config.h"
 #include "exfat_global.h"
@@ -140,6 +141,63 @@ no_bh:
 	return (FFS_MEDIAERR);
 }
 
+INT32 bdev_readahead(struct super_block *sb, UINT32 secno, UINT32 num_secs)
+{
+	UINT32 i;
+	struct blk_plug plug;
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	if (!p_bd->opened) return(FFS_MEDIAERR);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < num_secs; i++)
+		__breadahead(sb->s_bdev, secno + i, p_bd->sector_size);
+	blk_finish_plug(&plug);
+
+	return(FFS_SUCCESS);
+}
+
+static int bdev_bh_cmp(const void *a, const void *b)
+{
+	sector_t x = (*(struct buffer_head **) a)->b_blocknr;
+	sector_t y = (*(struct buffer_head **) b)->b_blocknr;
+
+	if (x < y) return -1;
+	return (x > y);
+}
+
+INT32 bdev_write_bhs(struct super_block *sb, struct buffer_head **bhs, UINT32 num_bhs)
+{
+	UINT32 i;
+	INT32 ret = FFS_SUCCESS;
+	struct blk_plug plug;
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+#if EXFAT_CONFIG_KERNEL_DEBUG
+	struct exfat_sb_info *sbi = EXFAT_SB(sb);
+	long flags = sbi->debug_flags;
+
+	if (flags & EXFAT_DEBUGFLAGS_ERROR_RW)	return (FFS_MEDIAERR);
+#endif
+
+	if (!p_bd->opened) return(FFS_MEDIAERR);
+
+	/* submit in sector order under one plug so that neighbours merge */
+	sort(bhs, num_bhs, sizeof(struct buffer_head *), bdev_bh_cmp, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < num_bhs; i++)
+		write_dirty_buffer(bhs[i], WRITE_SYNC);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < num_bhs; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			ret = FFS_MEDIAERR;
+	}
+
+	return(ret);
+}
+
 INT32 bdev_sync(struct super_block *sb)
 {
 	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
@@ -39,6 +39,8 @@ extern "C" {
 	INT32 bdev_close(struct super_block *sb);
 	INT32 bdev_read(struct super_block *sb, UINT32 secno, struct buffer_head **bh, UINT32 num_secs, INT32 read);
 	INT32 bdev_write(struct super_block *sb, UINT32 secno, struct buffer_head *bh, UINT32 num_secs, INT32 sync);
+	INT32 bdev_readahead(struct super_block *sb, UINT32 secno, UINT32 num_secs);
+	INT32 bdev_write_bhs(struct super_block *sb, struct buffer_head **bhs, UINT32 num_bhs);
 	INT32 bdev_sync(struct super_block *sb);
 #ifdef __cplusplus
 }
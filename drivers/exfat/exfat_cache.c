@@ -44,20 +44,77 @@ static BUF_CACHE_T *buf_cache_get(struct super_block *sb, UINT32 sec);
 static void buf_cache_insert_hash(struct super_block *sb, BUF_CACHE_T *bp);
 static void buf_cache_remove_hash(BUF_CACHE_T *bp);
 
+static void FAT_readahead(struct super_block *sb, UINT32 sec);
+static void buf_readahead(struct super_block *sb, UINT32 sec);
+
 static void push_to_mru(BUF_CACHE_T *bp, BUF_CACHE_T *list);
 static void push_to_lru(BUF_CACHE_T *bp, BUF_CACHE_T *list);
 static void move_to_mru(BUF_CACHE_T *bp, BUF_CACHE_T *list);
 static void move_to_lru(BUF_CACHE_T *bp, BUF_CACHE_T *list);
 
+static void buf_free_caches(FS_INFO_T *p_fs)
+{
+	FREE(p_fs->FAT_cache_array);
+	FREE(p_fs->FAT_cache_hash_list);
+	FREE(p_fs->buf_cache_array);
+	FREE(p_fs->buf_cache_hash_list);
+	FREE(p_fs->cache_sync_bhs);
+
+	p_fs->FAT_cache_array = NULL;
+	p_fs->FAT_cache_hash_list = NULL;
+	p_fs->buf_cache_array = NULL;
+	p_fs->buf_cache_hash_list = NULL;
+	p_fs->cache_sync_bhs = NULL;
+}
+
 INT32 buf_init(struct super_block *sb)
 {
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	INT32 i;
+	UINT64 vol_gb;
+	UINT32 scale = 0;
+
+	/* double the caches for every 4x of volume size from 4GB up */
+	vol_gb = i_size_read(sb->s_bdev->bd_inode) >> 30;
+	while (vol_gb >= 4) {
+		scale++;
+		vol_gb >>= 2;
+	}
+
+	p_fs->FAT_cache_size = FAT_CACHE_SIZE << scale;
+	if (p_fs->FAT_cache_size > FAT_CACHE_MAX_SIZE)
+		p_fs->FAT_cache_size = FAT_CACHE_MAX_SIZE;
+	p_fs->FAT_cache_hash_size = p_fs->FAT_cache_size >> 1;
+	if (p_fs->FAT_cache_hash_size < FAT_CACHE_HASH_SIZE)
+		p_fs->FAT_cache_hash_size = FAT_CACHE_HASH_SIZE;
+
+	p_fs->buf_cache_size = BUF_CACHE_SIZE << scale;
+	if (p_fs->buf_cache_size > BUF_CACHE_MAX_SIZE)
+		p_fs->buf_cache_size = BUF_CACHE_MAX_SIZE;
+	p_fs->buf_cache_hash_size = p_fs->buf_cache_size >> 2;
+	if (p_fs->buf_cache_hash_size < BUF_CACHE_HASH_SIZE)
+		p_fs->buf_cache_hash_size = BUF_CACHE_HASH_SIZE;
+
+	p_fs->FAT_cache_array = MALLOC(p_fs->FAT_cache_size * sizeof(BUF_CACHE_T));
+	p_fs->FAT_cache_hash_list = MALLOC(p_fs->FAT_cache_hash_size * sizeof(BUF_CACHE_T));
+	p_fs->buf_cache_array = MALLOC(p_fs->buf_cache_size * sizeof(BUF_CACHE_T));
+	p_fs->buf_cache_hash_list = MALLOC(p_fs->buf_cache_hash_size * sizeof(BUF_CACHE_T));
+	p_fs->cache_sync_bhs = MALLOC(MAX(p_fs->FAT_cache_size, p_fs->buf_cache_size) * sizeof(struct buffer_head *));
+
+	if (!p_fs->FAT_cache_array || !p_fs->FAT_cache_hash_list ||
+	    !p_fs->buf_cache_array || !p_fs->buf_cache_hash_list ||
+	    !p_fs->cache_sync_bhs) {
+		buf_free_caches(p_fs);
+		return(FFS_MEMORYERR);
+	}
+
+	p_fs->FAT_ra_start = p_fs->FAT_ra_end = 0;
+	p_fs->buf_ra_start = p_fs->buf_ra_end = 0;
 
 	p_fs->FAT_cache_lru_list.next = p_fs->FAT_cache_lru_list.prev = &p_fs->FAT_cache_lru_list;
 
-	for (i = 0; i < FAT_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->FAT_cache_size; i++) {
 		p_fs->FAT_cache_array[i].drv = -1;
 		p_fs->FAT_cache_array[i].sec = ~0;
 		p_fs->FAT_cache_array[i].flag = 0;
@@ -68,7 +125,7 @@ INT32 buf_init(struct super_block *sb)
 
 	p_fs->buf_cache_lru_list.next = p_fs->buf_cache_lru_list.prev = &p_fs->buf_cache_lru_list;
 
-	for (i = 0; i < BUF_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->buf_cache_size; i++) {
 		p_fs->buf_cache_array[i].drv = -1;
 		p_fs->buf_cache_array[i].sec = ~0;
 		p_fs->buf_cache_array[i].flag = 0;
@@ -77,23 +134,23 @@ INT32 buf_init(struct super_block *sb)
 		push_to_mru(&(p_fs->buf_cache_array[i]), &p_fs->buf_cache_lru_list);
 	}
 
-	for (i = 0; i < FAT_CACHE_HASH_SIZE; i++) {
+	for (i = 0; i < p_fs->FAT_cache_hash_size; i++) {
 		p_fs->FAT_cache_hash_list[i].drv = -1;
 		p_fs->FAT_cache_hash_list[i].sec = ~0;
 		p_fs->FAT_cache_hash_list[i].hash_next = p_fs->FAT_cache_hash_list[i].hash_prev = &(p_fs->FAT_cache_hash_list[i]);
 	}
 
-	for (i = 0; i < FAT_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->FAT_cache_size; i++) {
 		FAT_cache_insert_hash(sb, &(p_fs->FAT_cache_array[i]));
 	}
 
-	for (i = 0; i < BUF_CACHE_HASH_SIZE; i++) {
+	for (i = 0; i < p_fs->buf_cache_hash_size; i++) {
 		p_fs->buf_cache_hash_list[i].drv = -1;
 		p_fs->buf_cache_hash_list[i].sec = ~0;
 		p_fs->buf_cache_hash_list[i].hash_next = p_fs->buf_cache_hash_list[i].hash_prev = &(p_fs->buf_cache_hash_list[i]);
 	}
 
-	for (i = 0; i < BUF_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->buf_cache_size; i++) {
 		buf_cache_insert_hash(sb, &(p_fs->buf_cache_array[i]));
 	}
 
@@ -102,6 +159,10 @@ INT32 buf_init(struct super_block *sb)
 
 INT32 buf_shutdown(struct super_block *sb)
 {
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	buf_free_caches(p_fs);
+
 	return(FFS_SUCCESS);
 }
 
@@ -361,6 +422,8 @@ UINT8 *FAT_getblk(struct super_block *sb, UINT32 sec)
 		return(bp->buf_bh->b_data);
 	}
 
+	FAT_readahead(sb, sec);
+
 	bp = FAT_cache_get(sb, sec);
 
 	FAT_cache_remove_hash(bp);
@@ -392,6 +455,7 @@ void FAT_modify(struct super_block *sb, UINT32 sec)
 	bp = FAT_cache_find(sb, sec);
 	if (bp != NULL) {
 		sector_write(sb, sec, bp->buf_bh, 0);
+		bp->flag |= DIRTYBIT;
 	}
 }
 
@@ -422,6 +486,7 @@ void FAT_release_all(struct super_block *sb)
 
 void FAT_sync(struct super_block *sb)
 {
+	INT32 n = 0;
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
@@ -430,12 +495,16 @@ void FAT_sync(struct super_block *sb)
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
 		if ((bp->drv == p_fs->drv) && (bp->flag & DIRTYBIT)) {
-			sync_dirty_buffer(bp->buf_bh);
+			if (bp->buf_bh)
+				p_fs->cache_sync_bhs[n++] = bp->buf_bh;
 			bp->flag &= ~(DIRTYBIT);
 		}
 		bp = bp->next;
 	}
 
+	if (n > 0)
+		sector_sync_bhs(sb, p_fs->cache_sync_bhs, n);
+
 	sm_V(&f_sem);
 }
 
@@ -445,7 +514,7 @@ static BUF_CACHE_T *FAT_cache_find(struct super_block *sb, UINT32 sec)
 	BUF_CACHE_T *bp, *hp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (FAT_CACHE_HASH_SIZE - 1);
+	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (p_fs->FAT_cache_hash_size - 1);
 
 	hp = &(p_fs->FAT_cache_hash_list[off]);
 	for (bp = hp->hash_next; bp != hp; bp = bp->hash_next) {
@@ -480,7 +549,7 @@ static void FAT_cache_insert_hash(struct super_block *sb, BUF_CACHE_T *bp)
 	FS_INFO_T *p_fs;
 
 	p_fs = &(EXFAT_SB(sb)->fs_info);
-	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (FAT_CACHE_HASH_SIZE-1);
+	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (p_fs->FAT_cache_hash_size - 1);
 
 	hp = &(p_fs->FAT_cache_hash_list[off]);
 	bp->hash_next = hp->hash_next;
@@ -519,6 +588,8 @@ static UINT8 *__buf_getblk(struct super_block *sb, UINT32 sec)
 		return(bp->buf_bh->b_data);
 	}
 
+	buf_readahead(sb, sec);
+
 	bp = buf_cache_get(sb, sec);
 
 	buf_cache_remove_hash(bp);
@@ -553,6 +624,7 @@ void buf_modify(struct super_block *sb, UINT32 sec)
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) {
 		sector_write(sb, sec, bp->buf_bh, 0);
+		bp->flag |= DIRTYBIT;
 	}
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
@@ -639,6 +711,7 @@ void buf_release_all(struct super_block *sb)
 
 void buf_sync(struct super_block *sb)
 {
+	INT32 n = 0;
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
@@ -647,12 +720,16 @@ void buf_sync(struct super_block *sb)
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
 		if ((bp->drv == p_fs->drv) && (bp->flag & DIRTYBIT)) {
-			sync_dirty_buffer(bp->buf_bh);
+			if (bp->buf_bh)
+				p_fs->cache_sync_bhs[n++] = bp->buf_bh;
 			bp->flag &= ~(DIRTYBIT);
 		}
 		bp = bp->next;
 	}
 
+	if (n > 0)
+		sector_sync_bhs(sb, p_fs->cache_sync_bhs, n);
+
 	sm_V(&b_sem);
 }
 
@@ -662,7 +739,7 @@ static BUF_CACHE_T *buf_cache_find(struct super_block *sb, UINT32 sec)
 	BUF_CACHE_T *bp, *hp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (BUF_CACHE_HASH_SIZE - 1);
+	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (p_fs->buf_cache_hash_size - 1);
 
 	hp = &(p_fs->buf_cache_hash_list[off]);
 	for (bp = hp->hash_next; bp != hp; bp = bp->hash_next) {
@@ -694,7 +771,7 @@ static void buf_cache_insert_hash(struct super_block *sb, BUF_CACHE_T *bp)
 	FS_INFO_T *p_fs;
 
 	p_fs = &(EXFAT_SB(sb)->fs_info);
-	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (BUF_CACHE_HASH_SIZE-1);
+	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (p_fs->buf_cache_hash_size - 1);
 
 	hp = &(p_fs->buf_cache_hash_list[off]);
 	bp->hash_next = hp->hash_next;
@@ -709,6 +786,62 @@ static void buf_cache_remove_hash(BUF_CACHE_T *bp)
 	(bp->hash_next)->hash_prev = bp->hash_prev;
 }
 
+/*
+ * On a cache miss, start reading the sectors that follow in the same
+ * contiguous region so that walking it sequentially does not turn into one
+ * small read per sector. The sectors land in the block device page cache;
+ * later misses pick them up from there without going to the media.
+ */
+static void FAT_readahead(struct super_block *sb, UINT32 sec)
+{
+	UINT32 end;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if ((sec >= p_fs->FAT_ra_start) && (sec < p_fs->FAT_ra_end))
+		return;
+
+	end = p_fs->FAT1_start_sector + p_fs->num_FAT_sectors;
+	if ((sec < p_fs->FAT1_start_sector) || (sec >= end))
+		return;
+	if (end > sec + FAT_RA_SECTORS)
+		end = sec + FAT_RA_SECTORS;
+
+	p_fs->FAT_ra_start = sec;
+	p_fs->FAT_ra_end = end;
+
+	if (end - sec > 1)
+		sector_readahead(sb, sec, end - sec);
+}
+
+static void buf_readahead(struct super_block *sb, UINT32 sec)
+{
+	UINT32 end;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if ((sec >= p_fs->buf_ra_start) && (sec < p_fs->buf_ra_end))
+		return;
+
+	if ((p_fs->root_start_sector < p_fs->data_start_sector) &&
+	    (sec >= p_fs->root_start_sector) && (sec < p_fs->data_start_sector)) {
+		/* FAT12/16 root directory */
+		end = p_fs->data_start_sector;
+	} else if ((p_fs->sectors_per_clu > 1) && (sec >= p_fs->data_start_sector)) {
+		/* rest of the cluster, the next one may be anywhere */
+		end = ((sec - p_fs->data_start_sector) | (p_fs->sectors_per_clu - 1)) + 1;
+		end += p_fs->data_start_sector;
+	} else {
+		return;
+	}
+	if (end > sec + BUF_RA_SECTORS)
+		end = sec + BUF_RA_SECTORS;
+
+	p_fs->buf_ra_start = sec;
+	p_fs->buf_ra_end = end;
+
+	if (end - sec > 1)
+		sector_readahead(sb, sec, end - sec);
+}
+
 static void push_to_mru(BUF_CACHE_T *bp, BUF_CACHE_T *list)
 {
 	bp->next = list->next;
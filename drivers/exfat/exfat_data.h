@@ -28,9 +28,14 @@ extern "C" {
 #define MAX_OPEN                20
 #define MAX_DENTRY              512
 #define FAT_CACHE_SIZE          128
+#define FAT_CACHE_MAX_SIZE      512
 #define FAT_CACHE_HASH_SIZE     64
 #define BUF_CACHE_SIZE          256
+#define BUF_CACHE_MAX_SIZE      1024
 #define BUF_CACHE_HASH_SIZE     64
+#define FAT_RA_SECTORS          32
+#define BUF_RA_SECTORS          32
+#define ALLOC_MIN_EXTENT        32
 #define DEFAULT_CODEPAGE        437
 #define DEFAULT_IOCHARSET       "utf8"
 #ifdef __cplusplus
@@ -69,20 +69,32 @@ void Bitmap_clear(UINT8 *bitmap, INT32 i)
 
 void Bitmap_nbits_set(UINT8 *bitmap, INT32 offset, INT32 nbits)
 {
-	INT32   i;
-
-	for (i = 0; i < nbits; i++) {
-		Bitmap_set(bitmap, offset+i);
+	while ((nbits > 0) && BITMAP_SHIFT(offset)) {
+		Bitmap_set(bitmap, offset++);
+		nbits--;
+	}
+	if (nbits >= 8) {
+		MEMSET(bitmap + BITMAP_LOC(offset), 0xFF, BITMAP_LOC(nbits));
+		offset += nbits & ~0x07;
+		nbits &= 0x07;
 	}
+	while (nbits-- > 0)
+		Bitmap_set(bitmap, offset++);
 }
 
 void Bitmap_nbits_clear(UINT8 *bitmap, INT32 offset, INT32 nbits)
 {
-	INT32   i;
-
-	for (i = 0; i < nbits; i++) {
-		Bitmap_clear(bitmap, offset+i);
+	while ((nbits > 0) && BITMAP_SHIFT(offset)) {
+		Bitmap_clear(bitmap, offset++);
+		nbits--;
+	}
+	if (nbits >= 8) {
+		MEMSET(bitmap + BITMAP_LOC(offset), 0x0, BITMAP_LOC(nbits));
+		offset += nbits & ~0x07;
+		nbits &= 0x07;
 	}
+	while (nbits-- > 0)
+		Bitmap_clear(bitmap, offset++);
 }
 
 void my_itoa(INT8 *buf, INT32 v)
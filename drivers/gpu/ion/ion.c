@@ -99,6 +99,7 @@ static void ion_buffer_destroy(struct kref *kref)
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
+	kfree(buffer->dirty);
 	kfree(buffer);
 }
 
@@ -778,6 +779,61 @@ static int ion_share_release(struct inode *inode, struct file* file)
 	return 0;
 }
 
+/*
+ * Cached mappings of heaps that provide user_pfn are populated one page at
+ * a time from ion_vm_fault(), which marks the page in buffer->dirty.  Cache
+ * maintenance then only has to cover the pages the cpu touched since the
+ * last time, and zaps them again so the next access is noticed.  This only
+ * works while the faulting mapping is the only mapping of the buffer, any
+ * other mapping marks the whole buffer dirty and the maintenance falls
+ * back to the full range.
+ *
+ * buffer->lock nests inside mmap_sem, as in the fault path.
+ */
+static void ion_buffer_add_vma(struct ion_buffer *buffer,
+			       struct vm_area_struct *vma)
+{
+	int n_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+
+	mutex_lock(&buffer->lock);
+	if (++buffer->vma_count > 1 && buffer->dirty)
+		bitmap_fill(buffer->dirty, n_pages);
+	mutex_unlock(&buffer->lock);
+}
+
+static void ion_buffer_del_vma(struct ion_buffer *buffer,
+			       struct vm_area_struct *vma)
+{
+	mutex_lock(&buffer->lock);
+	buffer->vma_count--;
+	if (buffer->fault_vma == vma)
+		buffer->fault_vma = NULL;
+	mutex_unlock(&buffer->lock);
+}
+
+static int ion_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	unsigned long pfn;
+	int ret;
+
+	/* vm_insert_pfn() cannot back a private (cow) mapping */
+	if (!buffer->heap->ops->user_pfn || !(vma->vm_flags & VM_SHARED) ||
+	    vmf->pgoff >= (PAGE_ALIGN(buffer->size) >> PAGE_SHIFT))
+		return VM_FAULT_SIGBUS;
+
+	mutex_lock(&buffer->lock);
+	if (buffer->dirty)
+		set_bit(vmf->pgoff, buffer->dirty);
+	pfn = buffer->heap->ops->user_pfn(buffer->heap, buffer, vmf->pgoff);
+	ret = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
+	mutex_unlock(&buffer->lock);
+
+	if (ret && ret != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+
 static void ion_vma_open(struct vm_area_struct *vma)
 {
 
@@ -786,6 +842,7 @@ static void ion_vma_open(struct vm_area_struct *vma)
 	struct ion_client *client;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
+	ion_buffer_add_vma(buffer, vma);
 	/* check that the client still exists and take a reference so
 	   it can't go away until this vma is closed */
 	client = ion_client_lookup(buffer->dev, current->group_leader);
@@ -807,6 +864,7 @@ static void ion_vma_close(struct vm_area_struct *vma)
 	struct ion_client *client;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
+	ion_buffer_del_vma(buffer, vma);
 	/* this indicates the client is gone, nothing to do here */
 	if (!handle)
 		return;
@@ -828,8 +886,23 @@ static void ion_vma_close(struct vm_area_struct *vma)
 static struct vm_operations_struct ion_vm_ops = {
 	.open = ion_vma_open,
 	.close = ion_vma_close,
+	.fault = ion_vm_fault,
 };
 
+/* this function should only be called while buffer->lock is held */
+static int ion_buffer_init_dirty(struct ion_buffer *buffer)
+{
+	int n_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+
+	if (buffer->dirty)
+		return 0;
+	buffer->dirty = kzalloc(BITS_TO_LONGS(n_pages) * sizeof(unsigned long),
+				GFP_KERNEL);
+	if (!buffer->dirty)
+		return -ENOMEM;
+	return 0;
+}
+
 static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct ion_buffer *buffer = file->private_data;
@@ -872,8 +945,25 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 	}
 
 	mutex_lock(&buffer->lock);
-	/* now map it to userspace */
-	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+	if (buffer->map_cacheable && buffer->heap->ops->user_pfn &&
+	    (vma->vm_flags & VM_SHARED)) {
+		/*
+		 * Leave it to ion_vm_fault, which tracks dirty pages.  Private
+		 * mappings are cow and can't be filled with vm_insert_pfn(),
+		 * they go through map_user below.
+		 */
+		ret = ion_buffer_init_dirty(buffer);
+		if (!ret) {
+			vma->vm_flags |= VM_IO | VM_PFNMAP | VM_RESERVED;
+			buffer->fault_vma = vma;
+		}
+	} else {
+		/* now map it to userspace */
+		ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+	}
+	if (!ret && ++buffer->vma_count > 1 && buffer->dirty)
+		bitmap_fill(buffer->dirty, PAGE_ALIGN(buffer->size) >>
+			    PAGE_SHIFT);
 	mutex_unlock(&buffer->lock);
 	if (ret) {
 		pr_err("%s: failure mapping buffer to userspace\n",
@@ -901,11 +991,85 @@ err:
 	return ret;
 }
 
+/*
+ * Does the cache maintenance through @sync for the pages in [vaddr, vaddr +
+ * size) that the cpu touched since the last time.  Below the full cache
+ * flush threshold each run of dirty pages gets its own call, above it the
+ * whole range is passed down so the heap flushes the entire cache once.
+ */
+static int ion_sync_user(struct ion_buffer *buffer, size_t size,
+			 unsigned long vaddr,
+			 int (*sync)(struct ion_buffer *, size_t, unsigned long,
+				     unsigned long))
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long offset = 0;
+	unsigned long first, last, start, end, i;
+	size_t dirty = 0;
+	int ret = 0;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, vaddr);
+	if (vma && (vma->vm_start > vaddr || vma->vm_file == NULL ||
+		    vma->vm_file->private_data != buffer))
+		vma = NULL;
+	if (vma)
+		offset = (vma->vm_pgoff << PAGE_SHIFT) + vaddr - vma->vm_start;
+
+	mutex_lock(&buffer->lock);
+	if (!vma || vma != buffer->fault_vma || buffer->vma_count != 1 ||
+	    vaddr + size > vma->vm_end) {
+		ret = sync(buffer, size, vaddr, offset);
+		goto out;
+	}
+
+	first = offset >> PAGE_SHIFT;
+	last = PAGE_ALIGN(offset + size) >> PAGE_SHIFT;
+	for (i = find_next_bit(buffer->dirty, last, first); i < last;
+	     i = find_next_bit(buffer->dirty, last, i + 1))
+		dirty += PAGE_SIZE;
+	/* the cpu has not touched this range since the last maintenance */
+	if (!dirty)
+		goto out;
+
+	if (dirty > FULL_CACHE_FLUSH_THRESHOLD) {
+		ret = sync(buffer, size, vaddr, offset);
+	} else {
+		for (i = find_next_bit(buffer->dirty, last, first); i < last;
+		     i = find_next_bit(buffer->dirty, last, end)) {
+			end = find_next_zero_bit(buffer->dirty, last, i);
+			start = max(i << PAGE_SHIFT, offset);
+			ret = sync(buffer,
+				   min(end << PAGE_SHIFT, offset + size) - start,
+				   vaddr + start - offset, start);
+			if (ret)
+				goto out;
+		}
+	}
+	if (ret)
+		goto out;
+
+	/* pages only partly covered by the range stay dirty */
+	first = PAGE_ALIGN(offset) >> PAGE_SHIFT;
+	last = (offset + size) >> PAGE_SHIFT;
+	if (first >= last)
+		goto out;
+	for (i = first; i < last; i++)
+		clear_bit(i, buffer->dirty);
+	zap_vma_ptes(vma, vma->vm_start +
+		     ((first - vma->vm_pgoff) << PAGE_SHIFT),
+		     (last - first) << PAGE_SHIFT);
+out:
+	mutex_unlock(&buffer->lock);
+	up_read(&mm->mmap_sem);
+	return ret;
+}
+
 static int ion_flush_cached(struct ion_handle *handle, size_t size,
 			   unsigned long vaddr)
 {
 	struct ion_buffer *buffer = handle->buffer;
-	struct ion_client *client;
 	int ret;
 
 	if (!handle->buffer->heap->ops->flush_user) {
@@ -914,10 +1078,9 @@ static int ion_flush_cached(struct ion_handle *handle, size_t size,
 		return -EINVAL;
 	}
 
-	mutex_lock(&buffer->lock);
 	/* now flush buffer mapped to userspace */
-	ret = buffer->heap->ops->flush_user(buffer, size, vaddr);
-	mutex_unlock(&buffer->lock);
+	ret = ion_sync_user(buffer, size, vaddr,
+			    buffer->heap->ops->flush_user);
 	if (ret) {
 		pr_err("%s: failure flushing buffer\n",
 		       __func__);
@@ -931,7 +1094,6 @@ static int ion_inval_cached(struct ion_handle *handle, size_t size,
 			   unsigned long vaddr)
 {
 	struct ion_buffer *buffer = handle->buffer;
-	struct ion_client *client;
 	int ret;
 
 	if (!handle->buffer->heap->ops->inval_user) {
@@ -940,10 +1102,9 @@ static int ion_inval_cached(struct ion_handle *handle, size_t size,
 		return -EINVAL;
 	}
 
-	mutex_lock(&buffer->lock);
-	/* now flush buffer mapped to userspace */
-	ret = buffer->heap->ops->inval_user(buffer, size, vaddr);
-	mutex_unlock(&buffer->lock);
+	/* now invalidate buffer mapped to userspace */
+	ret = ion_sync_user(buffer, size, vaddr,
+			    buffer->heap->ops->inval_user);
 	if (ret) {
 		pr_err("%s: failure invalidating buffer\n",
 		       __func__);
@@ -127,8 +127,16 @@ static void per_cpu_cache_flush_arm(void *arg)
 	flush_cache_all();
 }
 
+unsigned long ion_carveout_heap_user_pfn(struct ion_heap *heap,
+					 struct ion_buffer *buffer,
+					 unsigned long pgoff)
+{
+	return __phys_to_pfn(buffer->priv_phys) + pgoff;
+}
+
 int ion_carveout_heap_cache_operation(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr, enum cache_operation cacheop)
+			unsigned long vaddr, unsigned long offset,
+			enum cache_operation cacheop)
 {
 	if (!buffer || !buffer->map_cacheable) {
 		pr_err("%s(): buffer not mapped as cacheable\n",
@@ -145,31 +153,34 @@ int ion_carveout_heap_cache_operation(struct ion_buffer *buffer, size_t len,
 	flush_cache_user_range(vaddr, (vaddr+len));
 	
 	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(buffer->priv_phys, buffer->priv_phys+len);
+		outer_flush_range(buffer->priv_phys + offset,
+				  buffer->priv_phys + offset + len);
 	else
-		outer_inv_range(buffer->priv_phys, buffer->priv_phys+len);
+		outer_inv_range(buffer->priv_phys + offset,
+				buffer->priv_phys + offset + len);
 	
 	return 0;
 }
 
 int ion_carveout_heap_flush_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+			unsigned long vaddr, unsigned long offset)
 {
 	return ion_carveout_heap_cache_operation(buffer, len,
-			vaddr, CACHE_FLUSH);
+			vaddr, offset, CACHE_FLUSH);
 }
 
 int ion_carveout_heap_inval_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+			unsigned long vaddr, unsigned long offset)
 {
 	return ion_carveout_heap_cache_operation(buffer, len,
-			vaddr, CACHE_INVALIDATE);
+			vaddr, offset, CACHE_INVALIDATE);
 }
 static struct ion_heap_ops carveout_heap_ops = {
 	.allocate = ion_carveout_heap_allocate,
 	.free = ion_carveout_heap_free,
 	.phys = ion_carveout_heap_phys,
 	.map_user = ion_carveout_heap_map_user,
+	.user_pfn = ion_carveout_heap_user_pfn,
 	.flush_user = ion_carveout_heap_flush_user,
 	.inval_user = ion_carveout_heap_inval_user,
 	.map_kernel = ion_carveout_heap_map_kernel,
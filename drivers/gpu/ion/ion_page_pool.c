@@ -0,0 +1,184 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/* pages are kept on the pool lists through page->lru, as for the page cache */
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++) {
+		clear_highpage(nth_page(page, i));
+		if (pool->order)
+			cond_resched();
+	}
+}
+
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	mutex_lock(&pool->mutex);
+	while (pool->dirty_count) {
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		list_del(&page->lru);
+		pool->dirty_count--;
+		mutex_unlock(&pool->mutex);
+
+		ion_page_pool_zero(pool, page);
+
+		mutex_lock(&pool->mutex);
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool clean)
+{
+	struct page *page;
+
+	if (clean) {
+		BUG_ON(!pool->clean_count);
+		page = list_first_entry(&pool->clean_items, struct page, lru);
+		pool->clean_count--;
+	} else {
+		BUG_ON(!pool->dirty_count);
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		pool->dirty_count--;
+	}
+	list_del(&page->lru);
+	return page;
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+	bool clean = true;
+
+	mutex_lock(&pool->mutex);
+	if (pool->clean_count) {
+		page = ion_page_pool_remove(pool, true);
+	} else if (pool->dirty_count) {
+		page = ion_page_pool_remove(pool, false);
+		clean = false;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!page)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+	/* the background zeroing has not caught up yet, do it ourselves */
+	if (!clean)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->mutex);
+	if (pool->clean_count + pool->dirty_count >= pool->high_count) {
+		mutex_unlock(&pool->mutex);
+		__free_pages(page, pool->order);
+		return;
+	}
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->mutex);
+
+	schedule_work(&pool->zero_work);
+}
+
+static int ion_page_pool_shrink_list(struct ion_page_pool *pool,
+				     struct list_head *items, int *count,
+				     bool high, int nr_to_scan)
+{
+	struct page *page, *tmp;
+	int freed = 0;
+
+	list_for_each_entry_safe(page, tmp, items, lru) {
+		if (freed >= nr_to_scan)
+			break;
+		/* highmem is no help to a reclaimer that cannot use it */
+		if (!high && PageHighMem(page))
+			continue;
+		list_del(&page->lru);
+		(*count)--;
+		__free_pages(page, pool->order);
+		freed += (1 << pool->order);
+	}
+
+	return freed;
+}
+
+int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
+			 int nr_to_scan)
+{
+	bool high = !!(gfp_mask & __GFP_HIGHMEM);
+	int freed;
+
+	if (!nr_to_scan)
+		return (pool->clean_count + pool->dirty_count) << pool->order;
+
+	mutex_lock(&pool->mutex);
+	/* dirty pages first, reusing them would cost a zeroing pass anyway */
+	freed = ion_page_pool_shrink_list(pool, &pool->dirty_items,
+					  &pool->dirty_count, high, nr_to_scan);
+	if (freed < nr_to_scan)
+		freed += ion_page_pool_shrink_list(pool, &pool->clean_items,
+						   &pool->clean_count, high,
+						   nr_to_scan - freed);
+	mutex_unlock(&pool->mutex);
+
+	return freed;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int high_count)
+{
+	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return ERR_PTR(-ENOMEM);
+	pool->clean_count = 0;
+	pool->dirty_count = 0;
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	mutex_init(&pool->mutex);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	pool->high_count = high_count;
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, GFP_HIGHUSER, INT_MAX);
+	kfree(pool);
+}
@@ -21,6 +21,7 @@
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
 
@@ -126,6 +127,11 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @map_cacheable:	whether userspace mappings are cached
+ * @vma_count:		number of userspace mappings of the buffer
+ * @fault_vma:		the mapping populated through faults, if any
+ * @dirty:		bitmap of pages the cpu touched through @fault_vma
+ *			since their last cache maintenance
 */
 struct ion_buffer {
 	struct kref ref;
@@ -144,6 +150,9 @@ struct ion_buffer {
 	int dmap_cnt;
 	struct scatterlist *sglist;
 	bool map_cacheable;
+	int vma_count;
+	struct vm_area_struct *fault_vma;
+	unsigned long *dirty;
 };
 
 /**
@@ -157,8 +166,11 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
- * @flush_user		flush memory if mapped as cacheable
- * @inval_user		invalidate memory if mapped as cacheable
+ * @user_pfn		pfn backing page @pgoff of the buffer, lets cached
+ *			userspace mappings be populated on demand
+ * @flush_user		flush @len bytes at @offset into the buffer, mapped
+ *			at @vaddr, if mapped as cacheable
+ * @inval_user		invalidate memory if mapped as cacheable, as above
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -174,10 +186,13 @@ struct ion_heap_ops {
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
+	unsigned long (*user_pfn) (struct ion_heap *heap,
+				   struct ion_buffer *buffer,
+				   unsigned long pgoff);
 	int (*flush_user) (struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr);
+			unsigned long vaddr, unsigned long offset);
 	int (*inval_user) (struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr);
+			unsigned long vaddr, unsigned long offset);
 };
 
 /**
@@ -262,6 +277,57 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed items in the pool
+ * @dirty_count:	number of items still waiting to be zeroed
+ * @clean_items:	list of zeroed pages, ready to hand out
+ * @dirty_items:	list of freed pages
+ * @mutex:		lock protecting this struct and especially the counts
+ *			and item lists
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @high_count:		most items the pool keeps, further frees go straight
+ *			back to the page allocator
+ * @zero_work:		zeroes dirty items in the background
+ *
+ * Allows buffers to be returned to the pool instead of being freed back to
+ * the page allocator, which saves the cost of splitting and merging high
+ * order blocks and of zeroing pages in the allocation path.  Pages freed to
+ * the pool land on the dirty list and are zeroed by zero_work; allocations
+ * take a clean page if there is one, zero a dirty one otherwise and only
+ * then fall back to alloc_pages().  The pool is drained by the owning heap's
+ * shrinker through ion_page_pool_shrink().
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+	int high_count;
+	struct work_struct zero_work;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int high_count);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+/**
+ * ion_page_pool_shrink - frees up to nr_to_scan order-0 pages worth of items
+ * @pool:		the pool
+ * @gfp_mask:		the memory type to reclaim
+ * @nr_to_scan:		number of order-0 pages to free, 0 to only count
+ *
+ * Returns the number of order-0 pages freed, or held in the pool when
+ * nr_to_scan is 0.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
+			 int nr_to_scan);
+
 /**
  * Flushing entire cache is more efficient than flushing virtual address
  * range of a buffer whose size is 200Kbytes or higher, since line by
@@ -22,64 +22,155 @@
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * Buffers are built from the largest chunks the pools can provide, so a
+ * multi-megabyte buffer is a few dozen order-8 blocks rather than thousands
+ * of pages.  Order 8 must not go into reclaim, and no order above 0 may
+ * retry or warn, the smaller orders are there to fall back on.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+static const gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
+					   __GFP_NORETRY) & ~__GFP_WAIT;
+static const gfp_t mid_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN |
+					 __GFP_NORETRY;
+static const gfp_t low_order_gfp_flags = GFP_HIGHUSER;
+
+/* memory each pool keeps for reuse at most, the rest is freed at once */
+#define ION_SYSTEM_HEAP_POOL_HIGH	(16 << 20)
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct shrinker shrinker;
+};
+
+/*
+ * The chunks of a buffer are linked through page->lru of their first page,
+ * with the chunk order kept in page_private().
+ */
+struct ion_system_buffer_info {
+	struct list_head pages;
+	int n_chunks;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct page *alloc_largest_available(struct ion_system_heap *heap,
+					    unsigned long size,
+					    unsigned int max_order)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+		set_page_private(page, orders[i]);
+		return page;
+	}
+
+	return NULL;
+}
+
+static void free_buffer_page(struct ion_system_heap *heap, struct page *page)
+{
+	unsigned int order = page_private(page);
+
+	set_page_private(page, 0);
+	ion_page_pool_free(heap->pools[order_to_index(order)], page);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    unsigned long size, unsigned long align,
 				    unsigned long flags)
 {
-	int n_pages = PAGE_ALIGN(size) / PAGE_SIZE;
-	struct page **page_list;
-	const int gfp_mask = GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO;
-	int i = 0;
-
-	page_list = kmalloc(n_pages * sizeof(void *), GFP_KERNEL);
-
-	for (i = 0; i < n_pages; i++) {
-		page_list[i] = alloc_page(gfp_mask);
-		if (page_list[i] == NULL)
-			goto out;
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *info;
+	struct page *page, *tmp;
+	unsigned long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+
+	info = kmalloc(sizeof(struct ion_system_buffer_info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&info->pages);
+	info->n_chunks = 0;
+
+	while (size_remaining > 0) {
+		page = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!page)
+			goto err;
+		list_add_tail(&page->lru, &info->pages);
+		info->n_chunks++;
+		size_remaining -= PAGE_SIZE << page_private(page);
+		/* no point asking for an order that just failed again */
+		max_order = page_private(page);
 	}
 
-	buffer->priv_virt = page_list;
+	buffer->priv_virt = info;
 	return 0;
 
-out:
-	/* failed on i, so go to i-1 */
-	i--;
-
-	for (; i >= 0; i--)
-		__free_page(page_list[i]);
-
-	kfree(page_list);
+err:
+	list_for_each_entry_safe(page, tmp, &info->pages, lru) {
+		list_del(&page->lru);
+		free_buffer_page(sys_heap, page);
+	}
+	kfree(info);
 	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-
-	for (i = 0; i < n_pages; i++)
-		__free_page(page_list[i]);
-	kfree(page_list);
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &info->pages, lru) {
+		list_del(&page->lru);
+		free_buffer_page(sys_heap, page);
+	}
+	kfree(info);
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-	int i;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct scatterlist *sglist, *sg;
+	struct page *page;
 
-	sglist = vmalloc(n_pages * sizeof(struct scatterlist));
+	sglist = vmalloc(info->n_chunks * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, n_pages * sizeof(struct scatterlist));
-	sg_init_table(sglist, n_pages);
-	for (i = 0; i < n_pages; i++)
-		sg_set_page(&sglist[i], page_list[i], PAGE_SIZE, 0);
+	sg_init_table(sglist, info->n_chunks);
+	sg = sglist;
+	list_for_each_entry(page, &info->pages, lru) {
+		sg_set_page(sg, page, PAGE_SIZE << page_private(page), 0);
+		sg = sg_next(sg);
+	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
 }
@@ -94,10 +185,22 @@ void ion_system_heap_unmap_dma(struct ion_heap *heap, struct ion_buffer *buffer)
 void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
 	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-
-	return vm_map_ram(page_list, n_pages, -1, PAGE_KERNEL);
+	struct page **pages, *page;
+	void *vaddr;
+	int i, j = 0;
+
+	pages = vmalloc(n_pages * sizeof(struct page *));
+	if (!pages)
+		return NULL;
+	list_for_each_entry(page, &info->pages, lru)
+		for (i = 0; i < (1 << page_private(page)); i++)
+			pages[j++] = nth_page(page, i);
+
+	vaddr = vm_map_ram(pages, n_pages, -1, PAGE_KERNEL);
+	vfree(pages);
+	return vaddr;
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
@@ -108,33 +211,60 @@ void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 	vm_unmap_ram(buffer->vaddr, n_pages);
 }
 
+/*
+ * The tail pages of a high order chunk have no reference count of their
+ * own, so the chunks are mapped by pfn rather than with vm_insert_page().
+ */
 int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma)
 {
-	unsigned long uaddr = vma->vm_start;
-	unsigned long usize = vma->vm_end - vma->vm_start;
-	int n_pages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	struct page **page_list = (struct page **)buffer->priv_virt;
-	int i;
-
-	if (usize /* + pgoff << PAGE_SHIFT */  > (n_pages << PAGE_SHIFT))
-		return -EINVAL;
-
-	i = 0;
-	do {
-		int ret;
-
-		ret = vm_insert_page(vma, uaddr, page_list[i]);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	struct page *page;
+	int ret;
+
+	list_for_each_entry(page, &info->pages, lru) {
+		unsigned long pfn = page_to_pfn(page);
+		unsigned long len = PAGE_SIZE << page_private(page);
+
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		pfn += offset >> PAGE_SHIFT;
+		len = min(len - offset, vma->vm_end - addr);
+		offset = 0;
+
+		ret = remap_pfn_range(vma, addr, pfn, len, vma->vm_page_prot);
 		if (ret)
 			return ret;
+		addr += len;
+		if (addr >= vma->vm_end)
+			break;
+	}
 
-		uaddr += PAGE_SIZE;
-		usize -= PAGE_SIZE;
-	} while (usize > 0);
+	return 0;
+}
 
-	vma->vm_flags |= VM_RESERVED;
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_total = 0;
+	int i;
 
-	return 0;
+	for (i = 0; i < NUM_ORDERS && nr_to_scan > 0; i++)
+		nr_to_scan -= ion_page_pool_shrink(sys_heap->pools[i],
+						   sc->gfp_mask, nr_to_scan);
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		nr_total += ion_page_pool_shrink(sys_heap->pools[i],
+						 sc->gfp_mask, 0);
+	return nr_total;
 }
 
 static struct ion_heap_ops vmalloc_ops = {
@@ -149,19 +279,55 @@ static struct ion_heap_ops vmalloc_ops = {
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *heap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	heap->heap.ops = &vmalloc_ops;
+	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool;
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i] > 4)
+			gfp_flags = high_order_gfp_flags;
+		else if (orders[i] > 0)
+			gfp_flags = mid_order_gfp_flags;
+		pool = ion_page_pool_create(gfp_flags, orders[i],
+					    ION_SYSTEM_HEAP_POOL_HIGH >>
+					    (PAGE_SHIFT + orders[i]));
+		if (IS_ERR(pool))
+			goto err;
+		heap->pools[i] = pool;
+	}
+
+	heap->shrinker.shrink = ion_system_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+	return &heap->heap;
+
+err:
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (heap->pools[i])
+			ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	unregister_shrinker(&sys_heap->shrinker);
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -203,6 +369,17 @@ struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -219,8 +396,8 @@ static struct ion_heap_ops kmalloc_ops = {
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 };
 
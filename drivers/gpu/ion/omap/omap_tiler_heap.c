@@ -860,8 +860,20 @@ static void per_cpu_cache_flush_arm(void *arg)
 	   flush_cache_all();
 }
 
+unsigned long omap_tiler_heap_user_pfn(struct ion_heap *heap,
+				       struct ion_buffer *buffer,
+				       unsigned long pgoff)
+{
+	struct omap_tiler_info *info = buffer->priv_virt;
+
+	if (TILER_PIXEL_FMT_PAGE == info->fmt)
+		return __phys_to_pfn(info->tiler_addrs[0]) + pgoff;
+	return __phys_to_pfn(info->tiler_addrs[pgoff]);
+}
+
 int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr, enum cache_operation cacheop)
+			unsigned long vaddr, unsigned long offset,
+			enum cache_operation cacheop)
 {
 	struct omap_tiler_info *info;
 	int n_pages;
@@ -882,7 +894,7 @@ int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
 	}
 
 	n_pages = info->n_tiler_pages;
-	if (len > (n_pages * PAGE_SIZE)) {
+	if (offset + len > (n_pages * PAGE_SIZE)) {
 		pr_err("%s(): size to flush is greater than allocated size\n",
 			__func__);
 		return -EINVAL;
@@ -903,24 +915,26 @@ int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
 	flush_cache_user_range(vaddr, vaddr + len);
 
 	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(info->tiler_addrs[0],
-			info->tiler_addrs[0] + len);
+		outer_flush_range(info->tiler_addrs[0] + offset,
+			info->tiler_addrs[0] + offset + len);
 	else
-		outer_inv_range(info->tiler_addrs[0],
-			info->tiler_addrs[0] + len);
+		outer_inv_range(info->tiler_addrs[0] + offset,
+			info->tiler_addrs[0] + offset + len);
 	return 0;
 }
 
 int omap_tiler_heap_flush_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+			unsigned long vaddr, unsigned long offset)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_FLUSH);
+	return omap_tiler_cache_operation(buffer, len, vaddr, offset,
+					  CACHE_FLUSH);
 }
 
 int omap_tiler_heap_inval_user(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr)
+			unsigned long vaddr, unsigned long offset)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_INVALIDATE);
+	return omap_tiler_cache_operation(buffer, len, vaddr, offset,
+					  CACHE_INVALIDATE);
 }
 
 static struct ion_heap_ops omap_tiler_ops = {
@@ -928,6 +942,7 @@ static struct ion_heap_ops omap_tiler_ops = {
 	.free = omap_tiler_heap_free,
 	.phys = omap_tiler_phys,
 	.map_user = omap_tiler_heap_map_user,
+	.user_pfn = omap_tiler_heap_user_pfn,
 	.flush_user = omap_tiler_heap_flush_user,
 	.inval_user = omap_tiler_heap_inval_user,
 };
@@ -16,9 +16,11 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/err.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -28,18 +30,54 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/security.h>
 
 #include "binder.h"
+#include "binder_alloc.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking:
+ *
+ * binder_main_lock is a rw semaphore.  ioctl and poll take it shared and
+ * only exclude what tears objects down: proc release and flush from the
+ * deferred worker, BINDER_THREAD_EXIT, BINDER_SET_CONTEXT_MGR and the
+ * debugfs dumps, which take it exclusively.  So under the shared lock a
+ * thread, proc or node may be looked at as long as it is referenced, the
+ * context manager node does not change, and node->proc only goes from a
+ * proc to NULL under the exclusive lock.
+ *
+ * Under the shared lock, objects are protected by:
+ *
+ * proc->outer_lock (mutex): the refs of the proc (refs_by_desc,
+ *	refs_by_node and the counts and death notification of each ref).
+ *	Never held for two procs at once.
+ * proc->inner_lock (spinlock): the threads and nodes trees, the todo
+ *	lists of the proc and its threads, delivered_death, transaction
+ *	stacks and return errors of its threads, the thread counts, tmp_ref
+ *	of the proc and its threads, the latency histograms, the buffer <->
+ *	transaction links of its buffers and all the fields of its live nodes
+ *	except ptr, cookie, min_priority and accept_fds, which never change.
+ * node->lock (spinlock): the same fields of a node whose proc died.
+ *	binder_node_inner_lock() picks the right one of the two.
+ *
+ * Lock ordering: binder_main_lock -> binder_procs_lock -> proc->outer_lock
+ * -> node->lock or proc->inner_lock -> binder_dead_nodes_lock.  At most one
+ * of node->lock and any inner_lock is held at a time.  proc->alloc.mutex
+ * (see binder_alloc.c) is never taken under a spinlock; a sender allocates
+ * and fills a target buffer holding no binder lock at all.
+ */
+static DECLARE_RWSEM(binder_main_lock);
+static DEFINE_MUTEX(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
-static DEFINE_MUTEX(binder_mmap_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -49,7 +87,7 @@ static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -147,23 +185,90 @@ enum binder_stat_types {
 	BINDER_STAT_COUNT
 };
 
+/* Updated by threads of many procs at once, so kept atomic */
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+struct binder_lock_stats {
+	atomic_t acquired;
+	atomic_t contended;
+	atomic64_t wait_ns;
+};
+
+static struct binder_lock_stats binder_main_lock_stats;
+static struct binder_lock_stats binder_main_lock_shared_stats;
+static struct binder_lock_stats binder_procs_lock_stats;
+static struct binder_lock_stats binder_outer_lock_stats;
+
+static void binder_lock_contended(struct binder_lock_stats *stats,
+				  ktime_t start)
+{
+	atomic_inc(&stats->contended);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &stats->wait_ns);
+}
+
+static void binder_mutex_lock(struct mutex *lock,
+			      struct binder_lock_stats *stats)
+{
+	ktime_t start;
+
+	if (!mutex_trylock(lock)) {
+		start = ktime_get();
+		mutex_lock(lock);
+		binder_lock_contended(stats, start);
+	}
+	atomic_inc(&stats->acquired);
+}
+
+static inline void binder_lock(void)
+{
+	ktime_t start;
+
+	if (!down_write_trylock(&binder_main_lock)) {
+		start = ktime_get();
+		down_write(&binder_main_lock);
+		binder_lock_contended(&binder_main_lock_stats, start);
+	}
+	atomic_inc(&binder_main_lock_stats.acquired);
+}
+
+static inline void binder_unlock(void)
+{
+	up_write(&binder_main_lock);
+}
+
+static inline void binder_lock_shared(void)
+{
+	ktime_t start;
+
+	if (!down_read_trylock(&binder_main_lock)) {
+		start = ktime_get();
+		down_read(&binder_main_lock);
+		binder_lock_contended(&binder_main_lock_shared_stats, start);
+	}
+	atomic_inc(&binder_main_lock_shared_stats.acquired);
+}
+
+static inline void binder_unlock_shared(void)
+{
+	up_read(&binder_main_lock);
 }
 
 struct binder_transaction_log_entry {
@@ -190,6 +295,8 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -197,6 +304,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
 	return e;
 }
 
@@ -214,6 +322,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;	/* Once proc is dead, see binder_main_lock */
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -224,6 +333,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;		/* Held over a lookup, see binder_put_node */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -258,21 +368,31 @@ struct binder_ref {
 	struct binder_ref_death *death;
 };
 
-struct binder_buffer {
-	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
-	unsigned free:1;
-	unsigned allow_user_free:1;
-	unsigned async_transaction:1;
-	unsigned debug_id:29;
-
-	struct binder_transaction *transaction;
-
-	struct binder_node *target_node;
-	size_t data_size;
-	size_t offsets_size;
-	uint8_t data[0];
+/*
+ * log2 histogram of transaction latencies in microseconds: bucket 0
+ * counts sub-microsecond samples, bucket i (i > 0) counts samples in
+ * [2^(i-1), 2^i) us and the last bucket everything above.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+enum binder_latency_type {
+	BINDER_LATENCY_QUEUE,      /* queued -> read by a target thread */
+	BINDER_LATENCY_SERVICE,    /* BR_TRANSACTION read -> BC_REPLY */
+	BINDER_LATENCY_ROUND_TRIP, /* call queued -> BR_REPLY read by caller */
+	BINDER_LATENCY_COUNT
+};
+
+static const char * const binder_latency_strings[] = {
+	"queue",
+	"service",
+	"round trip"
+};
+
+struct binder_latency_hist {
+	unsigned int count;
+	unsigned int max_us;
+	u64 total_us;
+	unsigned int bucket[BINDER_LATENCY_BUCKETS];
 };
 
 enum binder_deferred_state {
@@ -288,22 +408,14 @@ struct binder_proc {
 	struct rb_root refs_by_desc;
 	struct rb_root refs_by_node;
 	int pid;
-	struct vm_area_struct *vma;
 	struct task_struct *tsk;
 	struct files_struct *files;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
-	void *buffer;
-	ptrdiff_t user_buffer_offset;
+	struct binder_alloc alloc;
+	struct mutex outer_lock;
+	spinlock_t inner_lock;
 
-	struct list_head buffers;
-	struct rb_root free_buffers;
-	struct rb_root allocated_buffers;
-	size_t free_async_space;
-
-	struct page **pages;
-	size_t buffer_size;
-	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
@@ -314,6 +426,9 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency_hist latency[BINDER_LATENCY_COUNT];
+	int tmp_ref;
+	bool is_dead;
 };
 
 enum {
@@ -338,6 +453,8 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	int tmp_ref;
+	bool is_dead;
 };
 
 struct binder_transaction {
@@ -357,8 +474,71 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	queue_time;	/* put on the target todo list */
+	ktime_t	call_time;	/* queue_time of the call, for replies */
+	ktime_t	read_time;	/* BR_TRANSACTION returned to the target */
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
+static inline void binder_proc_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->outer_lock, &binder_outer_lock_stats);
+}
+
+static inline void binder_proc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->outer_lock);
+}
+
+static inline void binder_inner_proc_lock(struct binder_proc *proc)
+{
+	spin_lock(&proc->inner_lock);
+}
+
+static inline void binder_inner_proc_unlock(struct binder_proc *proc)
+{
+	spin_unlock(&proc->inner_lock);
+}
+
+/*
+ * Lock the state of @node: the inner lock of its proc while that is alive,
+ * else the node's own lock.  Needs binder_main_lock so node->proc does not
+ * change in between.
+ */
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+	else
+		spin_lock(&node->lock);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	if (node->proc)
+		binder_inner_proc_unlock(node->proc);
+	else
+		spin_unlock(&node->lock);
+}
+
+static void binder_latency_add(struct binder_latency_hist *hist, s64 us)
+{
+	int i;
+
+	if (us < 0)
+		us = 0;
+	if (us > UINT_MAX)
+		us = UINT_MAX;
+	i = min(fls(us), BINDER_LATENCY_BUCKETS - 1);
+	hist->bucket[i]++;
+	hist->count++;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -517,441 +697,42 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
-static size_t binder_buffer_size(struct binder_proc *proc,
-				 struct binder_buffer *buffer)
-{
-	if (list_is_last(&buffer->entry, &proc->buffers))
-		return proc->buffer + proc->buffer_size - (void *)buffer->data;
-	else
-		return (size_t)list_entry(buffer->entry.next,
-			struct binder_buffer, entry) - (size_t)buffer->data;
-}
-
-static void binder_insert_free_buffer(struct binder_proc *proc,
-				      struct binder_buffer *new_buffer)
-{
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	size_t new_buffer_size;
-
-	BUG_ON(!new_buffer->free);
-
-	new_buffer_size = binder_buffer_size(proc, new_buffer);
-
-	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-		     "binder: %d: add free buffer, size %zd, "
-		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
-
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
-}
-
-static void binder_insert_allocated_buffer(struct binder_proc *proc,
-					   struct binder_buffer *new_buffer)
-{
-	struct rb_node **p = &proc->allocated_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-
-	BUG_ON(new_buffer->free);
-
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(buffer->free);
-
-		if (new_buffer < buffer)
-			p = &parent->rb_left;
-		else if (new_buffer > buffer)
-			p = &parent->rb_right;
-		else
-			BUG();
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->allocated_buffers);
-}
-
-static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
-						  void __user *user_ptr)
-{
-	struct rb_node *n = proc->allocated_buffers.rb_node;
-	struct binder_buffer *buffer;
-	struct binder_buffer *kern_ptr;
-
-	kern_ptr = user_ptr - proc->user_buffer_offset
-		- offsetof(struct binder_buffer, data);
-
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(buffer->free);
-
-		if (kern_ptr < buffer)
-			n = n->rb_left;
-		else if (kern_ptr > buffer)
-			n = n->rb_right;
-		else
-			return buffer;
-	}
-	return NULL;
-}
-
-static int binder_update_page_range(struct binder_proc *proc, int allocate,
-				    void *start, void *end,
-				    struct vm_area_struct *vma)
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
-	void *page_addr;
-	unsigned long user_page_addr;
-	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
-
-	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-		     "binder: %d: %s pages %p-%p\n", proc->pid,
-		     allocate ? "allocate" : "free", start, end);
-
-	if (end <= start)
-		return 0;
-
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
-
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-		if (vma && mm != vma->vm_mm) {
-			pr_err("binder: %d: vma mm and task mm mismatch\n",
-				proc->pid);
-			vma = NULL;
-		}
-	}
-
-	if (allocate == 0)
-		goto free_range;
-
-	if (vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
-		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
-	}
-
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "for page at %p\n", proc->pid, page_addr);
-			goto err_alloc_page_failed;
-		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
-		}
-		/* vm_insert_page does not seem to increment the refcount */
-	}
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
-	}
-	return 0;
-
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
-err_alloc_page_failed:
-		;
-	}
-err_no_vma:
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
-	}
-	return -ENOMEM;
-}
-
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
-{
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
-	void *has_page_addr;
-	void *end_page_addr;
-	size_t size;
-
-	if (proc->vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
-		       proc->pid);
-		return NULL;
-	}
-
-	size = ALIGN(data_size, sizeof(void *)) +
-		ALIGN(offsets_size, sizeof(void *));
-
-	if (size < data_size || size < offsets_size) {
-		binder_user_error("binder: %d: got transaction with invalid "
-			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
-		return NULL;
-	}
-
-	if (is_async &&
-	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: binder_alloc_buf size %zd"
-			     "failed, no async space left\n", proc->pid, size);
-		return NULL;
-	}
+	struct rb_node *n = proc->nodes.rb_node;
+	struct binder_node *node;
 
 	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
+		node = rb_entry(n, struct binder_node, rb_node);
 
-		if (size < buffer_size) {
-			best_fit = n;
+		if (ptr < node->ptr)
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		else if (ptr > node->ptr)
 			n = n->rb_right;
 		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
-		       "no address space\n", proc->pid, size);
-		return NULL;
-	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
-
-	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-		     "binder: %d: binder_alloc_buf size %zd got buff"
-		     "er %p size %zd\n", proc->pid, size, buffer, buffer_size);
-
-	has_page_addr =
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
-		else
-			buffer_size = size + sizeof(struct binder_buffer);
-	}
-	end_page_addr =
-		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
-	if (end_page_addr > has_page_addr)
-		end_page_addr = has_page_addr;
-	if (binder_update_page_range(proc, 1,
-	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
-		return NULL;
-
-	rb_erase(best_fit, &proc->free_buffers);
-	buffer->free = 0;
-	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
-		list_add(&new_buffer->entry, &buffer->entry);
-		new_buffer->free = 1;
-		binder_insert_free_buffer(proc, new_buffer);
-	}
-	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-		     "binder: %d: binder_alloc_buf size %zd got "
-		     "%p\n", proc->pid, size, buffer);
-	buffer->data_size = data_size;
-	buffer->offsets_size = offsets_size;
-	buffer->async_transaction = is_async;
-	if (is_async) {
-		proc->free_async_space -= size + sizeof(struct binder_buffer);
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
-			     "binder: %d: binder_alloc_buf size %zd "
-			     "async free %zd\n", proc->pid, size,
-			     proc->free_async_space);
-	}
-
-	return buffer;
-}
-
-static void *buffer_start_page(struct binder_buffer *buffer)
-{
-	return (void *)((uintptr_t)buffer & PAGE_MASK);
-}
-
-static void *buffer_end_page(struct binder_buffer *buffer)
-{
-	return (void *)(((uintptr_t)(buffer + 1) - 1) & PAGE_MASK);
-}
-
-static void binder_delete_free_buffer(struct binder_proc *proc,
-				      struct binder_buffer *buffer)
-{
-	struct binder_buffer *prev, *next = NULL;
-	int free_page_end = 1;
-	int free_page_start = 1;
-
-	BUG_ON(proc->buffers.next == &buffer->entry);
-	prev = list_entry(buffer->entry.prev, struct binder_buffer, entry);
-	BUG_ON(!prev->free);
-	if (buffer_end_page(prev) == buffer_start_page(buffer)) {
-		free_page_start = 0;
-		if (buffer_end_page(prev) == buffer_end_page(buffer))
-			free_page_end = 0;
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: merge free, buffer %p "
-			     "share page with %p\n", proc->pid, buffer, prev);
-	}
-
-	if (!list_is_last(&buffer->entry, &proc->buffers)) {
-		next = list_entry(buffer->entry.next,
-				  struct binder_buffer, entry);
-		if (buffer_start_page(next) == buffer_end_page(buffer)) {
-			free_page_end = 0;
-			if (buffer_start_page(next) ==
-			    buffer_start_page(buffer))
-				free_page_start = 0;
-			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-				     "binder: %d: merge free, buffer"
-				     " %p share page with %p\n", proc->pid,
-				     buffer, prev);
-		}
-	}
-	list_del(&buffer->entry);
-	if (free_page_start || free_page_end) {
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: merge free, buffer %p do "
-			     "not share page%s%s with with %p or %p\n",
-			     proc->pid, buffer, free_page_start ? "" : " end",
-			     free_page_end ? "" : " start", prev, next);
-		binder_update_page_range(proc, 0, free_page_start ?
-			buffer_start_page(buffer) : buffer_end_page(buffer),
-			(free_page_end ? buffer_end_page(buffer) :
-			buffer_start_page(buffer)) + PAGE_SIZE, NULL);
-	}
-}
-
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
-{
-	size_t size, buffer_size;
-
-	buffer_size = binder_buffer_size(proc, buffer);
-
-	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
-
-	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-		     "binder: %d: binder_free_buf %p size %zd buffer"
-		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
-
-	BUG_ON(buffer->free);
-	BUG_ON(size > buffer_size);
-	BUG_ON(buffer->transaction != NULL);
-	BUG_ON((void *)buffer < proc->buffer);
-	BUG_ON((void *)buffer > proc->buffer + proc->buffer_size);
-
-	if (buffer->async_transaction) {
-		proc->free_async_space += size + sizeof(struct binder_buffer);
-
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
-			     "binder: %d: binder_free_buf size %zd "
-			     "async free %zd\n", proc->pid, size,
-			     proc->free_async_space);
-	}
-
-	binder_update_page_range(proc, 0,
-		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
-		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
-	buffer->free = 1;
-	if (!list_is_last(&buffer->entry, &proc->buffers)) {
-		struct binder_buffer *next = list_entry(buffer->entry.next,
-						struct binder_buffer, entry);
-		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
-			binder_delete_free_buffer(proc, next);
-		}
-	}
-	if (proc->buffers.next != &buffer->entry) {
-		struct binder_buffer *prev = list_entry(buffer->entry.prev,
-						struct binder_buffer, entry);
-		if (prev->free) {
-			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
-			buffer = prev;
+			node->tmp_refs++;
+			return node;
 		}
 	}
-	binder_insert_free_buffer(proc, buffer);
+	return NULL;
 }
 
+/* Returns the node with a tmp ref held, drop it with binder_put_node() */
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
-	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
 
-	while (n) {
-		node = rb_entry(n, struct binder_node, rb_node);
-
-		if (ptr < node->ptr)
-			n = n->rb_left;
-		else if (ptr > node->ptr)
-			n = n->rb_right;
-		else
-			return node;
-	}
-	return NULL;
+	binder_inner_proc_lock(proc);
+	node = binder_get_node_ilocked(proc, ptr);
+	binder_inner_proc_unlock(proc);
+	return node;
 }
 
-static struct binder_node *binder_new_node(struct binder_proc *proc,
-					   void __user *ptr,
-					   void __user *cookie)
+static struct binder_node *binder_init_node_ilocked(
+		struct binder_proc *proc, struct binder_node *new_node,
+		void __user *ptr, void __user *cookie, unsigned long flags)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
@@ -965,20 +746,25 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			/* Another thread of proc added it meanwhile */
+			node->tmp_refs++;
+			return node;
+		}
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
+	node->tmp_refs++;
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+	spin_lock_init(&node->lock);
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
@@ -989,8 +775,37 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/*
+ * Returns the node of @proc for @ptr, creating it if needed, with a tmp
+ * ref held.  @flags only apply to a node created here.
+ */
+static struct binder_node *binder_new_node(struct binder_proc *proc,
+					   void __user *ptr,
+					   void __user *cookie,
+					   unsigned long flags)
+{
+	struct binder_node *node;
+	struct binder_node *new_node;
+
+	new_node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+	binder_inner_proc_lock(proc);
+	node = binder_init_node_ilocked(proc, new_node, ptr, cookie, flags);
+	binder_inner_proc_unlock(proc);
+	if (node != new_node)
+		kfree(new_node);
+	return node;
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static int binder_inc_node_ilocked(struct binder_node *node, int strong,
+				   int internal, struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1024,50 +839,113 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+/*
+ * @target_list, if any, must be a todo list of node->proc, which is what
+ * binder_node_inner_lock() locks.
+ */
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_ilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/*
+ * Returns true if the node is now unreferenced and has been unlinked; the
+ * caller frees it with binder_free_node() after dropping the lock.
+ */
+static bool binder_dec_node_ilocked(struct binder_node *node, int strong,
+				    int internal)
 {
+	struct binder_proc *proc = node->proc;
+
+	/*
+	 * The local refs of a dead node were dropped along with its proc,
+	 * so a late drop of one taken before that is ignored.
+	 */
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
-		else
+		else if (proc || node->local_strong_refs)
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
+			return false;
 	} else {
-		if (!internal)
+		if (!internal && (proc || node->local_weak_refs))
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
+			return false;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
+		return false;
+	}
+	if (!hlist_empty(&node->refs) || node->local_strong_refs ||
+	    node->local_weak_refs || node->tmp_refs)
+		return false;
+	list_del_init(&node->work.entry);
+	if (proc) {
+		rb_erase(&node->rb_node, &proc->nodes);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: refless node %d deleted\n",
+			     node->debug_id);
 	} else {
-		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: refless node %d deleted\n",
-					     node->debug_id);
-			} else {
-				hlist_del(&node->dead_node);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: dead node %d deleted\n",
-					     node->debug_id);
-			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		}
+		spin_lock(&binder_dead_nodes_lock);
+		hlist_del(&node->dead_node);
+		spin_unlock(&binder_dead_nodes_lock);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: dead node %d deleted\n",
+			     node->debug_id);
 	}
+	return true;
+}
 
-	return 0;
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_ilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 }
 
+static void binder_put_node(struct binder_node *node)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	free_node = binder_dec_node_ilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
 
+/*
+ * Take the local strong ref a transaction buffer holds on its target node,
+ * and a tmp ref that keeps the node around while binder_transaction() runs
+ * without binder_main_lock.
+ */
+static void binder_get_txn_node(struct binder_node *node)
+{
+	binder_node_inner_lock(node);
+	binder_inc_node_ilocked(node, 1, 0, NULL);
+	node->tmp_refs++;
+	binder_node_inner_unlock(node);
+}
+
+/* The ref functions need proc->outer_lock of the proc owning the refs */
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
 {
@@ -1110,7 +988,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1139,7 +1017,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		binder_node_inner_lock(node);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_inner_unlock(node);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1156,23 +1036,32 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	bool free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
-		     ref->desc, ref->node->debug_id);
+		     ref->desc, node->debug_id);
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_inner_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_ilocked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_ilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		binder_inner_proc_lock(ref->proc);
 		list_del(&ref->death->work.entry);
+		binder_inner_proc_unlock(ref->proc);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1214,12 +1103,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1235,19 +1120,25 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(t->from != target_thread);
+	target_thread->transaction_stack = t->from_parent;
+	t->from = NULL;
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
+	if (target_proc) {
+		binder_inner_proc_lock(target_proc);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		binder_inner_proc_unlock(target_proc);
 	}
-	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1260,6 +1151,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			binder_inner_proc_lock(target_thread->proc);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1273,15 +1165,18 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
+				binder_inner_proc_unlock(target_thread->proc);
 				wake_up_interruptible(&target_thread->wait);
+				binder_free_transaction(t);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				binder_inner_proc_unlock(target_thread->proc);
 			}
 			return;
 		} else {
@@ -1292,7 +1187,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1351,11 +1246,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1365,6 +1265,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			binder_proc_unlock(proc);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1382,6 +1283,30 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+static void binder_free_proc(struct binder_proc *proc);
+
+static void binder_transaction_unpin(struct binder_proc *proc,
+				     struct binder_thread *thread)
+{
+	bool free_thread = false;
+	bool free_proc;
+
+	if (proc == NULL)
+		return;
+	binder_inner_proc_lock(proc);
+	if (thread) {
+		thread->tmp_ref--;
+		free_thread = thread->is_dead && !thread->tmp_ref;
+	}
+	proc->tmp_ref--;
+	free_proc = proc->is_dead && !proc->tmp_ref;
+	binder_inner_proc_unlock(proc);
+	if (free_thread)
+		kfree(thread);
+	if (free_proc)
+		binder_free_proc(proc);
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
 			       struct binder_transaction_data *tr, int reply)
@@ -1396,6 +1321,9 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_proc *pinned_proc = NULL;
+	struct binder_thread *pinned_thread = NULL;
+	const char *copy_error;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1407,15 +1335,16 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		binder_inner_proc_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_inner_proc_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1425,16 +1354,20 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			binder_inner_proc_unlock(proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		binder_inner_proc_unlock(proc);
+		binder_set_nice(in_reply_to->saved_priority);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		binder_inner_proc_lock(target_thread->proc);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1443,17 +1376,22 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_inner_proc_unlock(target_thread->proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
+		binder_inner_proc_unlock(target_thread->proc);
 		target_proc = target_thread->proc;
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+
+			binder_proc_lock(proc);
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1461,12 +1399,15 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_get_txn_node(target_node);
+			binder_proc_unlock(proc);
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			binder_get_txn_node(target_node);
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
@@ -1478,6 +1419,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_invalid_target_handle;
 		}
+		binder_inner_proc_lock(proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1489,6 +1431,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				binder_inner_proc_unlock(proc);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1498,6 +1441,7 @@ static void binder_transaction(struct binder_proc *proc,
 				tmp = tmp->from_parent;
 			}
 		}
+		binder_inner_proc_unlock(proc);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1524,7 +1468,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1554,30 +1498,59 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+
+	/*
+	 * Allocate and fill the target buffer without binder_main_lock:
+	 * page population takes the target's mmap_sem and copy_from_user
+	 * may fault.  The target proc and thread are pinned so they stay
+	 * valid, and are checked again once the lock is retaken.  The
+	 * target node is held by the tmp ref taken above.
+	 */
+	pinned_proc = target_proc;
+	pinned_thread = target_thread;
+	binder_inner_proc_lock(target_proc);
+	pinned_proc->tmp_ref++;
+	if (pinned_thread)
+		pinned_thread->tmp_ref++;
+	binder_inner_proc_unlock(target_proc);
+	binder_unlock_shared();
+
+	copy_error = NULL;
+	t->buffer = binder_alloc_new_buf(&target_proc->alloc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+	if (t->buffer) {
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->target_node = target_node;
+		offp = (size_t *)(t->buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			copy_error = "data";
+		else if (copy_from_user(offp, tr->data.ptr.offsets,
+					tr->offsets_size))
+			copy_error = "offsets";
+	}
+
+	binder_lock_shared();
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	if (target_proc->is_dead || (reply && target_thread->is_dead)) {
+		return_error = BR_DEAD_REPLY;
+		goto err_target_died;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+	if (target_thread && target_thread->is_dead) {
+		target_thread = NULL;
+		t->to_thread = NULL;
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	if (copy_error) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, copy_error);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
@@ -1606,14 +1579,15 @@ static void binder_transaction(struct binder_proc *proc,
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
+			int ref_debug_id;
+
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp->binder,
+						       fp->cookie, fp->flags);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1621,14 +1595,20 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			if (security_binder_transfer_binder(proc->tsk, target_proc->tsk)) {
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
+			binder_proc_lock(target_proc);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				binder_proc_unlock(target_proc);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1637,18 +1617,28 @@ static void binder_transaction(struct binder_proc *proc,
 			else
 				fp->type = BINDER_TYPE_WEAK_HANDLE;
 			fp->handle = ref->desc;
+			ref_debug_id = ref->debug_id;
 			binder_inc_ref(ref, fp->type == BINDER_TYPE_HANDLE,
 				       &thread->todo);
+			binder_proc_unlock(target_proc);
 
 			binder_debug(BINDER_DEBUG_TRANSACTION,
-				     "        node %d u%p -> ref %d desc %d\n",
-				     node->debug_id, node->ptr, ref->debug_id,
-				     ref->desc);
+				     "        node %d u%p -> ref %d desc %ld\n",
+				     node->debug_id, node->ptr, ref_debug_id,
+				     fp->handle);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+			int ref_debug_id;
+			uint32_t ref_desc;
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1656,36 +1646,52 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
+			node = ref->node;
+			binder_node_inner_lock(node);
+			node->tmp_refs++;
+			binder_node_inner_unlock(node);
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			binder_proc_unlock(proc);
 			if (security_binder_transfer_binder(proc->tsk, target_proc->tsk)) {
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     ref_debug_id, ref_desc, node->debug_id,
+					     node->ptr);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+				int new_ref_debug_id;
+
+				binder_proc_lock(target_proc);
+				new_ref = binder_get_ref_for_node(target_proc, node);
 				if (new_ref == NULL) {
+					binder_proc_unlock(target_proc);
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
 				fp->handle = new_ref->desc;
+				new_ref_debug_id = new_ref->debug_id;
 				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
+				binder_proc_unlock(target_proc);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     "        ref %d desc %d -> ref %d desc %ld (node %d)\n",
+					     ref_debug_id, ref_desc, new_ref_debug_id,
+					     fp->handle, node->debug_id);
 			}
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1739,29 +1745,82 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->queue_time = ktime_get();
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	if (reply) {
+		s64 service_us = ktime_us_delta(t->queue_time,
+						in_reply_to->read_time);
+
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		trace_binder_transaction_reply(t, in_reply_to, service_us);
+		t->call_time = in_reply_to->queue_time;
+		trace_binder_transaction(reply, t, target_node);
+		binder_inner_proc_lock(target_proc);
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			binder_inner_proc_unlock(target_proc);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			goto err_bad_target_stack;
+		}
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, target_list);
+		trace_binder_transaction_wakeup(t);
+		binder_inner_proc_unlock(target_proc);
+
+		binder_inner_proc_lock(proc);
+		binder_latency_add(&proc->latency[BINDER_LATENCY_SERVICE],
+				   service_us);
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		binder_inner_proc_unlock(proc);
+		wake_up_interruptible(target_wait);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
+		trace_binder_transaction(reply, t, target_node);
+		binder_inner_proc_lock(proc);
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		binder_inner_proc_unlock(proc);
+
+		binder_inner_proc_lock(target_proc);
+		list_add_tail(&t->work.entry, target_list);
+		trace_binder_transaction_wakeup(t);
+		binder_inner_proc_unlock(target_proc);
+		wake_up_interruptible(target_wait);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		trace_binder_transaction(reply, t, target_node);
+		binder_inner_proc_lock(proc);
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		binder_inner_proc_unlock(proc);
+
+		binder_inner_proc_lock(target_proc);
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
+		list_add_tail(&t->work.entry, target_list);
+		if (target_wait)
+			trace_binder_transaction_wakeup(t);
+		binder_inner_proc_unlock(target_proc);
+		if (target_wait)
+			wake_up_interruptible(target_wait);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_node)
+		binder_put_node(target_node);
+	binder_transaction_unpin(pinned_proc, pinned_thread);
 	return;
 
 err_get_unused_fd_failed:
@@ -1771,11 +1830,14 @@ err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
+err_bad_target_stack:
 err_bad_offset:
 err_copy_data_failed:
+err_target_died:
+	t->buffer->target_node = NULL;
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
-	binder_free_buf(target_proc, t->buffer);
+	binder_alloc_free_buf(&target_proc->alloc, t->buffer);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1788,6 +1850,10 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_node) {
+		binder_dec_node(target_node, 1, 0);
+		binder_put_node(target_node);
+	}
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1799,12 +1865,25 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	/*
+	 * A failed reply to one of our own outgoing transactions may have
+	 * been posted meanwhile by a thread of another proc.
+	 */
+	binder_inner_proc_lock(proc);
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	binder_inner_proc_unlock(proc);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
+	binder_transaction_unpin(pinned_proc, pinned_thread);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1819,9 +1898,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1835,6 +1914,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_proc_lock(proc);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1850,6 +1930,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1878,6 +1959,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			binder_proc_unlock(proc);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1885,6 +1967,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *node_ptr;
 			void *cookie;
 			struct binder_node *node;
+			bool free_node;
 
 			if (get_user(node_ptr, (void * __user *)ptr))
 				return -EFAULT;
@@ -1911,8 +1994,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1920,6 +2005,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1930,16 +2017,22 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			free_node = binder_dec_node_ilocked(node,
+					cmd == BC_ACQUIRE_DONE, 0);
+			WARN_ON(free_node);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1957,20 +2050,22 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
-			buffer = binder_buffer_lookup(proc, data_ptr);
+			buffer = binder_alloc_prepare_to_free(&proc->alloc,
+							      data_ptr);
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
-			if (!buffer->allow_user_free) {
+			if (IS_ERR(buffer)) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			binder_inner_proc_lock(proc);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1980,15 +2075,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			binder_inner_proc_unlock(proc);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+				struct binder_node *buf_node;
+
+				buf_node = buffer->target_node;
+				binder_node_inner_lock(buf_node);
+				BUG_ON(!buf_node->has_async_transaction);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(buf_node->async_todo.next, &thread->todo);
+				binder_node_inner_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
-			binder_free_buf(proc, buffer);
+			binder_alloc_free_buf(&proc->alloc, buffer);
 			break;
 		}
 
@@ -2007,6 +2108,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2024,6 +2126,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
@@ -2058,8 +2161,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_proc_lock(proc);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2086,11 +2191,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					binder_proc_unlock(proc);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					binder_proc_unlock(proc);
+					binder_inner_proc_lock(proc);
 					thread->return_error = BR_ERROR;
+					binder_inner_proc_unlock(proc);
 					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 						     "binder: %d:%d "
 						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
@@ -2103,12 +2212,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					binder_inner_proc_lock(proc);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					binder_inner_proc_unlock(proc);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2117,6 +2228,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_proc_unlock(proc);
 					break;
 				}
 				death = ref->death;
@@ -2128,9 +2240,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_proc_unlock(proc);
 					break;
 				}
 				ref->death = NULL;
+				binder_inner_proc_lock(proc);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2143,7 +2257,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				binder_inner_proc_unlock(proc);
 			}
+			binder_proc_unlock(proc);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2153,6 +2269,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_inner_proc_lock(proc);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2164,6 +2281,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				binder_inner_proc_unlock(proc);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2180,6 +2298,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			binder_inner_proc_unlock(proc);
 		} break;
 
 		default:
@@ -2196,9 +2315,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2215,6 +2334,35 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+static int binder_put_node_cmd(struct binder_proc *proc,
+			       struct binder_thread *thread,
+			       void __user **ptrp,
+			       void __user *node_ptr,
+			       void __user *node_cookie,
+			       int node_debug_id,
+			       uint32_t cmd, const char *cmd_name)
+{
+	void __user *ptr = *ptrp;
+
+	if (put_user(cmd, (uint32_t __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(uint32_t);
+	if (put_user(node_ptr, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+	if (put_user(node_cookie, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+
+	binder_stat_br(proc, thread, cmd);
+	binder_debug(BINDER_DEBUG_USER_REFS,
+		     "binder: %d:%d %s %d u%p c%p\n",
+		     proc->pid, thread->pid, cmd_name, node_debug_id,
+		     node_ptr, node_cookie);
+	*ptrp = ptr;
+	return 0;
+}
+
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2233,22 +2381,30 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		thread->return_error2 = BR_OK;
+		if (return_error2 != BR_OK && ptr + sizeof(uint32_t) >= end)
+			return_error = BR_OK;	/* no room, keep it */
+		else
+			thread->return_error = BR_OK;
+		binder_inner_proc_unlock(proc);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+		}
+		if (return_error != BR_OK) {
+			if (put_user(return_error, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2256,7 +2412,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
+	binder_unlock_shared();
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2280,10 +2437,12 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_lock_shared();
+	binder_inner_proc_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	binder_inner_proc_unlock(proc);
 
 	if (ret)
 		return ret;
@@ -2293,28 +2452,42 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct list_head *list;
+		s64 queue_us, round_trip_us;
 
+		binder_inner_proc_lock(proc);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			binder_inner_proc_unlock(proc);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			binder_inner_proc_unlock(proc);
 			break;
+		}
+		w = list_first_entry(list, struct binder_work, entry);
+		list_del_init(&w->entry);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			binder_inner_proc_unlock(proc);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			binder_inner_proc_unlock(proc);
 			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
+			if (put_user(cmd, (uint32_t __user *)ptr)) {
+				binder_inner_proc_lock(proc);
+				list_add(&w->entry, list);
+				binder_inner_proc_unlock(proc);
 				return -EFAULT;
+			}
 			ptr += sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
@@ -2322,85 +2495,103 @@ retry:
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
 
-			list_del(&w->entry);
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
-			const char *cmd_name;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
+			int has_weak_ref, has_strong_ref;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
-			if (weak && !node->has_weak_ref) {
-				cmd = BR_INCREFS;
-				cmd_name = "BR_INCREFS";
+			int weak = !hlist_empty(&node->refs) ||
+				   node->local_weak_refs || node->tmp_refs ||
+				   strong;
+
+			/*
+			 * Work out every transition at once and tell user
+			 * space after dropping the lock; the node may be
+			 * gone by then.
+			 */
+			has_weak_ref = node->has_weak_ref;
+			has_strong_ref = node->has_strong_ref;
+			if (weak && !has_weak_ref) {
 				node->has_weak_ref = 1;
 				node->pending_weak_ref = 1;
 				node->local_weak_refs++;
-			} else if (strong && !node->has_strong_ref) {
-				cmd = BR_ACQUIRE;
-				cmd_name = "BR_ACQUIRE";
+			}
+			if (strong && !has_strong_ref) {
 				node->has_strong_ref = 1;
 				node->pending_strong_ref = 1;
 				node->local_strong_refs++;
-			} else if (!strong && node->has_strong_ref) {
-				cmd = BR_RELEASE;
-				cmd_name = "BR_RELEASE";
+			}
+			if (!strong && has_strong_ref)
 				node->has_strong_ref = 0;
-			} else if (!weak && node->has_weak_ref) {
-				cmd = BR_DECREFS;
-				cmd_name = "BR_DECREFS";
+			if (!weak && has_weak_ref)
 				node->has_weak_ref = 0;
-			}
-			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-
-				binder_stat_br(proc, thread, cmd);
-				binder_debug(BINDER_DEBUG_USER_REFS,
-					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
-			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
-			}
+			if (!weak && !strong) {
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				rb_erase(&node->rb_node, &proc->nodes);
+				binder_inner_proc_unlock(proc);
+				binder_free_node(node);
+			} else
+				binder_inner_proc_unlock(proc);
+
+			if (weak && !has_weak_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+							  node_ptr, node_cookie,
+							  node_debug_id,
+							  BR_INCREFS,
+							  "BR_INCREFS");
+			if (!ret && strong && !has_strong_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+							  node_ptr, node_cookie,
+							  node_debug_id,
+							  BR_ACQUIRE,
+							  "BR_ACQUIRE");
+			if (!ret && !strong && has_strong_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+							  node_ptr, node_cookie,
+							  node_debug_id,
+							  BR_RELEASE,
+							  "BR_RELEASE");
+			if (!ret && !weak && has_weak_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+							  node_ptr, node_cookie,
+							  node_debug_id,
+							  BR_DECREFS,
+							  "BR_DECREFS");
+			if (ret)
+				return ret;
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
-			uint32_t cmd;
+			void __user *cookie;
 
 			death = container_of(w, struct binder_ref_death, work);
+			cookie = death->cookie;
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				binder_inner_proc_unlock(proc);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
+				list_add_tail(&w->entry, &proc->delivered_death);
+				binder_inner_proc_unlock(proc);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2409,17 +2600,14 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			binder_inner_proc_unlock(proc);
+			break;
 		}
 
 		if (!t)
@@ -2458,16 +2646,19 @@ retry:
 		tr.data_size = t->buffer->data_size;
 		tr.offsets_size = t->buffer->offsets_size;
 		tr.data.ptr.buffer = (void *)t->buffer->data +
-					proc->user_buffer_offset;
+			binder_alloc_get_user_buffer_offset(&proc->alloc);
 		tr.data.ptr.offsets = tr.data.ptr.buffer +
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			binder_inner_proc_lock(proc);
+			list_add(&t->work.entry, list);
+			binder_inner_proc_unlock(proc);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
@@ -2482,16 +2673,30 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
+		t->read_time = ktime_get();
+		queue_us = ktime_us_delta(t->read_time, t->queue_time);
+		round_trip_us = 0;
+		if (cmd == BR_REPLY)
+			round_trip_us = ktime_us_delta(t->read_time,
+						       t->call_time);
+		binder_inner_proc_lock(proc);
+		binder_latency_add(&proc->latency[BINDER_LATENCY_QUEUE],
+				   queue_us);
+		if (cmd == BR_REPLY)
+			binder_latency_add(
+				&proc->latency[BINDER_LATENCY_ROUND_TRIP],
+				round_trip_us);
+		trace_binder_transaction_received(t, thread->pid, queue_us,
+						  round_trip_us);
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			binder_inner_proc_unlock(proc);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
+			binder_inner_proc_unlock(proc);
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2499,18 +2704,21 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	binder_inner_proc_lock(proc);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		binder_inner_proc_unlock(proc);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		binder_inner_proc_unlock(proc);
 	return 0;
 }
 
@@ -2539,7 +2747,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2554,23 +2763,42 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (!new_thread)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	binder_inner_proc_unlock(proc);
+	if (thread)
+		return thread;
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	binder_inner_proc_unlock(proc);
+	if (thread != new_thread)
+		kfree(new_thread);
 	return thread;
 }
 
@@ -2610,7 +2838,9 @@ static int binder_free_thread(struct binder_proc *proc,
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
-	kfree(thread);
+	thread->is_dead = true;
+	if (!thread->tmp_ref)
+		kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
 }
@@ -2622,12 +2852,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock_shared();
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		binder_unlock_shared();
+		return POLLERR;
+	}
 
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
+	binder_unlock_shared();
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2648,6 +2884,7 @@ static unsigned int binder_poll(struct file *filp,
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
+	int exclusive;
 	struct binder_proc *proc = filp->private_data;
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
@@ -2659,7 +2896,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	/* Only these change what others may look at under the shared lock */
+	exclusive = cmd == BINDER_SET_CONTEXT_MGR || cmd == BINDER_THREAD_EXIT;
+	if (exclusive)
+		binder_lock();
+	else
+		binder_lock_shared();
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2711,12 +2953,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_inner_proc_lock(proc);
+		proc->max_threads = max_threads;
+		binder_inner_proc_unlock(proc);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
 		if (binder_context_mgr_node != NULL) {
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
@@ -2737,7 +2985,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
+		binder_context_mgr_node = binder_new_node(proc, NULL, NULL, 0);
 		if (binder_context_mgr_node == NULL) {
 			ret = -ENOMEM;
 			goto err;
@@ -2746,6 +2994,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		binder_put_node(binder_context_mgr_node);
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
@@ -2771,7 +3020,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	if (exclusive)
+		binder_unlock();
+	else
+		binder_unlock_shared();
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2797,7 +3049,7 @@ static void binder_vma_close(struct vm_area_struct *vma)
 		     proc->pid, vma->vm_start, vma->vm_end,
 		     (vma->vm_end - vma->vm_start) / SZ_1K, vma->vm_flags,
 		     (unsigned long)pgprot_val(vma->vm_page_prot));
-	proc->vma = NULL;
+	binder_alloc_vma_close(&proc->alloc);
 	binder_defer_work(proc, BINDER_DEFERRED_PUT_FILES);
 }
 
@@ -2809,10 +3061,8 @@ static struct vm_operations_struct binder_vm_ops = {
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int ret;
-	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
-	struct binder_buffer *buffer;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2830,71 +3080,18 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	vma->vm_flags = (vma->vm_flags | VM_DONTCOPY) & ~VM_MAYWRITE;
 
-	mutex_lock(&binder_mmap_lock);
-	if (proc->buffer) {
-		ret = -EBUSY;
-		failure_string = "already mapped";
-		goto err_already_mapped;
-	}
-
-	area = get_vm_area(vma->vm_end - vma->vm_start, VM_IOREMAP);
-	if (area == NULL) {
-		ret = -ENOMEM;
-		failure_string = "get_vm_area";
-		goto err_get_vm_area_failed;
-	}
-	proc->buffer = area->addr;
-	proc->user_buffer_offset = vma->vm_start - (uintptr_t)proc->buffer;
-	mutex_unlock(&binder_mmap_lock);
-
-#ifdef CONFIG_CPU_CACHE_VIPT
-	if (cache_is_vipt_aliasing()) {
-		while (CACHE_COLOUR((vma->vm_start ^ (uint32_t)proc->buffer))) {
-			printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p bad alignment\n", proc->pid, vma->vm_start, vma->vm_end, proc->buffer);
-			vma->vm_start += PAGE_SIZE;
-		}
-	}
-#endif
-	proc->pages = kzalloc(sizeof(proc->pages[0]) * ((vma->vm_end - vma->vm_start) / PAGE_SIZE), GFP_KERNEL);
-	if (proc->pages == NULL) {
-		ret = -ENOMEM;
-		failure_string = "alloc page array";
-		goto err_alloc_pages_failed;
-	}
-	proc->buffer_size = vma->vm_end - vma->vm_start;
-
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
-		ret = -ENOMEM;
-		failure_string = "alloc small buf";
-		goto err_alloc_small_buf_failed;
-	}
-	buffer = proc->buffer;
-	INIT_LIST_HEAD(&proc->buffers);
-	list_add(&buffer->entry, &proc->buffers);
-	buffer->free = 1;
-	binder_insert_free_buffer(proc, buffer);
-	proc->free_async_space = proc->buffer_size / 2;
-	barrier();
+	ret = binder_alloc_mmap_handler(&proc->alloc, vma);
+	if (ret)
+		return ret;
 	proc->files = get_files_struct(proc->tsk);
-	proc->vma = vma;
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
-		 proc->pid, vma->vm_start, vma->vm_end, proc->buffer);*/
+		 proc->pid, vma->vm_start, vma->vm_end, proc->alloc.buffer);*/
 	return 0;
 
-err_alloc_small_buf_failed:
-	kfree(proc->pages);
-	proc->pages = NULL;
-err_alloc_pages_failed:
-	mutex_lock(&binder_mmap_lock);
-	vfree(proc->buffer);
-	proc->buffer = NULL;
-err_get_vm_area_failed:
-err_already_mapped:
-	mutex_unlock(&binder_mmap_lock);
 err_bad_arg:
 	printk(KERN_ERR "binder_mmap: %d %lx-%lx %s failed %d\n",
 	       proc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
@@ -2913,16 +3110,19 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->outer_lock);
+	spin_lock_init(&proc->inner_lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
+	binder_alloc_init(&proc->alloc, proc->tsk, proc->pid);
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
+	binder_stats_created(BINDER_STAT_PROC);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2974,14 +3174,15 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
-	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+	proc->is_dead = true;
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
@@ -3004,17 +3205,22 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+		if (hlist_empty(&node->refs) && !node->tmp_refs) {
+			binder_free_node(node);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
 
+			/*
+			 * Also kept while a sender still holds a tmp ref on
+			 * it, see binder_transaction().
+			 */
 			node->proc = NULL;
 			node->local_strong_refs = 0;
 			node->local_weak_refs = 0;
+			spin_lock(&binder_dead_nodes_lock);
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
+			spin_unlock(&binder_dead_nodes_lock);
 
 			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
 				incoming_refs++;
@@ -3042,11 +3248,27 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
 
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	/* A sender still filling one of our buffers frees us when done */
+	if (!proc->tmp_ref)
+		binder_free_proc(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct binder_buffer *buffer;
+	int buffers, page_count;
+
+	buffers = 0;
+	while ((buffer = binder_alloc_first_allocated(&proc->alloc))) {
+		binder_inner_proc_lock(proc);
 		t = buffer->transaction;
 		if (t) {
 			t->buffer = NULL;
@@ -3056,47 +3278,20 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
-		binder_free_buf(proc, buffer);
+		binder_inner_proc_unlock(proc);
+		binder_alloc_free_buf(&proc->alloc, buffer);
 		buffers++;
 	}
 
 	binder_stats_deleted(BINDER_STAT_PROC);
 
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				if (IS_ALIGNED((unsigned long)proc->pages[i],
-						4))
-					__free_page(proc->pages[i]);
-				else
-					printk(KERN_ERR "binder_release: %d: "
-						"page %d addr %p is invalid\n",
-						proc->pid, i, proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
+	page_count = binder_alloc_deferred_release(&proc->alloc);
 
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3108,7 +3303,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_lock();
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3133,9 +3328,9 @@ static void binder_deferred_func(struct work_struct *work)
 			binder_deferred_flush(proc);
 
 		if (defer & BINDER_DEFERRED_RELEASE)
-			binder_deferred_release(proc); /* frees proc */
+			binder_deferred_release(proc); /* may free proc */
 
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3178,15 +3373,6 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 		   t->buffer->data);
 }
 
-static void print_binder_buffer(struct seq_file *m, const char *prefix,
-				struct binder_buffer *buffer)
-{
-	seq_printf(m, "%s %d: %p size %zd:%zd %s\n",
-		   prefix, buffer->debug_id, buffer->data,
-		   buffer->data_size, buffer->offsets_size,
-		   buffer->transaction ? "active" : "delivered");
-}
-
 static void print_binder_work(struct seq_file *m, const char *prefix,
 			      const char *transaction_prefix,
 			      struct binder_work *w)
@@ -3316,9 +3502,7 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
-	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
-		print_binder_buffer(m, "  buffer",
-				    rb_entry(n, struct binder_buffer, rb_node));
+	binder_alloc_print_allocated(m, &proc->alloc);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3388,17 +3572,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int count = atomic_read(&stats->bc[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int count = atomic_read(&stats->br[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3406,14 +3594,26 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
+static void print_binder_lock_stats(struct seq_file *m, const char *name,
+				    struct binder_lock_stats *stats)
+{
+	seq_printf(m, "%s lock: acquired %d contended %d wait %lld us\n",
+		   name, atomic_read(&stats->acquired),
+		   atomic_read(&stats->contended),
+		   (long long)div_u64(atomic64_read(&stats->wait_ns),
+				      NSEC_PER_USEC));
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
@@ -3430,7 +3630,8 @@ static void print_binder_proc_stats(struct seq_file *m,
 			"  ready threads %d\n"
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads,
+			binder_alloc_get_free_async_space(&proc->alloc));
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
@@ -3447,9 +3648,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	}
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
-	count = 0;
-	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
-		count++;
+	count = binder_alloc_get_allocated_count(&proc->alloc);
 	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
@@ -3467,6 +3666,38 @@ static void print_binder_proc_stats(struct seq_file *m,
 	print_binder_stats(m, "  ", &proc->stats);
 }
 
+static void print_binder_latency_hist(struct seq_file *m, const char *name,
+				      struct binder_latency_hist *hist)
+{
+	int i;
+
+	if (!hist->count)
+		return;
+	seq_printf(m, "  %s: count %u avg %llu us max %u us\n", name,
+		   hist->count, div_u64(hist->total_us, hist->count),
+		   hist->max_us);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS - 1; i++) {
+		if (hist->bucket[i])
+			seq_printf(m, "    < %u us: %u\n", 1U << i,
+				   hist->bucket[i]);
+	}
+	if (hist->bucket[i])
+		seq_printf(m, "    >= %u us: %u\n", 1U << (i - 1),
+			   hist->bucket[i]);
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(proc->latency) !=
+		     ARRAY_SIZE(binder_latency_strings));
+	seq_printf(m, "proc %d\n", proc->pid);
+	for (i = 0; i < ARRAY_SIZE(proc->latency); i++)
+		print_binder_latency_hist(m, binder_latency_strings[i],
+					  &proc->latency[i]);
+}
 
 static int binder_state_show(struct seq_file *m, void *unused)
 {
@@ -3476,7 +3707,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder state:\n");
 
@@ -3485,10 +3716,12 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
 		print_binder_node(m, node);
 
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3499,16 +3732,24 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
-
+	print_binder_lock_stats(m, "main", &binder_main_lock_stats);
+	print_binder_lock_stats(m, "main shared",
+				&binder_main_lock_shared_stats);
+	print_binder_lock_stats(m, "procs", &binder_procs_lock_stats);
+	print_binder_lock_stats(m, "outer", &binder_outer_lock_stats);
+	binder_alloc_print_stats(m);
+
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3519,13 +3760,34 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder transactions:\n");
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
+	mutex_unlock(&binder_procs_lock);
+	if (do_lock)
+		binder_unlock();
+	return 0;
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_lock();
+
+	seq_puts(m, "binder latency:\n");
+	binder_mutex_lock(&binder_procs_lock, &binder_procs_lock_stats);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	mutex_unlock(&binder_procs_lock);
+	if (do_lock)
+		binder_unlock();
 	return 0;
 }
 
@@ -3535,11 +3797,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3587,6 +3849,7 @@ static struct miscdevice binder_miscdev = {
 BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
+BINDER_DEBUG_ENTRY(latency);
 BINDER_DEBUG_ENTRY(transaction_log);
 
 static int __init binder_init(void)
@@ -3597,6 +3860,8 @@ static int __init binder_init(void)
 	if (!binder_deferred_workqueue)
 		return -ENOMEM;
 
+	binder_alloc_shrinker_init();
+
 	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
 	if (binder_debugfs_dir_entry_root)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
@@ -3618,6 +3883,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    NULL,
 				    &binder_transactions_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 		debugfs_create_file("transaction_log",
 				    S_IRUGO,
 				    binder_debugfs_dir_entry_root,
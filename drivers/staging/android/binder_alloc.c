@@ -0,0 +1,961 @@
+/* binder_alloc.c
+ *
+ * Android IPC Subsystem
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <asm/cacheflush.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "binder_alloc.h"
+
+/* This is only defined in include/asm-arm/sizes.h */
+#ifndef SZ_1K
+#define SZ_1K                               0x400
+#endif
+
+static DEFINE_MUTEX(binder_alloc_mmap_lock);
+
+/* All mapped allocators, walked by the shrinker */
+static DEFINE_MUTEX(binder_allocs_lock);
+static LIST_HEAD(binder_allocs);
+
+/* Pages on all lru lists */
+static atomic_t binder_alloc_lru_pages = ATOMIC_INIT(0);
+
+enum {
+	BINDER_DEBUG_USER_ERROR             = 1U << 0,
+	BINDER_DEBUG_OPEN_CLOSE             = 1U << 1,
+	BINDER_DEBUG_BUFFER_ALLOC           = 1U << 2,
+	BINDER_DEBUG_BUFFER_ALLOC_ASYNC     = 1U << 3,
+};
+static uint32_t binder_alloc_debug_mask = BINDER_DEBUG_USER_ERROR;
+module_param_named(debug_mask, binder_alloc_debug_mask,
+		   uint, S_IWUSR | S_IRUGO);
+
+/* Freed pages each proc keeps mapped for reuse, 0 disables the cache */
+static int binder_alloc_cached_pages = 32;
+module_param_named(cached_pages, binder_alloc_cached_pages,
+		   int, S_IWUSR | S_IRUGO);
+
+#define binder_alloc_debug(mask, x...) \
+	do { \
+		if (binder_alloc_debug_mask & mask) \
+			printk(KERN_INFO x); \
+	} while (0)
+
+static struct binder_alloc_stats {
+	atomic_t lock_acquired;
+	atomic_t lock_contended;
+	atomic64_t lock_wait_ns;
+	atomic_t allocs;
+	atomic_t alloc_failed;
+	atomic64_t alloc_ns;
+	atomic_t alloc_max_ns;
+	atomic_t pages_new;
+	atomic_t pages_reused;
+	atomic_t pages_freed;
+	atomic_t pages_shrunk;
+} binder_alloc_stats;
+
+static void binder_alloc_lock(struct binder_alloc *alloc)
+{
+	ktime_t start;
+
+	if (!mutex_trylock(&alloc->mutex)) {
+		start = ktime_get();
+		mutex_lock(&alloc->mutex);
+		atomic_inc(&binder_alloc_stats.lock_contended);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			     &binder_alloc_stats.lock_wait_ns);
+	}
+	atomic_inc(&binder_alloc_stats.lock_acquired);
+}
+
+static inline void binder_alloc_unlock(struct binder_alloc *alloc)
+{
+	mutex_unlock(&alloc->mutex);
+}
+
+static void binder_alloc_account(ktime_t start, struct binder_buffer *buffer)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int max;
+
+	atomic_inc(&binder_alloc_stats.allocs);
+	if (buffer == NULL)
+		atomic_inc(&binder_alloc_stats.alloc_failed);
+	atomic64_add(ns, &binder_alloc_stats.alloc_ns);
+	if (ns > INT_MAX)
+		ns = INT_MAX;
+	do {
+		max = atomic_read(&binder_alloc_stats.alloc_max_ns);
+		if (ns <= max)
+			break;
+	} while (atomic_cmpxchg(&binder_alloc_stats.alloc_max_ns,
+				max, ns) != max);
+}
+
+static size_t binder_buffer_size(struct binder_alloc *alloc,
+				 struct binder_buffer *buffer)
+{
+	if (list_is_last(&buffer->entry, &alloc->buffers))
+		return alloc->buffer + alloc->buffer_size - (void *)buffer->data;
+	else
+		return (size_t)list_entry(buffer->entry.next,
+			struct binder_buffer, entry) - (size_t)buffer->data;
+}
+
+static void binder_insert_free_buffer(struct binder_alloc *alloc,
+				      struct binder_buffer *new_buffer)
+{
+	struct rb_node **p = &alloc->free_buffers.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	size_t new_buffer_size;
+
+	BUG_ON(!new_buffer->free);
+
+	new_buffer_size = binder_buffer_size(alloc, new_buffer);
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: add free buffer, size %zd, "
+		     "at %p\n", alloc->pid, new_buffer_size, new_buffer);
+
+	while (*p) {
+		parent = *p;
+		buffer = rb_entry(parent, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+
+		buffer_size = binder_buffer_size(alloc, buffer);
+
+		if (new_buffer_size < buffer_size)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new_buffer->rb_node, parent, p);
+	rb_insert_color(&new_buffer->rb_node, &alloc->free_buffers);
+}
+
+static void binder_insert_allocated_buffer(struct binder_alloc *alloc,
+					   struct binder_buffer *new_buffer)
+{
+	struct rb_node **p = &alloc->allocated_buffers.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_buffer *buffer;
+
+	BUG_ON(new_buffer->free);
+
+	while (*p) {
+		parent = *p;
+		buffer = rb_entry(parent, struct binder_buffer, rb_node);
+		BUG_ON(buffer->free);
+
+		if (new_buffer < buffer)
+			p = &parent->rb_left;
+		else if (new_buffer > buffer)
+			p = &parent->rb_right;
+		else
+			BUG();
+	}
+	rb_link_node(&new_buffer->rb_node, parent, p);
+	rb_insert_color(&new_buffer->rb_node, &alloc->allocated_buffers);
+}
+
+static struct binder_buffer *__binder_alloc_buffer_lookup(
+	struct binder_alloc *alloc, void __user *user_ptr)
+{
+	struct rb_node *n = alloc->allocated_buffers.rb_node;
+	struct binder_buffer *buffer;
+	struct binder_buffer *kern_ptr;
+
+	kern_ptr = user_ptr - alloc->user_buffer_offset
+		- offsetof(struct binder_buffer, data);
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(buffer->free);
+
+		if (kern_ptr < buffer)
+			n = n->rb_left;
+		else if (kern_ptr > buffer)
+			n = n->rb_right;
+		else
+			return buffer;
+	}
+	return NULL;
+}
+
+/*
+ * Look up the buffer user space asks to free and claim it, so that two
+ * threads freeing the same buffer at once do not both get it.  Returns
+ * NULL if there is no such buffer and ERR_PTR(-EPERM) if it was never
+ * returned to user space or is already being freed.
+ */
+struct binder_buffer *binder_alloc_prepare_to_free(struct binder_alloc *alloc,
+						   void __user *user_ptr)
+{
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(alloc);
+	buffer = __binder_alloc_buffer_lookup(alloc, user_ptr);
+	if (buffer) {
+		if (buffer->allow_user_free)
+			buffer->allow_user_free = 0;
+		else
+			buffer = ERR_PTR(-EPERM);
+	}
+	binder_alloc_unlock(alloc);
+	return buffer;
+}
+
+static void binder_alloc_free_page(struct binder_alloc *alloc, int index,
+				   struct vm_area_struct *vma)
+{
+	void *page_addr = alloc->buffer + index * PAGE_SIZE;
+
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			alloc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(alloc->pages[index]);
+	alloc->pages[index] = NULL;
+}
+
+/*
+ * Unmap and free up to nr_pages cached pages, least recently freed first.
+ * Called with alloc->mutex held.  The shrinker passes trylock so that it
+ * never waits for the mmap_sem of the process it is trimming.
+ */
+static int binder_alloc_trim_lru(struct binder_alloc *alloc, int nr_pages,
+				 bool trylock)
+{
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int freed = 0;
+
+	if (nr_pages <= 0 || list_empty(&alloc->lru))
+		return 0;
+
+	mm = get_task_mm(alloc->tsk);
+	if (mm) {
+		if (!trylock)
+			down_read(&mm->mmap_sem);
+		else if (!down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return 0;
+		}
+	}
+	vma = alloc->vma;
+	if (vma && mm != vma->vm_mm)
+		vma = NULL;
+
+	while (freed < nr_pages && !list_empty(&alloc->lru)) {
+		struct list_head *entry = alloc->lru.next;
+
+		list_del_init(entry);
+		binder_alloc_free_page(alloc, entry - alloc->page_lru, vma);
+		freed++;
+	}
+	alloc->lru_count -= freed;
+	atomic_sub(freed, &binder_alloc_lru_pages);
+	atomic_add(freed, &binder_alloc_stats.pages_freed);
+
+	if (mm) {
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return freed;
+}
+
+static void binder_alloc_trim_cache(struct binder_alloc *alloc)
+{
+	binder_alloc_trim_lru(alloc,
+		alloc->lru_count - max(binder_alloc_cached_pages, 0), false);
+}
+
+static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
+				    void *start, void *end,
+				    struct vm_area_struct *vma)
+{
+	void *page_addr;
+	void *run_start = start;
+	void *run_addr = NULL;
+	unsigned long user_page_addr;
+	struct vm_struct tmp_area;
+	struct page **page;
+	struct mm_struct *mm;
+	int index;
+	int ret;
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: %s pages %p-%p\n", alloc->pid,
+		     allocate ? "allocate" : "free", start, end);
+
+	if (end <= start)
+		return 0;
+
+	if (allocate == 0)
+		goto free_range;
+
+	if (vma)
+		mm = NULL;
+	else
+		mm = get_task_mm(alloc->tsk);
+
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		vma = alloc->vma;
+		if (vma && mm != vma->vm_mm) {
+			pr_err("binder: %d: vma mm and task mm mismatch\n",
+				alloc->pid);
+			vma = NULL;
+		}
+	}
+
+	if (vma == NULL) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
+		       "map pages in userspace, no vma\n", alloc->pid);
+		goto err_no_vma;
+	}
+
+	page_addr = start;
+	while (page_addr < end) {
+		index = (page_addr - alloc->buffer) / PAGE_SIZE;
+		if (alloc->pages[index]) {
+			/* Still mapped from an earlier buffer, reuse it */
+			BUG_ON(list_empty(&alloc->page_lru[index]));
+			list_del_init(&alloc->page_lru[index]);
+			alloc->lru_count--;
+			atomic_dec(&binder_alloc_lru_pages);
+			atomic_inc(&binder_alloc_stats.pages_reused);
+			page_addr += PAGE_SIZE;
+			continue;
+		}
+
+		/* Populate the run of missing pages with one kernel map */
+		run_start = page_addr;
+		page = &alloc->pages[index];
+		while (page_addr < end && *page == NULL) {
+			*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+			if (*page == NULL) {
+				printk(KERN_ERR "binder: %d: binder_alloc_buf "
+				       "failed for page at %p\n",
+				       alloc->pid, page_addr);
+				goto err_alloc_page_failed;
+			}
+			page_addr += PAGE_SIZE;
+			page++;
+		}
+		tmp_area.addr = run_start;
+		tmp_area.size = page_addr - run_start +
+				PAGE_SIZE /* guard page? */;
+		page = &alloc->pages[index];
+		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page);
+		if (ret) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+			       "to map pages at %p-%p in kernel\n",
+			       alloc->pid, run_start, page_addr);
+			goto err_map_kernel_failed;
+		}
+		for (run_addr = run_start; run_addr < page_addr;
+		     run_addr += PAGE_SIZE) {
+			user_page_addr =
+				(uintptr_t)run_addr + alloc->user_buffer_offset;
+			ret = vm_insert_page(vma, user_page_addr,
+				alloc->pages[(run_addr - alloc->buffer) /
+					     PAGE_SIZE]);
+			if (ret) {
+				printk(KERN_ERR "binder: %d: binder_alloc_buf "
+				       "failed to map page at %lx in "
+				       "userspace\n", alloc->pid,
+				       user_page_addr);
+				goto err_vm_insert_page_failed;
+			}
+		}
+		atomic_add((page_addr - run_start) / PAGE_SIZE,
+			   &binder_alloc_stats.pages_new);
+	}
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return 0;
+
+err_vm_insert_page_failed:
+	if (run_addr > run_start)
+		zap_page_range(vma, (uintptr_t)run_start +
+			alloc->user_buffer_offset, run_addr - run_start, NULL);
+err_map_kernel_failed:
+	unmap_kernel_range((unsigned long)run_start, page_addr - run_start);
+err_alloc_page_failed:
+	for (run_addr = run_start; run_addr < page_addr;
+	     run_addr += PAGE_SIZE) {
+		page = &alloc->pages[(run_addr - alloc->buffer) / PAGE_SIZE];
+		__free_page(*page);
+		*page = NULL;
+	}
+	/* Pages populated or reused before the failing run go back to lru */
+	binder_update_page_range(alloc, 0, start, run_start, NULL);
+err_no_vma:
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return -ENOMEM;
+
+free_range:
+	/*
+	 * Keep the pages mapped; binder_alloc_trim_cache() or the shrinker
+	 * unmaps them once the cache is over its limit.
+	 */
+	for (page_addr = end - PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE) {
+		index = (page_addr - alloc->buffer) / PAGE_SIZE;
+		BUG_ON(alloc->pages[index] == NULL);
+		list_add_tail(&alloc->page_lru[index], &alloc->lru);
+		alloc->lru_count++;
+		atomic_inc(&binder_alloc_lru_pages);
+	}
+	return 0;
+}
+
+static struct binder_buffer *__binder_alloc_new_buf(struct binder_alloc *alloc,
+						    size_t data_size,
+						    size_t offsets_size,
+						    int is_async)
+{
+	struct rb_node *n = alloc->free_buffers.rb_node;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	struct rb_node *best_fit = NULL;
+	void *has_page_addr;
+	void *end_page_addr;
+	size_t size;
+
+	if (alloc->vma == NULL) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
+		       alloc->pid);
+		return NULL;
+	}
+
+	size = ALIGN(data_size, sizeof(void *)) +
+		ALIGN(offsets_size, sizeof(void *));
+
+	if (size < data_size || size < offsets_size) {
+		binder_alloc_debug(BINDER_DEBUG_USER_ERROR,
+			"binder: %d: got transaction with invalid "
+			"size %zd-%zd\n", alloc->pid, data_size, offsets_size);
+		return NULL;
+	}
+
+	if (is_async &&
+	    alloc->free_async_space < size + sizeof(struct binder_buffer)) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: binder_alloc_buf size %zd"
+			     "failed, no async space left\n", alloc->pid, size);
+		return NULL;
+	}
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+		buffer_size = binder_buffer_size(alloc, buffer);
+
+		if (size < buffer_size) {
+			best_fit = n;
+			n = n->rb_left;
+		} else if (size > buffer_size)
+			n = n->rb_right;
+		else {
+			best_fit = n;
+			break;
+		}
+	}
+	if (best_fit == NULL) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
+		       "no address space\n", alloc->pid, size);
+		return NULL;
+	}
+	if (n == NULL) {
+		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+		buffer_size = binder_buffer_size(alloc, buffer);
+	}
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: binder_alloc_buf size %zd got buff"
+		     "er %p size %zd\n", alloc->pid, size, buffer, buffer_size);
+
+	has_page_addr =
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
+	if (n == NULL) {
+		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = size; /* no room for other buffers */
+		else
+			buffer_size = size + sizeof(struct binder_buffer);
+	}
+	end_page_addr =
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
+	if (end_page_addr > has_page_addr)
+		end_page_addr = has_page_addr;
+	if (binder_update_page_range(alloc, 1,
+	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
+		return NULL;
+
+	rb_erase(best_fit, &alloc->free_buffers);
+	buffer->free = 0;
+	binder_insert_allocated_buffer(alloc, buffer);
+	if (buffer_size != size) {
+		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+		list_add(&new_buffer->entry, &buffer->entry);
+		new_buffer->free = 1;
+		binder_insert_free_buffer(alloc, new_buffer);
+	}
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: binder_alloc_buf size %zd got "
+		     "%p\n", alloc->pid, size, buffer);
+	buffer->data_size = data_size;
+	buffer->offsets_size = offsets_size;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->async_transaction = is_async;
+	if (is_async) {
+		alloc->free_async_space -= size + sizeof(struct binder_buffer);
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
+			     "binder: %d: binder_alloc_buf size %zd "
+			     "async free %zd\n", alloc->pid, size,
+			     alloc->free_async_space);
+	}
+
+	return buffer;
+}
+
+struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
+					   size_t data_size,
+					   size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+	ktime_t start = ktime_get();
+
+	binder_alloc_lock(alloc);
+	buffer = __binder_alloc_new_buf(alloc, data_size, offsets_size,
+					is_async);
+	if (buffer == NULL)
+		binder_alloc_trim_cache(alloc);
+	binder_alloc_unlock(alloc);
+	binder_alloc_account(start, buffer);
+	return buffer;
+}
+
+static void *buffer_start_page(struct binder_buffer *buffer)
+{
+	return (void *)((uintptr_t)buffer & PAGE_MASK);
+}
+
+static void *buffer_end_page(struct binder_buffer *buffer)
+{
+	return (void *)(((uintptr_t)(buffer + 1) - 1) & PAGE_MASK);
+}
+
+static void binder_delete_free_buffer(struct binder_alloc *alloc,
+				      struct binder_buffer *buffer)
+{
+	struct binder_buffer *prev, *next = NULL;
+	int free_page_end = 1;
+	int free_page_start = 1;
+
+	BUG_ON(alloc->buffers.next == &buffer->entry);
+	prev = list_entry(buffer->entry.prev, struct binder_buffer, entry);
+	BUG_ON(!prev->free);
+	if (buffer_end_page(prev) == buffer_start_page(buffer)) {
+		free_page_start = 0;
+		if (buffer_end_page(prev) == buffer_end_page(buffer))
+			free_page_end = 0;
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: merge free, buffer %p "
+			     "share page with %p\n", alloc->pid, buffer, prev);
+	}
+
+	if (!list_is_last(&buffer->entry, &alloc->buffers)) {
+		next = list_entry(buffer->entry.next,
+				  struct binder_buffer, entry);
+		if (buffer_start_page(next) == buffer_end_page(buffer)) {
+			free_page_end = 0;
+			if (buffer_start_page(next) ==
+			    buffer_start_page(buffer))
+				free_page_start = 0;
+			binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: merge free, buffer"
+				     " %p share page with %p\n", alloc->pid,
+				     buffer, prev);
+		}
+	}
+	list_del(&buffer->entry);
+	if (free_page_start || free_page_end) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: merge free, buffer %p do "
+			     "not share page%s%s with with %p or %p\n",
+			     alloc->pid, buffer, free_page_start ? "" : " end",
+			     free_page_end ? "" : " start", prev, next);
+		binder_update_page_range(alloc, 0, free_page_start ?
+			buffer_start_page(buffer) : buffer_end_page(buffer),
+			(free_page_end ? buffer_end_page(buffer) :
+			buffer_start_page(buffer)) + PAGE_SIZE, NULL);
+	}
+}
+
+static void __binder_alloc_free_buf(struct binder_alloc *alloc,
+				    struct binder_buffer *buffer)
+{
+	size_t size, buffer_size;
+
+	buffer_size = binder_buffer_size(alloc, buffer);
+
+	size = ALIGN(buffer->data_size, sizeof(void *)) +
+		ALIGN(buffer->offsets_size, sizeof(void *));
+
+	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: binder_free_buf %p size %zd buffer"
+		     "_size %zd\n", alloc->pid, buffer, size, buffer_size);
+
+	BUG_ON(buffer->free);
+	BUG_ON(size > buffer_size);
+	BUG_ON(buffer->transaction != NULL);
+	BUG_ON((void *)buffer < alloc->buffer);
+	BUG_ON((void *)buffer > alloc->buffer + alloc->buffer_size);
+
+	if (buffer->async_transaction) {
+		alloc->free_async_space += size + sizeof(struct binder_buffer);
+
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
+			     "binder: %d: binder_free_buf size %zd "
+			     "async free %zd\n", alloc->pid, size,
+			     alloc->free_async_space);
+	}
+
+	binder_update_page_range(alloc, 0,
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
+		NULL);
+	rb_erase(&buffer->rb_node, &alloc->allocated_buffers);
+	buffer->free = 1;
+	if (!list_is_last(&buffer->entry, &alloc->buffers)) {
+		struct binder_buffer *next = list_entry(buffer->entry.next,
+						struct binder_buffer, entry);
+		if (next->free) {
+			rb_erase(&next->rb_node, &alloc->free_buffers);
+			binder_delete_free_buffer(alloc, next);
+		}
+	}
+	if (alloc->buffers.next != &buffer->entry) {
+		struct binder_buffer *prev = list_entry(buffer->entry.prev,
+						struct binder_buffer, entry);
+		if (prev->free) {
+			binder_delete_free_buffer(alloc, buffer);
+			rb_erase(&prev->rb_node, &alloc->free_buffers);
+			buffer = prev;
+		}
+	}
+	binder_insert_free_buffer(alloc, buffer);
+}
+
+void binder_alloc_free_buf(struct binder_alloc *alloc,
+			   struct binder_buffer *buffer)
+{
+	binder_alloc_lock(alloc);
+	__binder_alloc_free_buf(alloc, buffer);
+	binder_alloc_trim_cache(alloc);
+	binder_alloc_unlock(alloc);
+}
+
+struct binder_buffer *binder_alloc_first_allocated(struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+
+	binder_alloc_lock(alloc);
+	n = rb_first(&alloc->allocated_buffers);
+	binder_alloc_unlock(alloc);
+	return n ? rb_entry(n, struct binder_buffer, rb_node) : NULL;
+}
+
+int binder_alloc_mmap_handler(struct binder_alloc *alloc,
+			      struct vm_area_struct *vma)
+{
+	int ret;
+	int i;
+	struct vm_struct *area;
+	const char *failure_string;
+	struct binder_buffer *buffer;
+	size_t nr_pages;
+
+	mutex_lock(&binder_alloc_mmap_lock);
+	if (alloc->buffer) {
+		ret = -EBUSY;
+		failure_string = "already mapped";
+		goto err_already_mapped;
+	}
+
+	area = get_vm_area(vma->vm_end - vma->vm_start, VM_IOREMAP);
+	if (area == NULL) {
+		ret = -ENOMEM;
+		failure_string = "get_vm_area";
+		goto err_get_vm_area_failed;
+	}
+	alloc->buffer = area->addr;
+	alloc->user_buffer_offset = vma->vm_start - (uintptr_t)alloc->buffer;
+	mutex_unlock(&binder_alloc_mmap_lock);
+
+#ifdef CONFIG_CPU_CACHE_VIPT
+	if (cache_is_vipt_aliasing()) {
+		while (CACHE_COLOUR((vma->vm_start ^ (uint32_t)alloc->buffer))) {
+			printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p bad alignment\n", alloc->pid, vma->vm_start, vma->vm_end, alloc->buffer);
+			vma->vm_start += PAGE_SIZE;
+		}
+	}
+#endif
+	nr_pages = (vma->vm_end - vma->vm_start) / PAGE_SIZE;
+	alloc->pages = kzalloc(sizeof(alloc->pages[0]) * nr_pages, GFP_KERNEL);
+	if (alloc->pages == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc page array";
+		goto err_alloc_pages_failed;
+	}
+	alloc->page_lru = kmalloc(sizeof(alloc->page_lru[0]) * nr_pages,
+				  GFP_KERNEL);
+	if (alloc->page_lru == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc page lru";
+		goto err_alloc_page_lru_failed;
+	}
+	for (i = 0; i < nr_pages; i++)
+		INIT_LIST_HEAD(&alloc->page_lru[i]);
+	alloc->buffer_size = vma->vm_end - vma->vm_start;
+
+	if (binder_update_page_range(alloc, 1, alloc->buffer,
+				     alloc->buffer + PAGE_SIZE, vma)) {
+		ret = -ENOMEM;
+		failure_string = "alloc small buf";
+		goto err_alloc_small_buf_failed;
+	}
+	buffer = alloc->buffer;
+	list_add(&buffer->entry, &alloc->buffers);
+	buffer->free = 1;
+	binder_insert_free_buffer(alloc, buffer);
+	alloc->free_async_space = alloc->buffer_size / 2;
+	barrier();
+	alloc->vma = vma;
+
+	mutex_lock(&binder_allocs_lock);
+	list_add_tail(&alloc->alloc_node, &binder_allocs);
+	mutex_unlock(&binder_allocs_lock);
+	return 0;
+
+err_alloc_small_buf_failed:
+	kfree(alloc->page_lru);
+	alloc->page_lru = NULL;
+err_alloc_page_lru_failed:
+	kfree(alloc->pages);
+	alloc->pages = NULL;
+err_alloc_pages_failed:
+	mutex_lock(&binder_alloc_mmap_lock);
+	vfree(alloc->buffer);
+	alloc->buffer = NULL;
+err_get_vm_area_failed:
+err_already_mapped:
+	mutex_unlock(&binder_alloc_mmap_lock);
+	printk(KERN_ERR "binder_mmap: %d %lx-%lx %s failed %d\n",
+	       alloc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
+	return ret;
+}
+
+void binder_alloc_vma_close(struct binder_alloc *alloc)
+{
+	/* Called with mmap_sem held, so alloc->mutex must not be taken */
+	alloc->vma = NULL;
+}
+
+int binder_alloc_deferred_release(struct binder_alloc *alloc)
+{
+	int i;
+	int page_count = 0;
+
+	mutex_lock(&binder_allocs_lock);
+	list_del_init(&alloc->alloc_node);
+	mutex_unlock(&binder_allocs_lock);
+
+	binder_alloc_lock(alloc);
+	BUG_ON(alloc->vma);
+	if (alloc->pages) {
+		for (i = 0; i < alloc->buffer_size / PAGE_SIZE; i++) {
+			void *page_addr = alloc->buffer + i * PAGE_SIZE;
+
+			if (!alloc->pages[i])
+				continue;
+			if (!list_empty(&alloc->page_lru[i])) {
+				list_del_init(&alloc->page_lru[i]);
+				alloc->lru_count--;
+				atomic_dec(&binder_alloc_lru_pages);
+			} else {
+				binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+					     "binder_release: %d: "
+					     "page %d at %p not freed\n",
+					     alloc->pid, i, page_addr);
+				page_count++;
+			}
+			if (!IS_ALIGNED((unsigned long)alloc->pages[i], 4)) {
+				printk(KERN_ERR "binder_release: %d: "
+					"page %d addr %p is invalid\n",
+					alloc->pid, i, alloc->pages[i]);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				continue;
+			}
+			binder_alloc_free_page(alloc, i, NULL);
+		}
+		kfree(alloc->page_lru);
+		kfree(alloc->pages);
+		vfree(alloc->buffer);
+	}
+	binder_alloc_unlock(alloc);
+	return page_count;
+}
+
+static void print_binder_buffer(struct seq_file *m, const char *prefix,
+				struct binder_buffer *buffer)
+{
+	seq_printf(m, "%s %d: %p size %zd:%zd %s\n",
+		   prefix, buffer->debug_id, buffer->data,
+		   buffer->data_size, buffer->offsets_size,
+		   buffer->transaction ? "active" : "delivered");
+}
+
+void binder_alloc_print_allocated(struct seq_file *m,
+				  struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+
+	binder_alloc_lock(alloc);
+	for (n = rb_first(&alloc->allocated_buffers); n != NULL; n = rb_next(n))
+		print_binder_buffer(m, "  buffer",
+				    rb_entry(n, struct binder_buffer, rb_node));
+	binder_alloc_unlock(alloc);
+}
+
+int binder_alloc_get_allocated_count(struct binder_alloc *alloc)
+{
+	struct rb_node *n;
+	int count = 0;
+
+	binder_alloc_lock(alloc);
+	for (n = rb_first(&alloc->allocated_buffers); n != NULL; n = rb_next(n))
+		count++;
+	binder_alloc_unlock(alloc);
+	return count;
+}
+
+size_t binder_alloc_get_free_async_space(struct binder_alloc *alloc)
+{
+	size_t free_async_space;
+
+	binder_alloc_lock(alloc);
+	free_async_space = alloc->free_async_space;
+	binder_alloc_unlock(alloc);
+	return free_async_space;
+}
+
+void binder_alloc_print_stats(struct seq_file *m)
+{
+	struct binder_alloc_stats *stats = &binder_alloc_stats;
+	int allocs = atomic_read(&stats->allocs);
+
+	seq_printf(m, "alloc lock: acquired %d contended %d wait %lld us\n",
+		   atomic_read(&stats->lock_acquired),
+		   atomic_read(&stats->lock_contended),
+		   (long long)div_u64(atomic64_read(&stats->lock_wait_ns),
+				      NSEC_PER_USEC));
+	seq_printf(m, "alloc buffers: %d failed %d avg %lld ns max %d ns\n",
+		   allocs, atomic_read(&stats->alloc_failed),
+		   allocs ? (long long)div_u64(atomic64_read(&stats->alloc_ns),
+					       allocs) : 0LL,
+		   atomic_read(&stats->alloc_max_ns));
+	seq_printf(m, "alloc pages: new %d reused %d freed %d shrunk %d "
+		   "cached %d\n",
+		   atomic_read(&stats->pages_new),
+		   atomic_read(&stats->pages_reused),
+		   atomic_read(&stats->pages_freed),
+		   atomic_read(&stats->pages_shrunk),
+		   atomic_read(&binder_alloc_lru_pages));
+}
+
+void binder_alloc_init(struct binder_alloc *alloc, struct task_struct *tsk,
+		       int pid)
+{
+	mutex_init(&alloc->mutex);
+	alloc->tsk = tsk;
+	alloc->pid = pid;
+	INIT_LIST_HEAD(&alloc->buffers);
+	INIT_LIST_HEAD(&alloc->lru);
+	INIT_LIST_HEAD(&alloc->alloc_node);
+}
+
+static int binder_alloc_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct binder_alloc *alloc;
+	int nr_to_scan = sc->nr_to_scan;
+	int freed;
+
+	if (nr_to_scan <= 0)
+		return atomic_read(&binder_alloc_lru_pages);
+
+	if (!mutex_trylock(&binder_allocs_lock))
+		return -1;
+	list_for_each_entry(alloc, &binder_allocs, alloc_node) {
+		if (nr_to_scan <= 0)
+			break;
+		if (!mutex_trylock(&alloc->mutex))
+			continue;
+		freed = binder_alloc_trim_lru(alloc, nr_to_scan, true);
+		mutex_unlock(&alloc->mutex);
+		atomic_add(freed, &binder_alloc_stats.pages_shrunk);
+		nr_to_scan -= freed;
+	}
+	/* Start with a different proc next time */
+	if (!list_empty(&binder_allocs))
+		list_rotate_left(&binder_allocs);
+	mutex_unlock(&binder_allocs_lock);
+
+	return atomic_read(&binder_alloc_lru_pages);
+}
+
+static struct shrinker binder_alloc_shrinker = {
+	.shrink = binder_alloc_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+void binder_alloc_shrinker_init(void)
+{
+	register_shrinker(&binder_alloc_shrinker);
+}
@@ -0,0 +1,108 @@
+/* binder_alloc.h
+ *
+ * Android IPC Subsystem
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_BINDER_ALLOC_H
+#define _LINUX_BINDER_ALLOC_H
+
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+struct binder_transaction;
+struct binder_node;
+
+struct binder_buffer {
+	struct list_head entry; /* free and allocated entries by addesss */
+	struct rb_node rb_node; /* free entry by size or allocated entry */
+				/* by address */
+	unsigned free:1;
+	unsigned allow_user_free:1;
+	unsigned async_transaction:1;
+	unsigned debug_id:29;
+
+	struct binder_transaction *transaction;
+
+	struct binder_node *target_node;
+	size_t data_size;
+	size_t offsets_size;
+	uint8_t data[0];
+};
+
+/*
+ * Per-proc buffer allocator.  All fields are protected by mutex, except
+ * vma which is cleared from the vma close handler.
+ *
+ * Pages backing freed buffers are not unmapped right away: up to
+ * binder_alloc_cached_pages of them stay mapped on the lru list so the
+ * next transaction to the same proc can reuse them, and the shrinker
+ * unmaps them under memory pressure.
+ */
+struct binder_alloc {
+	struct mutex mutex;
+	struct task_struct *tsk;
+	struct vm_area_struct *vma;
+	void *buffer;
+	ptrdiff_t user_buffer_offset;
+
+	struct list_head buffers;
+	struct rb_root free_buffers;
+	struct rb_root allocated_buffers;
+	size_t free_async_space;
+
+	struct page **pages;
+	struct list_head *page_lru; /* one entry per page, on lru if cached */
+	struct list_head lru;	    /* cached pages, oldest free first */
+	int lru_count;
+	struct list_head alloc_node; /* on binder_allocs while mapped */
+	size_t buffer_size;
+	int pid;
+};
+
+extern void binder_alloc_init(struct binder_alloc *alloc,
+			      struct task_struct *tsk, int pid);
+extern int binder_alloc_mmap_handler(struct binder_alloc *alloc,
+				     struct vm_area_struct *vma);
+extern void binder_alloc_vma_close(struct binder_alloc *alloc);
+extern struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
+						  size_t data_size,
+						  size_t offsets_size,
+						  int is_async);
+extern void binder_alloc_free_buf(struct binder_alloc *alloc,
+				  struct binder_buffer *buffer);
+extern struct binder_buffer *binder_alloc_prepare_to_free(
+	struct binder_alloc *alloc, void __user *user_ptr);
+extern struct binder_buffer *binder_alloc_first_allocated(
+	struct binder_alloc *alloc);
+extern int binder_alloc_deferred_release(struct binder_alloc *alloc);
+extern int binder_alloc_get_allocated_count(struct binder_alloc *alloc);
+extern size_t binder_alloc_get_free_async_space(struct binder_alloc *alloc);
+extern void binder_alloc_print_allocated(struct seq_file *m,
+					 struct binder_alloc *alloc);
+extern void binder_alloc_print_stats(struct seq_file *m);
+extern void binder_alloc_shrinker_init(void);
+
+static inline ptrdiff_t
+binder_alloc_get_user_buffer_offset(struct binder_alloc *alloc)
+{
+	/* Set once at mmap time and never changed afterwards */
+	return alloc->user_buffer_offset;
+}
+
+#endif /* _LINUX_BINDER_ALLOC_H */
@@ -0,0 +1,128 @@
+/* binder_trace.h
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+struct binder_transaction;
+struct binder_node;
+
+/*
+ * A transaction goes through binder_transaction (queued on the target
+ * todo list), binder_transaction_wakeup (target woken),
+ * binder_transaction_received (picked up by a target thread) and, for
+ * two-way calls, binder_transaction_reply (the reply is queued back to
+ * the caller, which then sees its own binder_transaction_received).
+ */
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_wakeup,
+	TP_PROTO(struct binder_transaction *t),
+	TP_ARGS(t),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, to_proc)
+		__field(int, to_thread)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+	),
+	TP_printk("transaction=%d dest_proc=%d dest_thread=%d",
+		  __entry->debug_id, __entry->to_proc, __entry->to_thread)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, int thread, s64 queue_us,
+		 s64 round_trip_us),
+	TP_ARGS(t, thread, queue_us, round_trip_us),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, thread)
+		__field(s64, queue_us)
+		__field(s64, round_trip_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->thread = thread;
+		__entry->queue_us = queue_us;
+		__entry->round_trip_us = round_trip_us;
+	),
+	TP_printk("transaction=%d thread=%d queue=%lldus round_trip=%lldus",
+		  __entry->debug_id, __entry->thread,
+		  (long long)__entry->queue_us,
+		  (long long)__entry->round_trip_us)
+);
+
+TRACE_EVENT(binder_transaction_reply,
+	TP_PROTO(struct binder_transaction *t,
+		 struct binder_transaction *in_reply_to, s64 service_us),
+	TP_ARGS(t, in_reply_to, service_us),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply_to)
+		__field(s64, service_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->reply_to = in_reply_to->debug_id;
+		__entry->service_us = service_us;
+	),
+	TP_printk("transaction=%d reply_to=%d service=%lldus",
+		  __entry->debug_id, __entry->reply_to,
+		  (long long)__entry->service_us)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
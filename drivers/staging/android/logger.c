@@ -20,10 +20,13 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
 #include "logger.h"
 
@@ -36,33 +39,55 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is only ever held across memcpy()s of at most one
+ * entry: user copies are done outside of it (see logger_aio_write() and
+ * logger_read()).
+ *
+ * 'buffer' and 'misc' must stay the first two members, sec_logger peeks at
+ * them through its own copy of this structure.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_ctl	*ctl;	/* control page for mmap readers */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned long		r_gen;	/* bumped when r_off is moved for us */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
 };
 
+/*
+ * struct logger_write_buf - per-cpu staging area for writers
+ *
+ * Writers copy their payload from user space into the staging buffer of the
+ * cpu they run on, with preemption and page faults disabled, so that writers
+ * to different logs or on different cpus do not serialize on each other.  A
+ * payload that is not resident is copied into a private buffer instead, so
+ * no writer ever sleeps while owning a staging buffer.
+ */
+struct logger_write_buf {
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
+};
+
+static DEFINE_PER_CPU(struct logger_write_buf, logger_write_bufs);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -114,7 +139,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * get_entry_msg_len - Grabs the length of the message of the entry
  * starting from from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -159,9 +184,11 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * user-space buffer 'buf'. Returns 'count' on success, or -EAGAIN if a
+ * writer lapped the reader while the entry was being copied.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock, which is dropped for the user copies and
+ * held again on return.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
@@ -169,21 +196,28 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 				   size_t count)
 {
 	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_entry entry;
+	size_t r_off = reader->r_off;
+	unsigned long r_gen = reader->r_gen;
 	size_t len;
 	size_t msg_start;
+	int err = 0;
+
+	entry = *get_entry_header(log, r_off, &scratch);
+	spin_unlock(&log->lock);
 
 	/*
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
+	if (copy_header_to_user(reader->r_ver, &entry, buf)) {
+		err = -EFAULT;
+		goto out;
+	}
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(r_off + sizeof(struct logger_entry));
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -191,8 +225,10 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+	if (copy_to_user(buf, log->buffer + msg_start, len)) {
+		err = -EFAULT;
+		goto out;
+	}
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
@@ -200,9 +236,21 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 */
 	if (count != len)
 		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+			err = -EFAULT;
+
+out:
+	spin_lock(&log->lock);
+
+	/*
+	 * A writer that overwrote any part of the entry had to pull us
+	 * forward first, and so did a concurrent read() on the same file.
+	 */
+	if (reader->r_off != r_off || reader->r_gen != r_gen)
+		return -EAGAIN;
+	if (err)
+		return err;
 
-	reader->r_off = logger_offset(reader->r_off +
+	reader->r_off = logger_offset(r_off +
 		sizeof(struct logger_entry) + count);
 
 	return count + get_user_hdr_len(reader->r_ver);
@@ -243,6 +291,9 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
+ *
+ * Writers are never held up by readers: the entry is copied to user space
+ * without log->lock and thrown away if a writer lapped us in the meantime.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
@@ -256,9 +307,8 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		/* racy, rechecked under log->lock below */
+		ret = (ACCESS_ONCE(log->w_off) == ACCESS_ONCE(reader->r_off));
 		if (!ret)
 			break;
 
@@ -279,7 +329,7 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
@@ -287,7 +337,7 @@ start:
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
@@ -301,9 +351,13 @@ start:
 
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (unlikely(ret == -EAGAIN)) {
+		spin_unlock(&log->lock);
+		goto start;
+	}
 
 out:
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -312,7 +366,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -351,7 +405,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -363,14 +417,44 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (clock_interval(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->r_gen++;
+		}
+}
+
+/*
+ * logger_ctl_begin - mark the ring as being written for mmap readers
+ *
+ * The caller needs to hold log->lock.
+ */
+static inline void logger_ctl_begin(struct logger_log *log)
+{
+	if (!log->ctl)
+		return;
+	log->ctl->seq++;
+	smp_wmb();
+}
+
+/*
+ * logger_ctl_end - publish the new head and write offset to mmap readers
+ *
+ * The caller needs to hold log->lock.
+ */
+static inline void logger_ctl_end(struct logger_log *log)
+{
+	if (!log->ctl)
+		return;
+	log->ctl->head = log->head;
+	log->ctl->w_off = log->w_off;
+	smp_wmb();
+	log->ctl->seq++;
 }
 
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -387,53 +471,68 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * copy_iov_from_user - gathers 'count' bytes of payload from the user-space
+ * vector 'iov' into 'buf'
  *
- * The caller needs to hold log->mutex.
+ * If 'atomic' is set the caller has page faults disabled and a payload that
+ * is not resident fails the copy.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns 0 on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_iov_from_user(unsigned char *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count, bool atomic)
 {
-	size_t len;
+	size_t copied = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && copied < count) {
+		size_t len;
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count - copied);
+
+		if (!len)
+			left = 0;
+		else if (atomic)
+			left = __copy_from_user_inatomic(buf + copied,
+							 iov->iov_base, len);
+		else
+			left = copy_from_user(buf + copied, iov->iov_base, len);
+		if (left)
 			return -EFAULT;
 
-	sec_logger_update_buffer(log->buffer + log->w_off, count);
+		sec_logger_update_buffer(buf + copied, len);
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		copied += len;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is staged in this cpu's logger_write_buf, or in a private
+ * buffer if copying it would fault, without any log lock held; log->lock
+ * then only covers timestamping the entry and copying it into the ring, so
+ * entries come out in timestamp order.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_write_buf *wbuf;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	unsigned char *buf;
+	size_t orig;
+	int ret;
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -442,47 +541,58 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	wbuf = &get_cpu_var(logger_write_bufs);
+	buf = wbuf->buf;
+	pagefault_disable();
+	ret = copy_iov_from_user(buf, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		/* the payload is not resident, fault it in without the cpu */
+		put_cpu_var(logger_write_bufs);
+		buf = kmalloc(header.len, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		ret = copy_iov_from_user(buf, iov, nr_segs, header.len, false);
+		if (ret) {
+			kfree(buf);
+			return ret;
+		}
+	}
+
+	spin_lock(&log->lock);
+
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+	orig = log->w_off;
+
+	logger_ctl_begin(log);
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * entry after (what will be) the new write offset.
 	 */
 	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, buf, header.len);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
-
-		iov++;
-		ret += nr;
-	}
+	logger_ctl_end(log);
 
 	sec_logger_add_log_ram_console(log, orig);
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+	if (buf == wbuf->buf)
+		put_cpu_var(logger_write_bufs);
+	else
+		kfree(buf);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
 	sec_logger_print_buffer();
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -517,12 +627,13 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
+		reader->r_gen = 0;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -542,9 +653,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		kfree(reader);
 	}
@@ -575,14 +686,14 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -604,10 +715,19 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	size_t off;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	/* copies from user space, and only touches the reader */
+	if (cmd == LOGGER_SET_VERSION) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		return logger_set_version(reader, argp);
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -646,9 +766,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
+		logger_ctl_begin(log);
+		list_for_each_entry(reader, &log->readers, list) {
 			reader->r_off = log->w_off;
+			reader->r_gen++;
+		}
 		log->head = log->w_off;
+		logger_ctl_end(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -659,24 +783,93 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
-	case LOGGER_SET_VERSION:
+	case LOGGER_SET_READ_OFFSET:
 		if (!(file->f_mode & FMODE_READ)) {
 			ret = -EBADF;
 			break;
 		}
 		reader = file->private_data;
-		ret = logger_set_version(reader, argp);
+
+		/* the offset comes from the raw ring, which only r_all maps */
+		if (!reader->r_all) {
+			ret = -EPERM;
+			break;
+		}
+		/* must lie between the oldest entry and the write head */
+		if (arg >= log->size || logger_offset(arg - log->head) >
+		    logger_offset(log->w_off - log->head))
+			break;
+		/* and must be the start of an entry (or the write head) */
+		off = reader->r_off;
+		if (logger_offset(arg - log->head) <
+		    logger_offset(off - log->head))
+			off = log->head;
+		while (off != arg && off != log->w_off)
+			off = logger_offset(off + sizeof(struct logger_entry) +
+					    get_entry_msg_len(log, off));
+		if (off != arg)
+			break;
+		reader->r_off = arg;
+		reader->r_gen++;
+		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page followed by the ring itself, read-only, so that a
+ * reader can consume the whole log in bulk instead of one entry per read().
+ * After consuming up to some offset the reader reports it back with
+ * LOGGER_SET_READ_OFFSET, so that poll() only wakes it up for new entries.
+ * The raw ring is not filtered by uid, so only readers that may see every
+ * entry can map it.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+	if (!log->ctl)
+		return -ENOMEM;
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->ctl) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
+	.mmap = logger_mmap,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
@@ -688,10 +881,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).  The buffer is
+ * page aligned so that it can be mapped by logger_mmap().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -702,7 +896,7 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -730,6 +924,13 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->ctl = (struct logger_mmap_ctl *)get_zeroed_page(GFP_KERNEL);
+	if (log->ctl)
+		log->ctl->size = log->size;
+	else
+		printk(KERN_WARNING "logger: no control page for log '%s', "
+		       "mmap disabled\n", log->misc.name);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -51,6 +51,23 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Layout of the first page of a log mapping, see logger_mmap(). The ring
+ * itself follows at offset PAGE_SIZE and holds struct logger_entry (v2)
+ * records back to back, wrapping at 'size'.
+ *
+ * 'seq' is odd while a writer is updating the ring. A consumer reads seq,
+ * head and w_off, copies the entries between its own offset and w_off,
+ * then rereads seq. If seq moved it rechecks that its offset was not
+ * overtaken by head.
+ */
+struct logger_mmap_ctl {
+	__u32		size;		/* size of the ring */
+	__u32		seq;		/* odd while the ring is being written */
+	__u32		head;		/* offset of the oldest entry */
+	__u32		w_off;		/* offset the next entry goes to */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +83,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_READ_OFFSET		_IO(__LOGGERIO, 7) /* mmap consumed */
 
 #endif /* _LINUX_LOGGER_H */
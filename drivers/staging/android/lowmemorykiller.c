@@ -16,6 +16,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Writing 1 to /sys/module/lowmemorykiller/parameters/pressure_mode instead
+ * picks the minimum oom_adj from the vmpressure level (see mm/vmpressure.c),
+ * one entry of /sys/module/lowmemorykiller/parameters/pressure_adj per level
+ * none, low, medium and critical.  Only the first minfree threshold is still
+ * honoured in that mode, as a backstop for bursts that exhaust memory
+ * before reclaim has had a chance to report any pressure.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -38,6 +45,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/ktime.h>
+#include <linux/vmpressure.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 #ifdef CONFIG_ENHANCED_LMK_ROUTINE
 #define LOWMEM_DEATHPENDING_DEPTH 3
@@ -59,6 +71,15 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+static bool lowmem_pressure_mode;
+static int lowmem_pressure_adj[VMPRESSURE_NUM_LEVELS] = {
+	OOM_ADJUST_MAX + 1,	/* none */
+	OOM_ADJUST_MAX + 1,	/* low */
+	12,			/* medium */
+	6,			/* critical */
+};
+static int lowmem_pressure_adj_size = VMPRESSURE_NUM_LEVELS;
+
 #ifdef CONFIG_ENHANCED_LMK_ROUTINE
 static struct task_struct *lowmem_deathpending[LOWMEM_DEATHPENDING_DEPTH] = {
 	NULL,
@@ -68,6 +89,41 @@ static struct task_struct *lowmem_deathpending;
 #endif
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders by oom_adj, protected by tasklist_lock. Victim
+ * selection only walks the buckets from OOM_ADJUST_MAX down to the first
+ * one holding a candidate instead of every process in the system.
+ */
+static struct hlist_head lowmem_adj_buckets[OOM_ADJUST_MAX - OOM_DISABLE + 1];
+
+static struct hlist_head *lowmem_adj_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_adj_buckets[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_add_adj_bucket(struct task_struct *p)
+{
+	hlist_add_head(&p->lowmem_adj_node,
+		       lowmem_adj_bucket(p->signal->oom_adj));
+}
+
+void lowmem_del_adj_bucket(struct task_struct *p)
+{
+	hlist_del_init(&p->lowmem_adj_node);
+}
+
+void lowmem_update_adj_bucket(struct task_struct *p)
+{
+	write_lock_irq(&tasklist_lock);
+	p = p->group_leader;
+	if (!hlist_unhashed(&p->lowmem_adj_node)) {
+		hlist_del(&p->lowmem_adj_node);
+		lowmem_add_adj_bucket(p);
+	}
+	write_unlock_irq(&tasklist_lock);
+}
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -109,10 +165,16 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #else
 	struct task_struct *selected = NULL;
 #endif
+	struct hlist_node *pos;
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int nr_buckets = 0;
+	int nr_tasks = 0;
+	int nr_selected = 0;
+	ktime_t start;
 #ifdef CONFIG_ENHANCED_LMK_ROUTINE
 	int selected_tasksize[LOWMEM_DEATHPENDING_DEPTH] = {0,};
 	int selected_oom_adj[LOWMEM_DEATHPENDING_DEPTH] = {OOM_ADJUST_MAX,};
@@ -161,6 +223,14 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			break;
 		}
 	}
+	if (lowmem_pressure_mode && i != 0) {
+		int level = vmpressure_level();
+
+		if (level < lowmem_pressure_adj_size)
+			min_adj = lowmem_pressure_adj[level];
+		else
+			min_adj = OOM_ADJUST_MAX + 1;
+	}
 	if (sc->nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
@@ -182,67 +252,81 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	selected_oom_adj = min_adj;
 #endif
 
+	start = ktime_get();
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE); adj--) {
+#ifdef CONFIG_ENHANCED_LMK_ROUTINE
+		if (all_selected_oom >= LOWMEM_DEATHPENDING_DEPTH)
+			break;
+#else
+		if (selected)
+			break;
+#endif
+		nr_buckets++;
+		hlist_for_each_entry(p, pos, lowmem_adj_bucket(adj),
+				     lowmem_adj_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			nr_tasks++;
+
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
+				continue;
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
+			if (tasksize <= 0)
+				continue;
 
 #ifdef CONFIG_ENHANCED_LMK_ROUTINE
-		for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-			if (all_selected_oom >= LOWMEM_DEATHPENDING_DEPTH) {
-				if (oom_adj < selected_oom_adj[i])
-					continue;
-				if (oom_adj == selected_oom_adj[i] &&
-					tasksize <= selected_tasksize[i])
+			for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+				if (all_selected_oom >= LOWMEM_DEATHPENDING_DEPTH) {
+					if (oom_adj < selected_oom_adj[i])
+						continue;
+					if (oom_adj == selected_oom_adj[i] &&
+						tasksize <= selected_tasksize[i])
+						continue;
+				} else if (selected[i])
 					continue;
-			} else if (selected[i])
-				continue;
 
-			selected[i] = p;
-			selected_tasksize[i] = tasksize;
-			selected_oom_adj[i] = oom_adj;
+				selected[i] = p;
+				selected_tasksize[i] = tasksize;
+				selected_oom_adj[i] = oom_adj;
 
-			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
-				all_selected_oom++;
-			lowmem_print(2, "select %d (%s), adj %d, size %d,"
-			     "to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+				if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
+					all_selected_oom++;
+				lowmem_print(2, "select %d (%s), adj %d, size %d,"
+				     "to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 
-			break;
-		}
+				break;
+			}
 #else
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 
 #endif
+		}
 	}
 #ifdef CONFIG_ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
@@ -255,6 +339,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			lowmem_deathpending_timeout = jiffies + HZ;
 			force_sig(SIGKILL, selected[i]);
 			rem -= selected_tasksize[i];
+			nr_selected++;
 		}
 	}
 #else
@@ -266,8 +351,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
+		nr_selected++;
 	}
 #endif
+	trace_lowmem_select(min_adj, nr_buckets, nr_tasks, nr_selected,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
 	read_unlock(&tasklist_lock);
@@ -298,6 +386,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_mode, lowmem_pressure_mode, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_adj, lowmem_pressure_adj, int,
+			 &lowmem_pressure_adj_size, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
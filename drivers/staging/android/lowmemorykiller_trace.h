@@ -0,0 +1,53 @@
+/* drivers/staging/android/lowmemorykiller_trace.h
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+	TP_PROTO(int min_adj, int buckets, int tasks, int selected,
+		 s64 cost_ns),
+	TP_ARGS(min_adj, buckets, tasks, selected, cost_ns),
+	TP_STRUCT__entry(
+		__field(int, min_adj)
+		__field(int, buckets)
+		__field(int, tasks)
+		__field(int, selected)
+		__field(s64, cost_ns)
+	),
+	TP_fast_assign(
+		__entry->min_adj = min_adj;
+		__entry->buckets = buckets;
+		__entry->tasks = tasks;
+		__entry->selected = selected;
+		__entry->cost_ns = cost_ns;
+	),
+	TP_printk("min_adj=%d buckets=%d tasks=%d selected=%d cost=%lldns",
+		  __entry->min_adj, __entry->buckets, __entry->tasks,
+		  __entry->selected, (long long)__entry->cost_ns)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
@@ -6,9 +6,11 @@
  *
  * Zcache provides an in-kernel "host implementation" for transcendent memory
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
- * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
+ * page-accessible memory [1] interfaces, both utilizing lzo1x (or, with
+ * zcache=lz4, lz4) compression:
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
+ * 2) xvmalloc (or zsmalloc, with CONFIG_ZCACHE_ZSMALLOC) is used for
+ *    persistent pages.
  * Xvmalloc (based on the TLSF allocator) has very low fragmentation
  * so maximizes space efficiency, while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
@@ -22,14 +24,18 @@
 #include <linux/cpu.h>
 #include <linux/highmem.h>
 #include <linux/list.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include "tmem.h"
 
+#ifdef CONFIG_ZCACHE_ZSMALLOC
+#include "../zsmalloc/zsmalloc.h" /* if built in drivers/staging */
+#else
 #include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#endif
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -49,6 +55,43 @@
 	(__GFP_FS | __GFP_NORETRY | __GFP_NOWARN | __GFP_NOMEMALLOC)
 #endif
 
+/*
+ * Compression goes through the crypto API, so any compressor it knows of
+ * can be picked at boot with zcache=<name>.  Each cpu has its own tfm,
+ * used with preemption disabled; compression additionally runs with irqs
+ * disabled, so it cannot be interrupted by a decompression on the same tfm.
+ */
+static char zcache_comp_name[CRYPTO_MAX_ALG_NAME] = "lzo";
+static DEFINE_PER_CPU(struct crypto_comp *, zcache_comp_tfm);
+
+enum comp_op {
+	ZCACHE_COMPOP_COMPRESS,
+	ZCACHE_COMPOP_DECOMPRESS
+};
+
+static inline int zcache_comp_op(enum comp_op op,
+				const u8 *src, unsigned int slen,
+				u8 *dst, unsigned int *dlen)
+{
+	struct crypto_comp *tfm;
+	int ret;
+
+	tfm = get_cpu_var(zcache_comp_tfm);
+	BUG_ON(!tfm);
+	switch (op) {
+	case ZCACHE_COMPOP_COMPRESS:
+		ret = crypto_comp_compress(tfm, src, slen, dst, dlen);
+		break;
+	case ZCACHE_COMPOP_DECOMPRESS:
+		ret = crypto_comp_decompress(tfm, src, slen, dst, dlen);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	put_cpu_var(zcache_comp_tfm);
+	return ret;
+}
+
 /**********
  * Compression buddies ("zbud") provides for packing two (or, possibly
  * in the future, more) compressed ephemeral pages into a single "raw"
@@ -372,7 +415,7 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 {
 	struct zbud_page *zbpg;
 	unsigned budnum = zbud_budnum(zh);
-	size_t out_len = PAGE_SIZE;
+	unsigned int out_len = PAGE_SIZE;
 	char *to_va, *from_va;
 	unsigned size;
 	int ret = 0;
@@ -389,8 +432,9 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 	to_va = kmap_atomic(page, KM_USER0);
 	size = zh->size;
 	from_va = zbud_data(zh, size);
-	ret = lzo1x_decompress_safe(from_va, size, to_va, &out_len);
-	BUG_ON(ret != LZO_E_OK);
+	ret = zcache_comp_op(ZCACHE_COMPOP_DECOMPRESS, from_va, size,
+			     to_va, &out_len);
+	BUG_ON(ret);
 	BUG_ON(out_len != PAGE_SIZE);
 	kunmap_atomic(to_va, KM_USER0);
 out:
@@ -587,7 +631,9 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 /**********
  * This "zv" PAM implementation combines the TLSF-based xvMalloc
  * with lzo1x compression to maximize the amount of data that can
- * be packed into a physical page.
+ * be packed into a physical page.  With CONFIG_ZCACHE_ZSMALLOC, the
+ * size-class based zsmalloc is used instead, which also packs objects
+ * across page boundaries.
  *
  * Zv represents a PAM page with the index and object (plus a "size" value
  * necessary for decompression) immediately preceding the compressed data.
@@ -599,14 +645,98 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	uint16_t size;
 	DECL_SENTINEL
 };
 
 static const int zv_max_page_size = (PAGE_SIZE / 8) * 7;
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
-				struct tmem_oid *oid, uint32_t index,
-				void *cdata, unsigned clen)
+static void zv_fill(struct zv_hdr *zv, uint32_t pool_id,
+			struct tmem_oid *oid, uint32_t index,
+			void *cdata, unsigned clen)
+{
+	zv->index = index;
+	zv->oid = *oid;
+	zv->pool_id = pool_id;
+	zv->size = clen;
+	SET_SENTINEL(zv, ZVH);
+	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
+}
+
+static void zv_decompress_hdr(struct page *page, struct zv_hdr *zv)
+{
+	unsigned int clen = PAGE_SIZE;
+	char *to_va;
+	int ret;
+
+	ASSERT_SENTINEL(zv, ZVH);
+	BUG_ON(zv->size == 0 || zv->size > zv_max_page_size);
+	to_va = kmap_atomic(page, KM_USER0);
+	ret = zcache_comp_op(ZCACHE_COMPOP_DECOMPRESS, (char *)zv + sizeof(*zv),
+			     zv->size, to_va, &clen);
+	kunmap_atomic(to_va, KM_USER0);
+	BUG_ON(ret);
+	BUG_ON(clen != PAGE_SIZE);
+}
+
+#ifdef CONFIG_ZCACHE_ZSMALLOC
+
+/* The pampd is the zsmalloc handle */
+static void *zv_create(struct zs_pool *zspool, uint32_t pool_id,
+			struct tmem_oid *oid, uint32_t index,
+			void *cdata, unsigned clen)
+{
+	unsigned long handle;
+	struct zv_hdr *zv;
+
+	BUG_ON(!irqs_disabled());
+	handle = zs_malloc(zspool, clen + sizeof(struct zv_hdr));
+	if (unlikely(!handle))
+		return NULL;
+	zv = zs_map_object(zspool, handle, ZS_MM_WO);
+	zv_fill(zv, pool_id, oid, index, cdata, clen);
+	zs_unmap_object(zspool, handle);
+	return (void *)handle;
+}
+
+static void zv_free(struct zs_pool *zspool, void *pampd)
+{
+	unsigned long handle = (unsigned long)pampd;
+	unsigned long flags;
+	struct zv_hdr *zv;
+
+	zv = zs_map_object(zspool, handle, ZS_MM_RW);
+	ASSERT_SENTINEL(zv, ZVH);
+	BUG_ON(zv->size == 0 || zv->size > zv_max_page_size);
+	INVERT_SENTINEL(zv, ZVH);
+	zs_unmap_object(zspool, handle);
+	local_irq_save(flags);
+	zs_free(zspool, handle);
+	local_irq_restore(flags);
+}
+
+static void zv_decompress(struct zs_pool *zspool, struct page *page,
+				void *pampd)
+{
+	unsigned long handle = (unsigned long)pampd;
+
+	zv_decompress_hdr(page, zs_map_object(zspool, handle, ZS_MM_RO));
+	zs_unmap_object(zspool, handle);
+}
+
+#define ZV_ALLOCATOR "zsmalloc"
+
+static struct zs_pool *zv_create_pool(void)
+{
+	return zs_create_pool("zcache", ZCACHE_GFP_MASK);
+}
+
+#else /* !CONFIG_ZCACHE_ZSMALLOC */
+
+/* The pampd points to the zv_hdr */
+static void *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+			struct tmem_oid *oid, uint32_t index,
+			void *cdata, unsigned clen)
 {
 	struct page *page;
 	struct zv_hdr *zv = NULL;
@@ -619,26 +749,21 @@ static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
 	if (unlikely(ret))
 		goto out;
 	zv = kmap_atomic(page, KM_USER0) + offset;
-	zv->index = index;
-	zv->oid = *oid;
-	zv->pool_id = pool_id;
-	SET_SENTINEL(zv, ZVH);
-	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
+	zv_fill(zv, pool_id, oid, index, cdata, clen);
 	kunmap_atomic(zv, KM_USER0);
 out:
 	return zv;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct xv_pool *xvpool, void *pampd)
 {
+	struct zv_hdr *zv = pampd;
 	unsigned long flags;
 	struct page *page;
 	uint32_t offset;
-	uint16_t size;
 
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0 || size > zv_max_page_size);
+	BUG_ON(zv->size == 0 || zv->size > zv_max_page_size);
 	INVERT_SENTINEL(zv, ZVH);
 	page = virt_to_page(zv);
 	offset = (unsigned long)zv & ~PAGE_MASK;
@@ -647,24 +772,21 @@ static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
 	local_irq_restore(flags);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct xv_pool *xvpool, struct page *page,
+				void *pampd)
 {
-	size_t clen = PAGE_SIZE;
-	char *to_va;
-	unsigned size;
-	int ret;
+	zv_decompress_hdr(page, pampd);
+}
 
-	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0 || size > zv_max_page_size);
-	to_va = kmap_atomic(page, KM_USER0);
-	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
-					size, to_va, &clen);
-	kunmap_atomic(to_va, KM_USER0);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(clen != PAGE_SIZE);
+#define ZV_ALLOCATOR "xvmalloc"
+
+static struct xv_pool *zv_create_pool(void)
+{
+	return xv_create_pool();
 }
 
+#endif /* CONFIG_ZCACHE_ZSMALLOC */
+
 /*
  * zcache core code starts here
  */
@@ -681,7 +803,11 @@ static unsigned long zcache_failed_pers_puts;
 
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
+#ifdef CONFIG_ZCACHE_ZSMALLOC
+	struct zs_pool *zvpool;
+#else
+	struct xv_pool *zvpool;
+#endif
 } zcache_client;
 
 /*
@@ -942,8 +1068,8 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
-						oid, index, cdata, clen);
+		pampd = zv_create(zcache_client.zvpool, pool->pool_id,
+					oid, index, cdata, clen);
 		if (pampd == NULL)
 			goto out;
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
@@ -966,7 +1092,7 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
 	if (is_ephemeral(pool))
 		ret = zbud_decompress(page, pampd);
 	else
-		zv_decompress(page, pampd);
+		zv_decompress(zcache_client.zvpool, page, pampd);
 	return ret;
 }
 
@@ -981,7 +1107,7 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
+		zv_free(zcache_client.zvpool, pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -997,26 +1123,26 @@ static struct tmem_pamops zcache_pamops = {
  * zcache compression/decompression and related per-cpu stuff
  */
 
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGE_ORDER 1
-static DEFINE_PER_CPU(unsigned char *, zcache_workmem);
+#define ZCACHE_DSTMEM_PAGE_ORDER 1
 static DEFINE_PER_CPU(unsigned char *, zcache_dstmem);
 
 static int zcache_compress(struct page *from, void **out_va, size_t *out_len)
 {
 	int ret = 0;
 	unsigned char *dmem = __get_cpu_var(zcache_dstmem);
-	unsigned char *wmem = __get_cpu_var(zcache_workmem);
+	unsigned int dlen = PAGE_SIZE << ZCACHE_DSTMEM_PAGE_ORDER;
 	char *from_va;
 
 	BUG_ON(!irqs_disabled());
-	if (unlikely(dmem == NULL || wmem == NULL))
+	if (unlikely(dmem == NULL))
 		goto out;  /* no buffer, so can't compress */
 	from_va = kmap_atomic(from, KM_USER0);
 	mb();
-	ret = lzo1x_1_compress(from_va, PAGE_SIZE, dmem, out_len, wmem);
-	BUG_ON(ret != LZO_E_OK);
+	ret = zcache_comp_op(ZCACHE_COMPOP_COMPRESS, from_va, PAGE_SIZE, dmem,
+			     &dlen);
+	BUG_ON(ret);
 	*out_va = dmem;
+	*out_len = dlen;
 	kunmap_atomic(from_va, KM_USER0);
 	ret = 1;
 out:
@@ -1029,23 +1155,25 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 {
 	int cpu = (long)pcpu;
 	struct zcache_preload *kp;
+	struct crypto_comp *tfm;
 
 	switch (action) {
 	case CPU_UP_PREPARE:
+		tfm = crypto_alloc_comp(zcache_comp_name, 0, 0);
+		if (IS_ERR(tfm))
+			return NOTIFY_BAD;
+		per_cpu(zcache_comp_tfm, cpu) = tfm;
 		per_cpu(zcache_dstmem, cpu) = (void *)__get_free_pages(
 			GFP_KERNEL | __GFP_REPEAT,
-			LZO_DSTMEM_PAGE_ORDER),
-		per_cpu(zcache_workmem, cpu) =
-			kzalloc(LZO1X_MEM_COMPRESS,
-				GFP_KERNEL | __GFP_REPEAT);
+			ZCACHE_DSTMEM_PAGE_ORDER);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
+		crypto_free_comp(per_cpu(zcache_comp_tfm, cpu));
+		per_cpu(zcache_comp_tfm, cpu) = NULL;
 		free_pages((unsigned long)per_cpu(zcache_dstmem, cpu),
-				LZO_DSTMEM_PAGE_ORDER);
+				ZCACHE_DSTMEM_PAGE_ORDER);
 		per_cpu(zcache_dstmem, cpu) = NULL;
-		kfree(per_cpu(zcache_workmem, cpu));
-		per_cpu(zcache_workmem, cpu) = NULL;
 		kp = &per_cpu(zcache_preloads, cpu);
 		while (kp->nr) {
 			kmem_cache_free(zcache_objnode_cache,
@@ -1563,9 +1691,12 @@ struct frontswap_ops zcache_frontswap_register_ops(void)
 
 static int zcache_enabled;
 
+/* "zcache" or "zcache=<compressor>", any the crypto API knows of */
 static int __init enable_zcache(char *s)
 {
 	zcache_enabled = 1;
+	if (*s == '=' && *++s)
+		strlcpy(zcache_comp_name, s, sizeof(zcache_comp_name));
 	return 1;
 }
 __setup("zcache", enable_zcache);
@@ -1607,6 +1738,12 @@ static int __init zcache_init(void)
 	if (zcache_enabled) {
 		unsigned int cpu;
 
+		if (!crypto_has_comp(zcache_comp_name, 0, 0)) {
+			pr_warning("zcache: %s compressor not available, "
+				   "using lzo\n", zcache_comp_name);
+			strcpy(zcache_comp_name, "lzo");
+		}
+		pr_info("zcache: using %s compressor\n", zcache_comp_name);
 		tmem_register_hostops(&zcache_hostops);
 		tmem_register_pamops(&zcache_pamops);
 		ret = register_cpu_notifier(&zcache_cpu_notifier_block);
@@ -1642,14 +1779,14 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
+		zcache_client.zvpool = zv_create_pool();
+		if (zcache_client.zvpool == NULL) {
+			pr_err("zcache: can't create zv pool\n");
 			goto out;
 		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and " ZV_ALLOCATOR "\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
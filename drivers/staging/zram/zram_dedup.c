@@ -0,0 +1,216 @@
+/*
+ * Compressed RAM block device - same page deduplication
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/rbtree.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket for this many disk pages */
+#define ZRAM_DEDUP_PAGES_PER_BUCKET	16
+
+static u32 zram_dedup_checksum(const void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+/* Entries with the same checksum go to the right of each other */
+void zram_dedup_insert(struct zram *zram, struct zram_entry *new,
+		       u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *entry;
+
+	new->checksum = checksum;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		entry = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < entry->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&new->rb_node, parent, rb_node);
+	rb_insert_color(&new->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+}
+
+/* Called with a reference held on entry, so it cannot go away */
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			     const unsigned char *mem, unsigned char *buffer)
+{
+	unsigned char *cmem;
+	bool match;
+	int ret;
+
+	if (entry->len == PAGE_SIZE) {
+		cmem = kmap_atomic(entry->page, KM_USER1);
+		match = !memcmp(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		return match;
+	}
+
+	/* mapping the object keeps preemption off for zram_decompress() */
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = zram_decompress(zram, cmem, entry->len, buffer);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return !ret && !memcmp(mem, buffer, PAGE_SIZE);
+}
+
+/*
+ * Returns an entry holding the same data as page with a reference taken
+ * for the caller, or NULL.  The checksum of page is returned either way,
+ * for zram_dedup_insert().  buffer must hold a decompressed page.
+ *
+ * The candidates are compared outside the bucket lock, as comparing
+ * compressed ones means decompressing them first.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct page *page,
+				   u32 *checksum, void *buffer)
+{
+	struct zram_hash *hash;
+	struct zram_entry *entry;
+	struct rb_node *rb_node;
+	unsigned char *mem;
+	bool match;
+
+	mem = kmap_atomic(page, KM_USER0);
+	*checksum = zram_dedup_checksum(mem);
+	kunmap_atomic(mem, KM_USER0);
+
+	hash = zram_dedup_bucket(zram, *checksum);
+
+	spin_lock(&hash->lock);
+again:
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (*checksum == entry->checksum)
+			break;
+		if (*checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+
+	/* walk the run of entries with this checksum, leftmost first */
+	if (rb_node) {
+		struct rb_node *prev;
+
+		while ((prev = rb_prev(rb_node)) &&
+		       rb_entry(prev, struct zram_entry,
+				rb_node)->checksum == *checksum)
+			rb_node = prev;
+	}
+
+	for (; rb_node; rb_node = rb_next(rb_node)) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (entry->checksum != *checksum)
+			break;
+
+		entry->refcount++;
+		spin_unlock(&hash->lock);
+
+		mem = kmap_atomic(page, KM_USER0);
+		match = zram_dedup_match(zram, entry, mem, buffer);
+		kunmap_atomic(mem, KM_USER0);
+		if (match)
+			return entry;
+
+		spin_lock(&hash->lock);
+		if (--entry->refcount) {
+			/* entry is still in the tree, carry on from it */
+			continue;
+		}
+
+		/* the last user went away meanwhile, start over */
+		rb_erase(&entry->rb_node, &hash->rb_root);
+		spin_unlock(&hash->lock);
+		zram_entry_free(zram, entry);
+		spin_lock(&hash->lock);
+		goto again;
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/*
+ * Drops a reference to entry.  Returns true if it was the last one, in
+ * which case the caller must free the entry.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash;
+	bool last;
+
+	if (!zram->dedup)
+		return true;
+
+	hash = zram_dedup_bucket(zram, entry->checksum);
+	spin_lock(&hash->lock);
+	last = !--entry->refcount;
+	if (last)
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	return last;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->dedup)
+		return 0;
+
+	zram->hash_size = roundup_pow_of_two(max_t(size_t, 1,
+			num_pages / ZRAM_DEDUP_PAGES_PER_BUCKET));
+	zram->hash = vzalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash) {
+		pr_err("Error allocating dedup hash table\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+/* Called once all entries have been put */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
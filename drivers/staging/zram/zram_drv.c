@@ -23,33 +23,41 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct kmem_cache *zram_entry_cache;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+const char * const zram_codecs[ZRAM_NR_CODECS] = {
+	"lzo",
+	"lz4",
+};
+
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -74,19 +82,152 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return test_bit(flag, &zram->table[index].flags);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	__set_bit(flag, &zram->table[index].flags);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	__clear_bit(flag, &zram->table[index].flags);
+}
+
+/*
+ * Slots are locked individually, so reads, writes and swap slot frees of
+ * different pages do not serialize against each other.  The lock is held
+ * while a slot is decompressed or its contents replaced, never across a
+ * memory allocation.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	if (unlikely(!bit_spin_trylock(ZRAM_ACCESS,
+				       &zram->table[index].flags))) {
+		zram_stat64_inc(zram, &zram->stats.lock_waits);
+		bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+	}
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zs = per_cpu_ptr(zram->streams,
+					     raw_smp_processor_id());
+
+	if (unlikely(!mutex_trylock(&zs->lock))) {
+		zram_stat64_inc(zram, &zram->stats.lock_waits);
+		mutex_lock(&zs->lock);
+	}
+	return zs;
+}
+
+static void zram_stream_put(struct zram_stream *zs)
+{
+	mutex_unlock(&zs->lock);
+}
+
+static void zram_free_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zs = per_cpu_ptr(zram->streams, cpu);
+
+		if (!IS_ERR_OR_NULL(zs->tfm))
+			crypto_free_comp(zs->tfm);
+		if (!IS_ERR_OR_NULL(zs->dtfm))
+			crypto_free_comp(zs->dtfm);
+		free_pages((unsigned long)zs->buffer, 1);
+	}
+	free_percpu(zram->streams);
+	zram->streams = NULL;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	const char *name = zram_codecs[zram->codec];
+	int cpu;
+
+	zram->streams = alloc_percpu(struct zram_stream);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_stream *zs = per_cpu_ptr(zram->streams, cpu);
+
+		mutex_init(&zs->lock);
+		zs->tfm = crypto_alloc_comp(name, 0, 0);
+		zs->dtfm = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(zs->tfm) || IS_ERR(zs->dtfm)) {
+			pr_err("Error allocating %s compressor!\n", name);
+			goto fail;
+		}
+
+		/* worst case expansion of a page stays well within this */
+		zs->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+						      1);
+		if (!zs->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	zram_free_streams(zram);
+	return -ENOMEM;
+}
+
+static int zram_compress(struct zram *zram, struct zram_stream *zs,
+			 const unsigned char *src, size_t *clen)
+{
+	struct zram_codec_stats *cs = &zram->codec_stats[zram->codec];
+	unsigned int dlen = PAGE_SIZE << 1;
+	u64 start = local_clock();
+	int ret;
+
+	ret = crypto_comp_compress(zs->tfm, src, PAGE_SIZE, zs->buffer, &dlen);
+	if (ret)
+		return ret;
+
+	atomic64_add(local_clock() - start, &cs->compr_ns);
+	atomic64_inc(&cs->compr_pages);
+	atomic64_add(dlen, &cs->compr_size);
+	*clen = dlen;
+	return 0;
+}
+
+/* Called with preemption disabled */
+int zram_decompress(struct zram *zram, const unsigned char *src,
+			   size_t slen, unsigned char *dst)
+{
+	struct zram_codec_stats *cs = &zram->codec_stats[zram->codec];
+	struct zram_stream *zs = this_cpu_ptr(zram->streams);
+	unsigned int dlen = PAGE_SIZE;
+	u64 start = local_clock();
+	int ret;
+
+	ret = crypto_comp_decompress(zs->dtfm, src, slen, dst, &dlen);
+	if (ret)
+		return ret;
+	if (dlen != PAGE_SIZE)
+		return -EINVAL;
+
+	atomic64_add(local_clock() - start, &cs->decompr_ns);
+	atomic64_inc(&cs->decompr_pages);
+	return 0;
 }
 
 static int page_zero_filled(void *ptr)
@@ -133,15 +274,171 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static struct zram_entry *zram_entry_alloc(struct zram *zram, size_t len)
+{
+	struct zram_entry *entry;
+
+	entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	if (len == PAGE_SIZE) {
+		entry->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!entry->page)
+			goto fail;
+	} else {
+		entry->handle = zs_malloc(zram->mem_pool, len);
+		if (!entry->handle)
+			goto fail;
+	}
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->len = len;
+	entry->refcount = 1;
+
+	if (len == PAGE_SIZE)
+		zram_stat_inc(&zram->stats.pages_expand);
+	else if (len <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+	zram_stat64_add(zram, &zram->stats.compr_size, len);
+
+	return entry;
+
+fail:
+	kmem_cache_free(zram_entry_cache, entry);
+	return NULL;
+}
+
+/* Frees an entry once its last reference is gone */
+void zram_entry_free(struct zram *zram, struct zram_entry *entry)
+{
+	if (entry->len == PAGE_SIZE) {
+		__free_page(entry->page);
+		zram_stat_dec(&zram->stats.pages_expand);
+	} else {
+		zs_free(zram->mem_pool, entry->handle);
+		if (entry->len <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+	}
+	zram_stat64_sub(zram, &zram->stats.compr_size, entry->len);
+
+	kmem_cache_free(zram_entry_cache, entry);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block;
+
+	do {
+		block = find_next_zero_bit(zram->bitmap, zram->nr_blocks, 1);
+		if (block >= zram->nr_blocks)
+			return 0;
+	} while (test_and_set_bit(block, zram->bitmap));
+
+	return block;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long block)
+{
+	clear_bit(block, zram->bitmap);
+	zram_stat_dec(&zram->stats.pages_wb);
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long block;
+	int ret;
+};
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw = container_of(work, struct zram_bdev_work,
+						 work);
+	struct zram *zram = zw->zram;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = zw->block << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, zw->page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(READ, bio);
+	wait_for_completion(&done);
+
+	zw->ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+}
+
+/*
+ * Bios submitted from a make_request function are only started once it
+ * returns, so the read is issued and waited for from a worker instead.
+ *
+ * The slot is not locked here.  Like the rest of zram this relies on the
+ * user not freeing or overwriting a page while reading it.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page,
+			  unsigned long block)
+{
+	struct zram_bdev_work zw = {
+		.zram = zram,
+		.page = page,
+		.block = block,
+	};
+
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	if (unlikely(zw.ret)) {
+		pr_err("Read from backing device failed! block=%lu\n", block);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return zw.ret;
+	}
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	flush_dcache_page(page);
+	return 0;
+}
+#else
+static inline void zram_free_block(struct zram *zram, unsigned long block)
+{
+}
+
+static inline int zram_bdev_read(struct zram *zram, struct page *page,
+				 unsigned long block)
+{
+	return -EIO;
+}
+#endif
+
+/* Called with the slot locked, or on a device nobody is using */
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	struct zram_entry *entry = zram->table[index].entry;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_block(zram, zram->table[index].bdev_block);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram->table[index].bdev_block = 0;
+		return;
+	}
+
+	if (unlikely(!entry)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -153,28 +450,13 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
-	}
-
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
-
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	if (zram_dedup_put(zram, entry))
+		zram_entry_free(zram, entry);
+	else
+		zram_stat_dec(&zram->stats.pages_dup);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].entry = NULL;
 }
 
 static void handle_zero_page(struct page *page)
@@ -194,8 +476,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].entry->page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -204,70 +485,78 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+static int zram_read_page(struct zram *zram, struct page *page, u32 index)
 {
+	int ret;
+	struct zram_entry *entry;
+	unsigned char *user_mem, *cmem;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	zram_slot_lock(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	entry = zram->table[index].entry;
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned long block = zram->table[index].bdev_block;
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		zram_slot_unlock(zram, index);
+		return zram_bdev_read(zram, page, block);
+	}
 
-		page = bvec->bv_page;
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_slot_unlock(zram, index);
+		handle_zero_page(page);
+		return 0;
+	}
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	/* Requested page is not present in compressed area */
+	if (unlikely(!entry)) {
+		zram_slot_unlock(zram, index);
+		pr_debug("Read before write: index=%u\n", index);
+		handle_zero_page(page);
+		return 0;
+	}
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(entry->len == PAGE_SIZE)) {
+		handle_uncompressed_page(zram, page, index);
+		zram_slot_unlock(zram, index);
+		return 0;
+	}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	user_mem = kmap_atomic(page, KM_USER0);
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+	ret = zram_decompress(zram, cmem, entry->len, user_mem);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	kunmap_atomic(user_mem, KM_USER0);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+	zram_slot_unlock(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	flush_dcache_page(page);
+	return 0;
+}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+static void zram_read(struct zram *zram, struct bio *bio)
+{
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
+
+	zram_stat64_inc(zram, &zram->stats.num_reads);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-		flush_dcache_page(page);
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_read_page(zram, bvec->bv_page, index))
+			goto out;
 		index++;
 	}
 
@@ -279,121 +568,120 @@ out:
 	bio_io_error(bio);
 }
 
-static void zram_write(struct zram *zram, struct bio *bio)
+/*
+ * The page is compressed and its new home allocated without the slot lock,
+ * which is only taken to swap the old contents for the new ones.  With
+ * deduplication enabled, a page already stored under another index is
+ * shared instead.
+ */
+static int zram_write_page(struct zram *zram, struct page *page, u32 index)
 {
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
-
-	zram_stat64_inc(zram, &zram->stats.num_writes);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
-
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+	int ret;
+	size_t clen;
+	u32 checksum;
+	struct zram_stream *zs;
+	struct zram_entry *entry;
+	unsigned char *user_mem, *cmem;
 
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_zero_filled(user_mem)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		zram_slot_lock(zram, index);
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_slot_unlock(zram, index);
+		zram_stat_inc(&zram->stats.pages_zero);
+		return 0;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-		mutex_lock(&zram->lock);
+	zs = zram_stream_get(zram);
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
+	if (zram->dedup) {
+		entry = zram_dedup_find(zram, page, &checksum, zs->buffer);
+		if (entry) {
+			zram_stream_put(zs);
+			zram_stat_inc(&zram->stats.pages_dup);
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			goto found;
 		}
+	}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
-
-		kunmap_atomic(user_mem, KM_USER0);
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = zram_compress(zram, zs, user_mem, &clen);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+	if (unlikely(ret)) {
+		zram_stream_put(zs);
+		pr_err("Compression failed! err=%d\n", ret);
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		return -EIO;
+	}
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size))
+		clen = PAGE_SIZE;
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+	entry = zram_entry_alloc(zram, clen);
+	if (unlikely(!entry)) {
+		zram_stream_put(zs);
+		pr_info("Error allocating memory for page: %u, size=%zu\n",
+			index, clen);
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		return -ENOMEM;
+	}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+	if (clen == PAGE_SIZE) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(entry->page, KM_USER1);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+	} else {
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_WO);
+		memcpy(cmem, zs->buffer, clen);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+	}
+	zram_stream_put(zs);
 
-memstore:
-		zram->table[index].offset = offset;
+	if (zram->dedup)
+		zram_dedup_insert(zram, entry, checksum);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+found:
+	zram_slot_lock(zram, index);
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_free_page(zram, index);
+	zram->table[index].entry = entry;
+	zram_slot_unlock(zram, index);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+	zram_stat_inc(&zram->stats.pages_stored);
 
-		memcpy(cmem, src, clen);
+	return 0;
+}
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+static void zram_write(struct zram *zram, struct bio *bio)
+{
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+	zram_stat64_inc(zram, &zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-		mutex_unlock(&zram->lock);
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_write_page(zram, bvec->bv_page, index))
+			goto out;
 		index++;
 	}
 
@@ -453,6 +741,337 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Writeback copies pages out of the table in batches of up to
+ * ZRAM_WB_BATCH_PAGES, each written with one bio to consecutive blocks,
+ * and keeps up to ZRAM_WB_BATCHES of these in flight.
+ */
+#define ZRAM_WB_BATCH_PAGES	16
+#define ZRAM_WB_BATCHES		4
+
+struct zram_wb_batch {
+	struct bio *bio;
+	struct completion done;
+	unsigned long block;	/* of the first page */
+	int nr;
+	int nr_written;		/* pages that made it into the bio */
+	u32 index[ZRAM_WB_BATCH_PAGES];
+	struct page *pages[ZRAM_WB_BATCH_PAGES];
+};
+
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long *bitmap;
+	unsigned long nr_blocks;
+	size_t len;
+	char *name;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	len = strlen(name);
+	if (len && name[len - 1] == '\n')
+		name[len - 1] = '\0';
+
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return -EINVAL;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done || zram->bdev) {
+		mutex_unlock(&zram->init_lock);
+		vfree(bitmap);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return -EBUSY;
+	}
+	zram->bdev = bdev;
+	zram->backing_dev = name;
+	zram->bitmap = bitmap;
+	zram->nr_blocks = nr_blocks;
+	mutex_unlock(&zram->init_lock);
+
+	pr_info("Using %s as backing device, %lu pages\n", name, nr_blocks);
+	return 0;
+}
+
+/* Called with init_lock held */
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+	zram->wb_limit_enable = false;
+	zram->wb_limit = 0;
+}
+
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	for (index = 0; zram->init_done &&
+	     index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_slot_lock(zram, index);
+		if (zram->table[index].entry &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_slot_unlock(zram, index);
+	}
+	mutex_unlock(&zram->init_lock);
+}
+
+/*
+ * Copies the page at index into dst if writeback mode selects it, and
+ * marks it ZRAM_UNDER_WB.  Any write or free of the slot clears the flag,
+ * telling zram_wb_finish() that the copy is stale.
+ */
+static bool zram_wb_grab(struct zram *zram, u32 index, int mode,
+			 struct page *dst)
+{
+	struct zram_entry *entry;
+	unsigned char *src, *mem;
+	bool ret = false;
+
+	zram_slot_lock(zram, index);
+	entry = zram->table[index].entry;
+	if (!entry || zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		goto out;
+	if ((mode & ZRAM_WB_IDLE) && !zram_test_flag(zram, index, ZRAM_IDLE))
+		goto out;
+	if ((mode & ZRAM_WB_HUGE) && entry->len != PAGE_SIZE)
+		goto out;
+	/* moving one of several users of an entry frees no memory */
+	if (entry->refcount > 1)
+		goto out;
+
+	mem = kmap_atomic(dst, KM_USER0);
+	if (entry->len == PAGE_SIZE) {
+		src = kmap_atomic(entry->page, KM_USER1);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER1);
+		ret = true;
+	} else {
+		src = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = !zram_decompress(zram, src, entry->len, mem);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+	}
+	kunmap_atomic(mem, KM_USER0);
+
+	if (ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+out:
+	zram_slot_unlock(zram, index);
+	return ret;
+}
+
+static void zram_wb_submit(struct zram *zram, struct zram_wb_batch *wb)
+{
+	struct bio *bio;
+	int i;
+
+	bio = bio_alloc(GFP_NOIO, wb->nr);
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = wb->block << SECTORS_PER_PAGE_SHIFT;
+	for (i = 0; i < wb->nr; i++)
+		if (!bio_add_page(bio, wb->pages[i], PAGE_SIZE, 0))
+			break;
+
+	/*
+	 * The queue limits may cut the batch short, zram_wb_finish() gives
+	 * the slots that did not fit back.
+	 */
+	wb->nr_written = i;
+	if (!i) {
+		bio_put(bio);
+		return;
+	}
+
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &wb->done;
+
+	INIT_COMPLETION(wb->done);
+	wb->bio = bio;
+	submit_bio(WRITE, bio);
+}
+
+/*
+ * Waits for a batch and moves the slots that did not change meanwhile to
+ * the blocks written.  Returns the number of pages moved.
+ */
+static int zram_wb_finish(struct zram *zram, struct zram_wb_batch *wb)
+{
+	bool error = true;
+	int i, moved = 0;
+
+	if (wb->bio) {
+		wait_for_completion(&wb->done);
+		error = !test_bit(BIO_UPTODATE, &wb->bio->bi_flags);
+		bio_put(wb->bio);
+		wb->bio = NULL;
+		if (error)
+			pr_err("Write to backing device failed! block=%lu\n",
+				wb->block);
+	}
+
+	for (i = 0; i < wb->nr; i++) {
+		u32 index = wb->index[i];
+
+		zram_slot_lock(zram, index);
+		if (error || i >= wb->nr_written ||
+		    !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			clear_bit(wb->block + i, zram->bitmap);
+			zram_slot_unlock(zram, index);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram->table[index].bdev_block = wb->block + i;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_slot_unlock(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_wb);
+		moved++;
+	}
+
+	zram_stat64_add(zram, &zram->stats.bd_writes, moved);
+	wb->nr = 0;
+	return moved;
+}
+
+/*
+ * Moves the pages selected by mode to the backing device, within the
+ * writeback limit if enabled.  Returns the number of pages moved.
+ */
+int zram_writeback(struct zram *zram, int mode)
+{
+	struct zram_wb_batch *batches, *wb;
+	unsigned long block = 0, budget = ULONG_MAX;
+	size_t index, nr_pages;
+	int i, cur = 0, ret = 0;
+	u64 moved = 0;
+
+	batches = kcalloc(ZRAM_WB_BATCHES, sizeof(*batches), GFP_KERNEL);
+	if (!batches)
+		return -ENOMEM;
+	for (i = 0; i < ZRAM_WB_BATCHES; i++) {
+		init_completion(&batches[i].done);
+		for (index = 0; index < ZRAM_WB_BATCH_PAGES; index++) {
+			batches[i].pages[index] = alloc_page(GFP_KERNEL);
+			if (!batches[i].pages[index]) {
+				ret = -ENOMEM;
+				goto free;
+			}
+		}
+	}
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	spin_lock(&zram->stat64_lock);
+	if (zram->wb_limit_enable)
+		budget = min_t(u64, zram->wb_limit, ULONG_MAX);
+	spin_unlock(&zram->stat64_lock);
+
+	/*
+	 * A block is taken before looking for a page to put in it, so a
+	 * batch can be submitted as soon as the next block does not follow
+	 * its last one.
+	 */
+	wb = &batches[0];
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages && budget; index++) {
+		if (!block) {
+			block = zram_alloc_block(zram);
+			if (!block) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		if (wb->nr && block != wb->block + wb->nr) {
+			zram_wb_submit(zram, wb);
+			cur = (cur + 1) % ZRAM_WB_BATCHES;
+			wb = &batches[cur];
+			moved += zram_wb_finish(zram, wb);
+		}
+
+		if (!zram_wb_grab(zram, index, mode, wb->pages[wb->nr]))
+			continue;
+
+		if (!wb->nr)
+			wb->block = block;
+		wb->index[wb->nr++] = index;
+		block = 0;
+		budget--;
+
+		if (wb->nr == ZRAM_WB_BATCH_PAGES) {
+			zram_wb_submit(zram, wb);
+			cur = (cur + 1) % ZRAM_WB_BATCHES;
+			wb = &batches[cur];
+			moved += zram_wb_finish(zram, wb);
+		}
+	}
+	if (block)
+		clear_bit(block, zram->bitmap);
+
+	if (wb->nr)
+		zram_wb_submit(zram, wb);
+	for (i = 0; i < ZRAM_WB_BATCHES; i++)
+		moved += zram_wb_finish(zram, &batches[i]);
+
+	if (zram->wb_limit_enable) {
+		spin_lock(&zram->stat64_lock);
+		zram->wb_limit -= min(zram->wb_limit, moved);
+		spin_unlock(&zram->stat64_lock);
+	}
+unlock:
+	mutex_unlock(&zram->init_lock);
+free:
+	for (i = 0; i < ZRAM_WB_BATCHES; i++)
+		for (index = 0; index < ZRAM_WB_BATCH_PAGES; index++)
+			if (batches[i].pages[index])
+				__free_page(batches[i].pages[index]);
+	kfree(batches);
+
+	return ret ? ret : min_t(u64, moved, INT_MAX);
+}
+#else
+static inline void zram_reset_backing_dev(struct zram *zram)
+{
+}
+#endif
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -461,33 +1080,25 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		struct zram_entry *entry = zram->table[index].entry;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (zram_test_flag(zram, index, ZRAM_WB))
 			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		if (entry && zram_dedup_put(zram, entry))
+			zram_entry_free(zram, entry);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
+	zram_dedup_fini(zram);
+	zram_reset_backing_dev(zram);
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,20 +1122,6 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
 	if (!zram->table) {
@@ -540,13 +1137,21 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	ret = zram_alloc_streams(zram);
+	if (ret)
+		goto fail;
+
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
@@ -566,7 +1171,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,7 +1186,6 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
 
@@ -664,11 +1270,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -698,6 +1310,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	kmem_cache_destroy(zram_entry_cache);
 out:
 	return ret;
 }
@@ -713,11 +1327,14 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		else
+			zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	kmem_cache_destroy(zram_entry_cache);
 	pr_debug("Cleanup done!\n");
 }
 
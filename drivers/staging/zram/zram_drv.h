@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,8 +42,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -65,25 +56,89 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
-	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
-
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Slot lock, see zram_slot_lock() */
+	ZRAM_ACCESS,
+
+	/* Page is on the backing device, at table[page_no].bdev_block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since marked idle through sysfs */
+	ZRAM_IDLE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * A stored page.  With deduplication enabled, disk pages with the same
+ * contents share one, and it is kept in zram->hash under the checksum of
+ * the uncompressed page.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	union {
+		unsigned long handle;	/* zsmalloc object */
+		struct page *page;	/* if stored uncompressed */
+	};
+	u32 checksum;
+	u16 len;		/* compressed size, PAGE_SIZE if uncompressed */
+	unsigned long refcount;	/* protected by the hash bucket lock */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
+/*
+ * Allocated for each disk page.  All fields are protected by the ZRAM_ACCESS
+ * bit lock in flags, so the other flags must only be changed with it held.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	union {
+		struct zram_entry *entry;
+		unsigned long bdev_block;	/* if ZRAM_WB */
+	};
+	unsigned long flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Compression backends, any compression algorithm known to the crypto API
+ * can be added here.  Selected per device through the comp_algorithm
+ * sysfs node before the device is initialized.
+ */
+extern const char * const zram_codecs[];
+#define ZRAM_NR_CODECS		2
+
+/*
+ * Compression workspace.  Each device has one per cpu, so writers on
+ * different cpus compress in parallel.  The mutex protects tfm and buffer
+ * and only matters when a writer is preempted or migrated while holding
+ * one.  dtfm is used for decompression with preemption disabled.
+ */
+struct zram_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	struct crypto_comp *dtfm;
+	void *buffer;
+};
+
+/* Kept across device resets, so codecs can be compared on one device */
+struct zram_codec_stats {
+	atomic64_t compr_pages;		/* pages passed to the compressor */
+	atomic64_t compr_size;		/* and the bytes it made of them */
+	atomic64_t compr_ns;
+	atomic64_t decompr_pages;
+	atomic64_t decompr_ns;
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -92,20 +147,29 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 lock_waits;		/* contended slot and stream locks */
+	u64 dedup_hits;		/* writes that found their page stored */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_dup;	/* no. of pages sharing another's entry */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+#endif
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_stream __percpu *streams;
+	int codec;		/* index into zram_codecs */
 	struct table *table;
+	struct zram_hash *hash;	/* if dedup, indexed by checksum */
+	size_t hash_size;
+	bool dedup;		/* changed only before init */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,8 +180,21 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/*
+	 * Set before init through the backing_dev sysfs node, dropped on
+	 * reset.  One bit per page sized block on it, block 0 is unused.
+	 */
+	struct block_device *bdev;
+	char *backing_dev;
+	unsigned long *bitmap;
+	unsigned long nr_blocks;
+	bool wb_limit_enable;
+	u64 wb_limit;		/* pages, protected by stat64_lock */
+#endif
 
 	struct zram_stats stats;
+	struct zram_codec_stats codec_stats[ZRAM_NR_CODECS];
 };
 
 extern struct zram *devices;
@@ -128,5 +205,28 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_decompress(struct zram *zram, const unsigned char *src,
+			   size_t slen, unsigned char *dst);
+extern void zram_entry_free(struct zram *zram, struct zram_entry *entry);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Which pages zram_writeback() picks, both bits means idle huge ones */
+#define ZRAM_WB_IDLE		0x1
+#define ZRAM_WB_HUGE		0x2
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int mode);
+#endif
+
+/* zram_dedup.c */
+extern int zram_dedup_init(struct zram *zram, size_t num_pages);
+extern void zram_dedup_fini(struct zram *zram);
+extern struct zram_entry *zram_dedup_find(struct zram *zram,
+					  struct page *page, u32 *checksum,
+					  void *buffer);
+extern void zram_dedup_insert(struct zram *zram, struct zram_entry *new,
+			      u32 checksum);
+extern bool zram_dedup_put(struct zram *zram, struct zram_entry *entry);
 
 #endif
@@ -14,6 +14,7 @@
 
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 
 #include "zram_drv.h"
@@ -72,6 +73,74 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 }
 
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; i < ZRAM_NR_CODECS; i++) {
+		if (i == zram->codec)
+			sz += sprintf(buf + sz, "[%s] ", zram_codecs[i]);
+		else
+			sz += sprintf(buf + sz, "%s ", zram_codecs[i]);
+	}
+	buf[sz - 1] = '\n';
+
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int i;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+
+	for (i = 0; i < ZRAM_NR_CODECS; i++) {
+		if (sysfs_streq(buf, zram_codecs[i]))
+			break;
+	}
+	if (i == ZRAM_NR_CODECS || !crypto_has_comp(zram_codecs[i], 0, 0))
+		return -EINVAL;
+
+	zram->codec = i;
+	return len;
+}
+
+static ssize_t dedup_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->dedup);
+}
+
+static ssize_t dedup_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->dedup = !!val;
+	return len;
+}
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -148,12 +217,38 @@ static ssize_t notify_free_show(struct device *dev,
 		zram_stat64_read(zram, &zram->stats.notify_free));
 }
 
+static ssize_t lock_waits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.lock_waits));
+}
+
 static ssize_t zero_pages_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t dup_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_dup));
+}
+
+static ssize_t dedup_hits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.dedup_hits));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -162,7 +257,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -181,38 +276,293 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		val = zs_get_total_size_bytes(zram->mem_pool) +
+			((u64)atomic_read(&zram->stats.pages_expand) <<
+			 PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zs_pool_stats stats = { 0 };
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_get_pool_stats(zram->mem_pool, &stats);
+	mutex_unlock(&zram->init_lock);
+
+	return sprintf(buf, "%lu\n", stats.pages_compacted);
+}
+
+/*
+ * Percentage of the memory allocated for compressed pages that holds no
+ * object, either left over at the end of zspages or in free slots.
+ */
+static ssize_t mem_fragmentation_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 total, frag = 0;
+	struct zs_pool_stats stats = { 0 };
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_get_pool_stats(zram->mem_pool, &stats);
+	mutex_unlock(&zram->init_lock);
+
+	total = (u64)stats.pages_used << PAGE_SHIFT;
+	if (total)
+		frag = div64_u64((total - stats.bytes_used) * 100, total);
+
+	return sprintf(buf, "%llu\n", frag);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	sz = sprintf(buf, "%s\n",
+		     zram->backing_dev ? zram->backing_dev : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		pr_info("Cannot set backing device for initialized device\n");
+		return -EBUSY;
+	}
+
+	ret = zram_set_backing_dev(zram, buf);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	zram_mark_idle(zram);
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret, mode;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "huge_idle"))
+		mode = ZRAM_WB_IDLE | ZRAM_WB_HUGE;
+	else
+		return -EINVAL;
+
+	ret = zram_writeback(zram, mode);
+	if (ret < 0)
+		return ret;
+
+	return len;
+}
+
+static ssize_t writeback_limit_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->wb_limit_enable);
+}
+
+static ssize_t writeback_limit_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->wb_limit_enable = !!val;
+	return len;
+}
+
+static ssize_t writeback_limit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n", zram_stat64_read(zram, &zram->wb_limit));
+}
+
+static ssize_t writeback_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	u64 val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoull(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	spin_lock(&zram->stat64_lock);
+	zram->wb_limit = val;
+	spin_unlock(&zram->stat64_lock);
+
+	return len;
+}
+
+/* pages stored on, read from and written to the backing device */
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%8u %8llu %8llu\n",
+		atomic_read(&zram->stats.pages_wb),
+		zram_stat64_read(zram, &zram->stats.bd_reads),
+		zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+#endif
+
+/* bytes per nanosecond to MB/s */
+static u64 zram_codec_rate(u64 bytes, u64 ns)
+{
+	return ns ? div64_u64(bytes * 1000, ns) : 0;
+}
+
+static ssize_t codec_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	sz += sprintf(buf, "%-8s %12s %12s %8s %10s %10s\n", "codec",
+		      "pages", "compr_size", "ratio%", "comp_MB/s",
+		      "decomp_MB/s");
+	for (i = 0; i < ZRAM_NR_CODECS; i++) {
+		struct zram_codec_stats *cs = &zram->codec_stats[i];
+		u64 pages = atomic64_read(&cs->compr_pages);
+		u64 compr_size = atomic64_read(&cs->compr_size);
+		u64 orig_size = pages << PAGE_SHIFT;
+
+		sz += sprintf(buf + sz,
+			"%-8s %12llu %12llu %8llu %10llu %10llu\n",
+			zram_codecs[i], pages, compr_size,
+			orig_size ? div64_u64(compr_size * 100, orig_size) : 0,
+			zram_codec_rate(orig_size,
+					atomic64_read(&cs->compr_ns)),
+			zram_codec_rate(atomic64_read(&cs->decompr_pages) <<
+					PAGE_SHIFT,
+					atomic64_read(&cs->decompr_ns)));
+	}
+
+	return sz;
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(dedup_enable, S_IRUGO | S_IWUSR,
+		dedup_enable_show, dedup_enable_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
+static DEVICE_ATTR(lock_waits, S_IRUGO, lock_waits_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(dup_pages, S_IRUGO, dup_pages_show, NULL);
+static DEVICE_ATTR(dedup_hits, S_IRUGO, dedup_hits_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(codec_stats, S_IRUGO, codec_stats_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
+static DEVICE_ATTR(mem_fragmentation, S_IRUGO, mem_fragmentation_show, NULL);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(writeback_limit_enable, S_IRUGO | S_IWUSR,
+		writeback_limit_enable_show, writeback_limit_enable_store);
+static DEVICE_ATTR(writeback_limit, S_IRUGO | S_IWUSR,
+		writeback_limit_show, writeback_limit_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_dedup_enable.attr,
 	&dev_attr_initstate.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
+	&dev_attr_lock_waits.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_dup_pages.attr,
+	&dev_attr_dedup_hits.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_codec_stats.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
+	&dev_attr_mem_fragmentation.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_writeback_limit_enable.attr,
+	&dev_attr_writeback_limit.attr,
+	&dev_attr_bd_stat.attr,
+#endif
 	NULL,
 };
 
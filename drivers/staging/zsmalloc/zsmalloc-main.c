@@ -0,0 +1,909 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc is a slab-like allocator for compressed pages.  Objects are
+ * sorted into size classes 16 bytes apart, and each class packs its
+ * objects back to back into 'zspages': chains of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE discontiguous 0-order pages, sized so that
+ * little is left over at the end.  Objects may thus span two pages, so
+ * they are only accessible between zs_map_object() and zs_unmap_object().
+ *
+ * Allocations return an opaque handle instead of an address, which lets
+ * zs_compact() move objects out of sparsely used zspages and free them.
+ *
+ * Pages of a zspage use the following struct page fields:
+ *
+ *	page->flags: PG_private is set on all of them, PG_private_2 marks
+ *		the first page
+ *	page->private: (first page) the second page, if any
+ *	page->first_page: (other pages) the first page
+ *	page->freelist: (other pages) the next page, if any
+ *	page->index: (first page) index of the first free object
+ *	page->inuse: (first page) number of allocated objects
+ *	page->objects: (first page) size class index and fullness group
+ *	page->lru: (first page) links the zspage into its fullness list
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Shared by all pools, allocated when the first one is created */
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+static struct kmem_cache *zs_handle_cachep;
+static DEFINE_MUTEX(zs_globals_lock);
+static int zs_globals_users;
+
+static int is_first_page(struct page *page)
+{
+	return PagePrivate2(page);
+}
+
+static struct page *get_next_page(struct page *page)
+{
+	if (is_first_page(page))
+		return (struct page *)page_private(page);
+	return page->freelist;
+}
+
+static void get_zspage_mapping(struct page *first_page,
+				unsigned int *class_idx,
+				enum fullness_group *fullness)
+{
+	BUG_ON(!is_first_page(first_page));
+
+	*fullness = first_page->objects & FULLNESS_MASK;
+	*class_idx = first_page->objects >> FULLNESS_BITS;
+}
+
+static void set_zspage_mapping(struct page *first_page,
+				unsigned int class_idx,
+				enum fullness_group fullness)
+{
+	BUG_ON(!is_first_page(first_page));
+
+	first_page->objects = (class_idx << FULLNESS_BITS) | fullness;
+}
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct page *first_page)
+{
+	int inuse = first_page->inuse;
+	int max_objects = class->objs_per_zspage;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max_objects)
+		return ZS_FULL;
+	if (inuse <= 3 * max_objects / fullness_threshold_frac)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+static void insert_zspage(struct page *first_page, struct size_class *class,
+				enum fullness_group fullness)
+{
+	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
+		return;
+
+	list_add(&first_page->lru, &class->fullness_list[fullness]);
+}
+
+static void remove_zspage(struct page *first_page, struct size_class *class,
+				enum fullness_group fullness)
+{
+	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
+		return;
+
+	BUG_ON(list_empty(&class->fullness_list[fullness]));
+	list_del_init(&first_page->lru);
+}
+
+/*
+ * Moves the zspage to the list of its new fullness group, if it changed.
+ * Returns the new fullness group.  Caller needs to hold class->lock.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+						struct page *first_page)
+{
+	unsigned int class_idx;
+	enum fullness_group currfg, newfg;
+
+	get_zspage_mapping(first_page, &class_idx, &currfg);
+	newfg = get_fullness_group(class, first_page);
+	if (newfg == currfg)
+		goto out;
+
+	remove_zspage(first_page, class, currfg);
+	insert_zspage(first_page, class, newfg);
+	set_zspage_mapping(first_page, class_idx, newfg);
+
+out:
+	return newfg;
+}
+
+/*
+ * We have to decide on how many pages to link together
+ * to form a zspage for each size class. This is important
+ * to reduce wastage due to unusable space left at end of
+ * each zspage which is given as:
+ *	wastage = Zp % size_class
+ * where Zp = zspage size = k * PAGE_SIZE where k = 1, 2, ...
+ *
+ * For example, for size class of 3/8 * PAGE_SIZE, we should
+ * link together 3 PAGE_SIZE sized pages to form a zspage
+ * since then we can perfectly fit in 8 such objects.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	/* number of pages which gives the highest used percentage */
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size;
+		int waste, usedpc;
+
+		zspage_size = i * PAGE_SIZE;
+		waste = zspage_size % class_size;
+		usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+/*
+ * Returns the page the object starts in and its offset there.  The
+ * object continues into the next page if offset + class->size exceeds
+ * PAGE_SIZE.
+ */
+static struct page *obj_page(struct page *first_page,
+				struct size_class *class,
+				unsigned long obj_idx, unsigned long *offset)
+{
+	unsigned long off = obj_idx * class->size;
+	struct page *page = first_page;
+	int n = off >> PAGE_SHIFT;
+
+	while (n--)
+		page = get_next_page(page);
+	*offset = off & ~PAGE_MASK;
+
+	return page;
+}
+
+static unsigned long location_to_obj(struct page *first_page,
+					unsigned long obj_idx)
+{
+	return (page_to_pfn(first_page) << OBJ_INDEX_BITS) |
+		(obj_idx & OBJ_INDEX_MASK);
+}
+
+static void obj_to_location(unsigned long obj, struct page **first_page,
+				unsigned long *obj_idx)
+{
+	*first_page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle >> OBJ_TAG_BITS;
+}
+
+/* Keeps the pin bit, which is held whenever the handle changes */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	unsigned long *p = (unsigned long *)handle;
+
+	*p = (obj << OBJ_TAG_BITS) | (*p & (1UL << HANDLE_PIN_BIT));
+}
+
+static void pin_handle(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_handle(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_handle(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+/* The header word never spans two pages, see ZS_ALIGN */
+static unsigned long obj_read_header(struct page *first_page,
+				struct size_class *class, unsigned long obj_idx)
+{
+	unsigned long off, head;
+	struct page *page;
+	void *addr;
+
+	page = obj_page(first_page, class, obj_idx, &off);
+	addr = kmap_atomic(page, KM_USER0);
+	head = *(unsigned long *)(addr + off);
+	kunmap_atomic(addr, KM_USER0);
+
+	return head;
+}
+
+static void obj_write_header(struct page *first_page,
+				struct size_class *class,
+				unsigned long obj_idx, unsigned long head)
+{
+	unsigned long off;
+	struct page *page;
+	void *addr;
+
+	page = obj_page(first_page, class, obj_idx, &off);
+	addr = kmap_atomic(page, KM_USER0);
+	*(unsigned long *)(addr + off) = head;
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/*
+ * Takes the first free object of the zspage for the given handle and
+ * returns its index.  Caller needs to hold class->lock.
+ */
+static unsigned long obj_malloc(struct size_class *class,
+				struct page *first_page, unsigned long handle)
+{
+	unsigned long obj_idx = first_page->index;
+	unsigned long head;
+
+	BUG_ON(obj_idx == OBJ_INDEX_END);
+	head = obj_read_header(first_page, class, obj_idx);
+	BUG_ON(head & OBJ_ALLOCATED_TAG);
+
+	first_page->index = head >> OBJ_TAG_BITS;
+	obj_write_header(first_page, class, obj_idx,
+			 handle | OBJ_ALLOCATED_TAG);
+	record_obj(handle, location_to_obj(first_page, obj_idx));
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj_idx;
+}
+
+/* Caller needs to hold class->lock */
+static void obj_free(struct size_class *class, struct page *first_page,
+			unsigned long obj_idx)
+{
+	obj_write_header(first_page, class, obj_idx,
+			 first_page->index << OBJ_TAG_BITS);
+	first_page->index = obj_idx;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
+static void reset_page(struct page *page)
+{
+	ClearPagePrivate(page);
+	ClearPagePrivate2(page);
+	set_page_private(page, 0);
+	page->freelist = NULL;
+	reset_page_mapcount(page);
+}
+
+static void free_zspage(struct page *first_page)
+{
+	struct page *page = first_page, *next;
+
+	BUG_ON(first_page->inuse);
+
+	while (page) {
+		next = get_next_page(page);
+		reset_page(page);
+		__free_page(page);
+		page = next;
+	}
+}
+
+/* Links all free objects of a new zspage into its freelist */
+static void init_zspage(struct page *first_page, struct size_class *class)
+{
+	unsigned long i, next;
+
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		next = i + 1;
+		if (next == class->objs_per_zspage)
+			next = OBJ_INDEX_END;
+		obj_write_header(first_page, class, i, next << OBJ_TAG_BITS);
+	}
+	first_page->index = 0;
+}
+
+static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct page *first_page = NULL, *prev_page = NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page;
+
+		page = alloc_page(flags);
+		if (!page) {
+			if (first_page)
+				free_zspage(first_page);
+			return NULL;
+		}
+
+		SetPagePrivate(page);
+		if (i == 0) {
+			first_page = page;
+			SetPagePrivate2(page);
+			set_page_private(page, 0);
+			page->inuse = 0;
+		} else {
+			page->first_page = first_page;
+			page->freelist = NULL;
+			if (i == 1)
+				set_page_private(first_page,
+						 (unsigned long)page);
+			else
+				prev_page->freelist = page;
+		}
+		prev_page = page;
+	}
+
+	init_zspage(first_page, class);
+
+	return first_page;
+}
+
+static struct page *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct page, lru);
+	}
+
+	return NULL;
+}
+
+static void zs_free_globals(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zs_map_area, cpu).vm_buf);
+		per_cpu(zs_map_area, cpu).vm_buf = NULL;
+	}
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
+	zs_handle_cachep = NULL;
+}
+
+static int zs_get_globals(void)
+{
+	int cpu, ret = 0;
+
+	mutex_lock(&zs_globals_lock);
+	if (zs_globals_users++)
+		goto out;
+
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					     0, 0, NULL);
+	if (!zs_handle_cachep)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		void *buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+
+		if (!buf)
+			goto fail;
+		per_cpu(zs_map_area, cpu).vm_buf = buf;
+	}
+	goto out;
+
+fail:
+	zs_free_globals();
+	zs_globals_users--;
+	ret = -ENOMEM;
+out:
+	mutex_unlock(&zs_globals_lock);
+	return ret;
+}
+
+static void zs_put_globals(void)
+{
+	mutex_lock(&zs_globals_lock);
+	if (!--zs_globals_users)
+		zs_free_globals();
+	mutex_unlock(&zs_globals_lock);
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool, used in messages
+ * @flags: allocation flags used to allocate pool pages
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i;
+	struct zs_pool *pool;
+
+	BUILD_BUG_ON(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE >=
+		     OBJ_INDEX_END);
+	BUILD_BUG_ON(ZS_SIZE_CLASSES << FULLNESS_BITS > USHRT_MAX);
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if (zs_get_globals()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fullness;
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = min(ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA,
+				  (int)ZS_MAX_ALLOC_SIZE);
+		class->index = i;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					 PAGE_SIZE / class->size;
+		spin_lock_init(&class->lock);
+		for (fullness = 0; fullness < _ZS_NR_FULLNESS_GROUPS;
+							fullness++)
+			INIT_LIST_HEAD(&class->fullness_list[fullness]);
+	}
+
+	pool->handle_cachep = zs_handle_cachep;
+	pool->flags = flags;
+	pool->name = name;
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			if (list_empty(&class->fullness_list[fg]))
+				continue;
+			pr_info("Freeing non-empty class with size %db, "
+				"fullness group %d\n", class->size, fg);
+		}
+	}
+	kfree(pool);
+	zs_put_globals();
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * On success, handle to the allocated object is returned,
+ * otherwise 0.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE will
+ * fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	unsigned long handle;
+	struct size_class *class;
+	struct page *first_page;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(pool->handle_cachep,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (unlikely(!handle))
+		return 0;
+	*(unsigned long *)handle = 0;
+
+	class = &pool->size_class[get_size_class_index(size + ZS_HANDLE_SIZE)];
+
+	spin_lock(&class->lock);
+	first_page = find_get_zspage(class);
+
+	if (unlikely(!first_page)) {
+		spin_unlock(&class->lock);
+		first_page = alloc_zspage(class, pool->flags);
+		if (unlikely(!first_page)) {
+			kmem_cache_free(pool->handle_cachep, (void *)handle);
+			return 0;
+		}
+
+		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	obj_malloc(class, first_page, handle);
+	fix_fullness_group(class, first_page);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *first_page;
+	unsigned long obj_idx;
+	unsigned int class_idx;
+	enum fullness_group fullness;
+	struct size_class *class;
+
+	if (unlikely(!handle))
+		return;
+
+	/* keeps compaction from moving the object under us */
+	pin_handle(handle);
+	obj_to_location(handle_to_obj(handle), &first_page, &obj_idx);
+	get_zspage_mapping(first_page, &class_idx, &fullness);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&class->lock);
+	obj_free(class, first_page, obj_idx);
+	fullness = fix_fullness_group(class, first_page);
+	if (fullness == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+
+	unpin_handle(handle);
+	kmem_cache_free(pool->handle_cachep, (void *)handle);
+
+	if (fullness == ZS_EMPTY) {
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+		free_zspage(first_page);
+	}
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/* Copies an object that spans two pages in or out of buf */
+static void zs_copy_object(char *buf, struct page *page, unsigned long off,
+			   int size, bool out)
+{
+	int first = PAGE_SIZE - off;
+	char *addr;
+
+	addr = kmap_atomic(page, KM_USER0);
+	if (out)
+		/* the header is ours, it may have been copied in stale */
+		memcpy(addr + off + ZS_HANDLE_SIZE, buf + ZS_HANDLE_SIZE,
+		       first - ZS_HANDLE_SIZE);
+	else
+		memcpy(buf, addr + off, first);
+	kunmap_atomic(addr, KM_USER0);
+
+	addr = kmap_atomic(get_next_page(page), KM_USER0);
+	if (out)
+		memcpy(addr, buf + first, size - first);
+	else
+		memcpy(buf + first, addr, size - first);
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the mapping is going to be used
+ *
+ * Before using an object allocated from zs_malloc, it must be mapped using
+ * this function. When done with the object, it must be unmapped using
+ * zs_unmap_object.
+ *
+ * Only one object can be mapped per cpu at a time.  Preemption stays
+ * disabled until the object is unmapped, and compaction leaves it alone.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct page *first_page, *page;
+	unsigned long obj_idx, off;
+	unsigned int class_idx;
+	enum fullness_group fg;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	pin_handle(handle);
+	obj_to_location(handle_to_obj(handle), &first_page, &obj_idx);
+	get_zspage_mapping(first_page, &class_idx, &fg);
+	class = &pool->size_class[class_idx];
+	page = obj_page(first_page, class, obj_idx, &off);
+
+	area = &__get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if (off + class->size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->vm_addr = kmap_atomic(page, KM_USER0);
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
+	}
+
+	/* this object spans two pages */
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_object(area->vm_buf, page, off, class->size, false);
+
+	return area->vm_buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *first_page, *page;
+	unsigned long obj_idx, off;
+	unsigned int class_idx;
+	enum fullness_group fg;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER0);
+		area->vm_addr = NULL;
+	} else if (area->vm_mm != ZS_MM_RO) {
+		obj_to_location(handle_to_obj(handle), &first_page, &obj_idx);
+		get_zspage_mapping(first_page, &class_idx, &fg);
+		class = &pool->size_class[class_idx];
+		page = obj_page(first_page, class, obj_idx, &off);
+		zs_copy_object(area->vm_buf, page, off, class->size, true);
+	}
+
+	unpin_handle(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/* Copies a whole object, header included, between two zspages */
+static void zs_object_copy(struct size_class *class,
+			   struct page *d_first, unsigned long d_idx,
+			   struct page *s_first, unsigned long s_idx)
+{
+	unsigned long s_off, d_off;
+	struct page *s_page, *d_page;
+	void *s_addr, *d_addr;
+	int size = class->size;
+
+	s_page = obj_page(s_first, class, s_idx, &s_off);
+	d_page = obj_page(d_first, class, d_idx, &d_off);
+
+	while (size) {
+		int len = min3(size, (int)(PAGE_SIZE - s_off),
+			       (int)(PAGE_SIZE - d_off));
+
+		s_addr = kmap_atomic(s_page, KM_USER0);
+		d_addr = kmap_atomic(d_page, KM_USER1);
+		memcpy(d_addr + d_off, s_addr + s_off, len);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		size -= len;
+		s_off += len;
+		d_off += len;
+		if (s_off == PAGE_SIZE) {
+			s_page = get_next_page(s_page);
+			s_off = 0;
+		}
+		if (d_off == PAGE_SIZE) {
+			d_page = get_next_page(d_page);
+			d_off = 0;
+		}
+	}
+}
+
+/* The fullest zspage other than src, to move objects of src into */
+static struct page *find_target_zspage(struct size_class *class,
+					struct page *src)
+{
+	struct page *first_page;
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		list_for_each_entry(first_page, &class->fullness_list[i], lru) {
+			if (first_page != src)
+				return first_page;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Moves all objects of src that are not pinned into other zspages.
+ * Caller needs to hold class->lock.
+ */
+static void migrate_zspage(struct size_class *class, struct page *src)
+{
+	unsigned long obj_idx, new_idx, head;
+	struct page *dst;
+
+	for (obj_idx = 0; obj_idx < class->objs_per_zspage && src->inuse;
+								obj_idx++) {
+		head = obj_read_header(src, class, obj_idx);
+		if (!(head & OBJ_ALLOCATED_TAG))
+			continue;
+
+		head &= ~OBJ_ALLOCATED_TAG;
+		/* mapped or being freed, leave it */
+		if (!trypin_handle(head))
+			continue;
+
+		dst = find_target_zspage(class, src);
+		if (!dst) {
+			unpin_handle(head);
+			break;
+		}
+
+		new_idx = obj_malloc(class, dst, head);
+		zs_object_copy(class, dst, new_idx, src, obj_idx);
+		obj_free(class, src, obj_idx);
+		fix_fullness_group(class, dst);
+
+		unpin_handle(head);
+	}
+}
+
+static bool zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->zspages * class->objs_per_zspage -
+		     class->objs_inuse;
+
+	return obj_wasted >= class->objs_per_zspage;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				  struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct page *src;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		/* the sparsest zspages are on the almost empty list */
+		if (list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+			break;
+		src = list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					struct page, lru);
+
+		migrate_zspage(class, src);
+		if (fix_fullness_group(class, src) != ZS_EMPTY) {
+			/* pinned objects kept it alive, try again later */
+			break;
+		}
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+		free_zspage(src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects to free sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Objects mapped or being freed at the time are skipped.  May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += __zs_compact(pool, &pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long obj_wasted;
+
+		spin_lock(&class->lock);
+		stats->bytes_used += (u64)class->objs_inuse * class->size;
+		obj_wasted = class->zspages * class->objs_per_zspage -
+			     class->objs_inuse;
+		stats->pages_compactable += obj_wasted /
+			class->objs_per_zspage * class->pages_per_zspage;
+		spin_unlock(&class->lock);
+	}
+	stats->pages_used = atomic_long_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_pool_stats);
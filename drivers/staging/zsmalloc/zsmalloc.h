@@ -0,0 +1,53 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/*
+ * zsmalloc mapping modes
+ *
+ * NOTE: These only make a difference when a mapped object spans pages.
+ */
+enum zs_mapmode {
+	ZS_MM_RW, /* normal read-write mapping */
+	ZS_MM_RO, /* read-only (no copy-out at unmap time) */
+	ZS_MM_WO /* write-only (no copy-in at map time) */
+};
+
+struct zs_pool_stats {
+	unsigned long pages_used;	/* pages backing the pool */
+	u64 bytes_used;			/* held by allocated objects */
+	unsigned long pages_compactable; /* zs_compact() could free these */
+	unsigned long pages_compacted;	/* freed by zs_compact() so far */
+};
+
+struct zs_pool;
+
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * This must be power of 2 and greater than or equal to ZS_HANDLE_SIZE.
+ * Since object sizes are multiples of it, the header word at the start of
+ * an object never spans two pages.
+ */
+#define ZS_ALIGN		8
+
+/*
+ * A single 'zspage' is composed of up to 2^N discontiguous 0-order (single)
+ * pages. ZS_MAX_ZSPAGE_ORDER defines upper limit on N.
+ */
+#define ZS_MAX_ZSPAGE_ORDER 2
+#define ZS_MAX_PAGES_PER_ZSPAGE (_AC(1, UL) << ZS_MAX_ZSPAGE_ORDER)
+
+/*
+ * Every object starts with a header word.  An allocated object keeps the
+ * address of its handle there, tagged with OBJ_ALLOCATED_TAG, so that
+ * compaction can find and update the handle when it moves the object.  A
+ * free object keeps the index of the next free object in its zspage.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+#define OBJ_ALLOCATED_TAG	1
+#define OBJ_TAG_BITS		1
+
+/*
+ * Handles point to a word holding the object location, shifted left by
+ * OBJ_TAG_BITS.  Bit HANDLE_PIN_BIT of that word is a bit spinlock taken
+ * while the object is mapped or freed, and tried by compaction before it
+ * moves the object.
+ *
+ * The location is the pfn of the first page of the object's zspage and the
+ * object index within that zspage.
+ */
+#define HANDLE_PIN_BIT		0
+
+#ifndef MAX_PHYSMEM_BITS
+#ifdef CONFIG_HIGHMEM64G
+#define MAX_PHYSMEM_BITS 36
+#else /* !CONFIG_HIGHMEM64G */
+/*
+ * If this definition of MAX_PHYSMEM_BITS is used, OBJ_INDEX_BITS will just
+ * be PAGE_SHIFT - OBJ_TAG_BITS
+ */
+#define MAX_PHYSMEM_BITS BITS_PER_LONG
+#endif
+#endif
+#define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
+#define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
+
+/* Terminates the free object list of a zspage */
+#define OBJ_INDEX_END	OBJ_INDEX_MASK
+
+/*
+ * Object sizes, including the header.  A zspage must not hold more than
+ * OBJ_INDEX_END objects, which ZS_MIN_ALLOC_SIZE guarantees on all the
+ * configurations above (checked in zs_init_size_classes()).
+ */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * On systems with 4K page size, this gives 255 size classes.  There is a
+ * trade-off here:
+ *  - Large number of size classes is potentially wasteful as free pages
+ *    are spread across these classes
+ *  - Small number of size classes causes large internal fragmentation
+ *
+ * ZS_MIN_ALLOC_SIZE and ZS_SIZE_CLASS_DELTA must be multiple of ZS_ALIGN
+ * (reason above)
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * We do not maintain any list for completely empty or full pages
+ */
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	ZS_EMPTY,
+	ZS_FULL
+};
+
+/* The fullness group is kept next to the class index in first_page->objects */
+#define FULLNESS_BITS	4
+#define FULLNESS_MASK	((1 << FULLNESS_BITS) - 1)
+
+/*
+ * We assign a page to ZS_ALMOST_EMPTY fullness group when:
+ *	n <= 3N / f, where
+ * n = number of allocated objects
+ * N = total number of objects zspage can store
+ * f = fullness_threshold_frac
+ *
+ * Similarly, we assign zspage to:
+ *	ZS_ALMOST_FULL	when n > 3N / f
+ *	ZS_EMPTY	when n == 0
+ *	ZS_FULL		when n == N
+ *
+ * (see: get_fullness_group())
+ */
+static const int fullness_threshold_frac = 4;
+
+struct size_class {
+	/*
+	 * Size of objects stored in this class. Must be multiple
+	 * of ZS_ALIGN.
+	 */
+	int size;
+	unsigned int index;
+
+	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
+	int pages_per_zspage;
+	int objs_per_zspage;
+
+	spinlock_t lock;
+
+	/* stats, protected by lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	struct kmem_cache *handle_cachep;
+	gfp_t flags;	/* allocation flags used when growing pool */
+	const char *name;
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+/*
+ * Objects that span two pages are copied through this buffer while they
+ * are mapped.
+ */
+struct mapping_area {
+	char *vm_buf;		/* copy buffer for objects spanning pages */
+	char *vm_addr;		/* address of kmap_atomic()'ed pages */
+	enum zs_mapmode vm_mm;	/* mapping mode */
+};
+
+#endif
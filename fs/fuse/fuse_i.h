@@ -23,9 +23,16 @@
 #include <linux/poll.h>
 #include <linux/workqueue.h>
 
-/** Max number of pages that can be used in a single read request */
+/** Default max number of pages that can be used in a single request,
+    also the number of page slots embedded in struct fuse_req */
 #define FUSE_MAX_PAGES_PER_REQ 32
 
+/** Upper limit for the max number of pages negotiated in INIT */
+#define FUSE_MAX_MAX_PAGES 256
+
+/** Magic number of fuse superblocks */
+#define FUSE_SUPER_MAGIC 0x65735546
+
 /** Bias for fi->writectr, meaning new writepages must not be sent */
 #define FUSE_NOWRITE INT_MIN
 
@@ -137,6 +144,9 @@ struct fuse_file {
 
 	/** Wait queue head for poll */
 	wait_queue_head_t poll_wait;
+
+	/** Lower file serving read, write and mmap (FOPEN_PASSTHROUGH) */
+	struct file *passthrough_filp;
 };
 
 /** One input argument of a request */
@@ -287,7 +297,13 @@ struct fuse_req {
 	} misc;
 
 	/** page vector */
-	struct page *pages[FUSE_MAX_PAGES_PER_REQ];
+	struct page **pages;
+
+	/** size of the page vector */
+	unsigned max_pages;
+
+	/** inline page vector, used unless more pages were requested */
+	struct page *inline_pages[FUSE_MAX_PAGES_PER_REQ];
 
 	/** number of pages in vector */
 	unsigned num_pages;
@@ -309,6 +325,9 @@ struct fuse_req {
 
 	/** Request is stolen from fuse_file->reserved_req */
 	struct file *stolen_file;
+
+	/** Lower file passed in an OPEN or CREATE reply */
+	struct file *passthrough_filp;
 };
 
 /**
@@ -343,6 +362,9 @@ struct fuse_conn {
 	/** Maximum write size */
 	unsigned max_write;
 
+	/** Maximum number of pages that can be used in a single request */
+	unsigned max_pages;
+
 	/** Readers of the connection are waiting on this */
 	wait_queue_head_t waitq[2];
 
@@ -474,6 +496,16 @@ struct fuse_conn {
 	/** Don't apply umask to creation modes */
 	unsigned dont_mask:1;
 
+	/** Files may be opened in passthrough mode.  Only set in INIT */
+	unsigned passthrough:1;
+
+	/** Mounted with CAP_SYS_ADMIN, so INIT may enable passthrough */
+	unsigned passthrough_allowed:1;
+
+	/** Buffered writes go through the page cache and writeback.
+	    Only set in INIT */
+	unsigned writeback_cache:1;
+
 	/** The number of requests waiting for completion */
 	atomic_t num_waiting;
 
@@ -642,11 +674,11 @@ int fuse_ctl_init(void);
 void fuse_ctl_cleanup(void);
 
 /**
- * Allocate a request
+ * Allocate a request with room for at least npages pages
  */
-struct fuse_req *fuse_request_alloc(void);
+struct fuse_req *fuse_request_alloc(unsigned npages);
 
-struct fuse_req *fuse_request_alloc_nofs(void);
+struct fuse_req *fuse_request_alloc_nofs(unsigned npages);
 
 /**
  * Free a request
@@ -658,6 +690,11 @@ void fuse_request_free(struct fuse_req *req);
  */
 struct fuse_req *fuse_get_req(struct fuse_conn *fc);
 
+/**
+ * Get a request with room for at least npages pages, may fail with -ENOMEM
+ */
+struct fuse_req *fuse_get_req_pages(struct fuse_conn *fc, unsigned npages);
+
 /**
  * Gets a requests for a file operation, always succeeds
  */
@@ -765,4 +802,14 @@ int fuse_dev_release(struct inode *inode, struct file *file);
 
 void fuse_write_update_size(struct inode *inode, loff_t pos);
 
+/* passthrough.c */
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_req *req);
+bool fuse_passthrough_open(struct file *file);
+void fuse_passthrough_release(struct fuse_file *ff);
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos);
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos);
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma);
+
 #endif /* _FS_FUSE_I_H */
@@ -47,8 +47,6 @@ MODULE_PARM_DESC(max_user_congthresh,
  "Global limit for the maximum congestion threshold an "
  "unprivileged user can set");
 
-#define FUSE_SUPER_MAGIC 0x65735546
-
 #define FUSE_DEFAULT_BLKSIZE 512
 
 /** Maximum number of outstanding background requests */
@@ -192,11 +190,19 @@ void fuse_change_attributes(struct inode *inode, struct fuse_attr *attr,
 
 	fuse_change_attributes_common(inode, attr, attr_valid);
 
+	/*
+	 * With the writeback cache, writes beyond EOF extend i_size
+	 * before the data reaches userspace, so the size reported by the
+	 * filesystem may be stale.  The kernel's idea of the size is
+	 * authoritative for regular files in that mode.
+	 */
 	oldsize = inode->i_size;
-	i_size_write(inode, attr->size);
+	if (!fc->writeback_cache || !S_ISREG(inode->i_mode))
+		i_size_write(inode, attr->size);
 	spin_unlock(&fc->lock);
 
-	if (S_ISREG(inode->i_mode) && oldsize != attr->size) {
+	if (!fc->writeback_cache && S_ISREG(inode->i_mode) &&
+	    oldsize != attr->size) {
 		truncate_pagecache(inode, oldsize, attr->size);
 		invalidate_inode_pages2(inode->i_mapping);
 	}
@@ -546,6 +552,7 @@ void fuse_conn_init(struct fuse_conn *fc)
 	atomic_set(&fc->num_waiting, 0);
 	fc->max_background = FUSE_DEFAULT_MAX_BACKGROUND;
 	fc->congestion_threshold = FUSE_DEFAULT_CONGESTION_THRESHOLD;
+	fc->max_pages = FUSE_MAX_PAGES_PER_REQ;
 	fc->khctr = 0;
 	fc->polled_files = RB_ROOT;
 	fc->reqctr = 0;
@@ -830,6 +837,20 @@ static void process_init_reply(struct fuse_conn *fc, struct fuse_req *req)
 				fc->big_writes = 1;
 			if (arg->flags & FUSE_DONT_MASK)
 				fc->dont_mask = 1;
+			if (arg->flags & FUSE_WRITEBACK_CACHE)
+				fc->writeback_cache = 1;
+			if ((arg->flags & FUSE_PASSTHROUGH) &&
+			    fc->passthrough_allowed)
+				fc->passthrough = 1;
+			/*
+			 * A short (7.16) reply leaves max_pages zeroed even
+			 * if the daemon echoed the flag, keep the default.
+			 */
+			if ((arg->flags & FUSE_MAX_PAGES) && arg->max_pages) {
+				fc->max_pages = min_t(unsigned,
+						      FUSE_MAX_MAX_PAGES,
+						      arg->max_pages);
+			}
 		} else {
 			ra_pages = fc->max_read / PAGE_CACHE_SIZE;
 			fc->no_lock = 1;
@@ -853,7 +874,8 @@ static void fuse_send_init(struct fuse_conn *fc, struct fuse_req *req)
 	arg->minor = FUSE_KERNEL_MINOR_VERSION;
 	arg->max_readahead = fc->bdi.ra_pages * PAGE_CACHE_SIZE;
 	arg->flags |= FUSE_ASYNC_READ | FUSE_POSIX_LOCKS | FUSE_ATOMIC_O_TRUNC |
-		FUSE_EXPORT_SUPPORT | FUSE_BIG_WRITES | FUSE_DONT_MASK;
+		FUSE_EXPORT_SUPPORT | FUSE_BIG_WRITES | FUSE_DONT_MASK |
+		FUSE_WRITEBACK_CACHE | FUSE_MAX_PAGES | FUSE_PASSTHROUGH;
 	req->in.h.opcode = FUSE_INIT;
 	req->in.numargs = 1;
 	req->in.args[0].size = sizeof(*arg);
@@ -985,6 +1007,12 @@ static int fuse_fill_super(struct super_block *sb, void *data, int silent)
 	fc->user_id = d.user_id;
 	fc->group_id = d.group_id;
 	fc->max_read = max_t(unsigned, 4096, d.max_read);
+	/*
+	 * Passthrough hands the daemon's open files to other users, so only
+	 * allow it for privileged mounts.  Checked here rather than at INIT
+	 * since daemons usually drop privileges after mounting.
+	 */
+	fc->passthrough_allowed = capable(CAP_SYS_ADMIN);
 
 	/* Used by get_root_inode() */
 	sb->s_fs_info = fc;
@@ -1002,12 +1030,12 @@ static int fuse_fill_super(struct super_block *sb, void *data, int silent)
 	/* only now - we want root dentry with NULL ->d_op */
 	sb->s_d_op = &fuse_dentry_operations;
 
-	init_req = fuse_request_alloc();
+	init_req = fuse_request_alloc(0);
 	if (!init_req)
 		goto err_put_root;
 
 	if (is_bdev) {
-		fc->destroy_req = fuse_request_alloc();
+		fc->destroy_req = fuse_request_alloc(0);
 		if (!fc->destroy_req)
 			goto err_free_init_req;
 	}
@@ -0,0 +1,200 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "fuse_i.h"
+
+#include <linux/aio.h>
+#include <linux/file.h>
+#include <linux/fsnotify.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+
+/*
+ * Passthrough mode
+ *
+ * A filesystem that only relays reads and writes to files of a lower
+ * filesystem can reply to OPEN or CREATE with FOPEN_PASSTHROUGH and the
+ * descriptor of the lower file.  Read, write and mmap on such an open
+ * file are then done directly on the lower file, while open, release,
+ * flush, fsync, locking and attributes still go to userspace.
+ */
+
+/*
+ * Called on the reply to OPEN and CREATE, in the context of the daemon
+ * writing the reply, which is the only place its descriptor can be
+ * looked up.
+ */
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_req *req)
+{
+	struct fuse_open_out *outarg;
+	struct file *lower;
+	struct inode *lower_inode;
+
+	if (!fc->passthrough)
+		return;
+
+	if (req->in.h.opcode != FUSE_OPEN && req->in.h.opcode != FUSE_CREATE)
+		return;
+
+	outarg = req->out.args[req->out.numargs - 1].value;
+	if (!(outarg->open_flags & FOPEN_PASSTHROUGH))
+		return;
+
+	lower = fget(outarg->passthrough_fd);
+	if (!lower)
+		return;
+
+	lower_inode = lower->f_path.dentry->d_inode;
+	if (!S_ISREG(lower_inode->i_mode) ||
+	    lower_inode->i_sb->s_magic == FUSE_SUPER_MAGIC ||
+	    !lower->f_op || !lower->f_op->aio_read || !lower->f_op->aio_write) {
+		fput(lower);
+		return;
+	}
+
+	req->passthrough_filp = lower;
+}
+
+/*
+ * Called when the file is opened.  Drop the lower file unless it can
+ * stand in for the fuse file, in which case the open file switches to
+ * passthrough file operations.
+ */
+bool fuse_passthrough_open(struct file *file)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *lower = ff->passthrough_filp;
+
+	if (!lower)
+		return false;
+
+	if (((file->f_mode & FMODE_READ) && !(lower->f_mode & FMODE_READ)) ||
+	    ((file->f_mode & FMODE_WRITE) && !(lower->f_mode & FMODE_WRITE)) ||
+	    ((file->f_flags & O_APPEND) && !(lower->f_flags & O_APPEND)) ||
+	    ((file->f_flags & O_DIRECT) && !(lower->f_flags & O_DIRECT))) {
+		ff->passthrough_filp = NULL;
+		fput(lower);
+		return false;
+	}
+
+	return true;
+}
+
+void fuse_passthrough_release(struct fuse_file *ff)
+{
+	if (ff->passthrough_filp) {
+		fput(ff->passthrough_filp);
+		ff->passthrough_filp = NULL;
+	}
+}
+
+static ssize_t fuse_passthrough_rw(struct file *lower, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t *ppos,
+				   int write)
+{
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	/* The lower file's locks and LSM hooks apply as for any I/O on it. */
+	ret = rw_verify_area(write ? WRITE : READ, lower, ppos,
+			     iov_length(iov, nr_segs));
+	if (ret < 0)
+		return ret;
+
+	init_sync_kiocb(&kiocb, lower);
+	kiocb.ki_pos = *ppos;
+	kiocb.ki_left = iov_length(iov, nr_segs);
+	kiocb.ki_nbytes = kiocb.ki_left;
+
+	if (write)
+		ret = lower->f_op->aio_write(&kiocb, iov, nr_segs, kiocb.ki_pos);
+	else
+		ret = lower->f_op->aio_read(&kiocb, iov, nr_segs, kiocb.ki_pos);
+	if (ret == -EIOCBQUEUED)
+		ret = wait_on_sync_kiocb(&kiocb);
+
+	if (ret > 0)
+		*ppos = kiocb.ki_pos;
+
+	return ret;
+}
+
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+	struct fuse_file *ff = iocb->ki_filp->private_data;
+	struct file *lower = ff->passthrough_filp;
+	ssize_t ret;
+
+	ret = fuse_passthrough_rw(lower, iov, nr_segs, &pos, 0);
+	if (ret > 0) {
+		iocb->ki_pos = pos;
+		fsnotify_access(lower);
+	}
+
+	return ret;
+}
+
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct fuse_file *ff = file->private_data;
+	struct file *lower = ff->passthrough_filp;
+	ssize_t ret;
+
+	ret = fuse_passthrough_rw(lower, iov, nr_segs, &pos, 1);
+	if (ret > 0) {
+		ssize_t err;
+
+		iocb->ki_pos = pos;
+		fuse_write_update_size(inode, pos);
+		fsnotify_modify(lower);
+
+		/*
+		 * The lower write only honours the daemon's open flags, so
+		 * sync here for O_SYNC and O_DSYNC opens of the fuse file.
+		 */
+		if (file->f_flags & O_DSYNC) {
+			err = vfs_fsync_range(lower, pos - ret, pos - 1,
+					      (file->f_flags & __O_SYNC) ? 0 : 1);
+			if (err < 0)
+				ret = err;
+		}
+	}
+	fuse_invalidate_attr(inode);
+
+	return ret;
+}
+
+/*
+ * Map the lower file in place of the fuse file, so that faults and
+ * writeback are handled by the lower filesystem.
+ */
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *lower = ff->passthrough_filp;
+	int err;
+
+	if (!lower->f_op->mmap)
+		return -ENODEV;
+
+	vma->vm_file = lower;
+	err = lower->f_op->mmap(lower, vma);
+	if (err) {
+		vma->vm_file = file;
+		return err;
+	}
+
+	file_accessed(file);
+	get_file(lower);
+	fput(file);
+
+	return 0;
+}
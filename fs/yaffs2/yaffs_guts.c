@@ -1394,73 +1394,107 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks in use are hashed by object and chunk id, kept on an
+ *   LRU list and on their object's cache_list, so lookups, picking a victim
+ *   and flushing or invalidating one object do not depend on the number of
+ *   caches. Unused ones are kept on a free list.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_hash[(obj->obj_id * 31 + chunk_id) &
+				dev->cache_hash_mask];
+}
+
+/* Attach an unused cache chunk to an object's chunk */
+static void yaffs_cache_attach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+	list_add(&cache->obj_link, &obj->cache_list);
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+}
+
+/* Give a cache chunk back to the free list, dropping its contents */
+static void yaffs_cache_detach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache)
+{
+	cache->object = NULL;
+	cache->dirty = 0;
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->obj_link);
+	list_move(&cache->lru_link, &dev->cache_free);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
-			return 1;
+	if (dev->param.n_caches > 0) {
+		list_for_each_entry(cache, &obj->cache_list, obj_link) {
+			if (cache->dirty)
+				return 1;
+		}
 	}
 
 	return 0;
 }
 
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
+/* Write out the object's dirty cache chunks, lowest chunk id first */
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
-
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+	int chunk_written = 1;
+	int n = 0;
+	int i;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->param.n_caches <= 0)
+		return;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	list_for_each_entry(cache, &obj->cache_list, obj_link) {
+		if (cache->dirty && !cache->locked)
+			dev->cache_flush[n++] = cache;
+	}
 
-		} while (cache && chunk_written > 0);
+	sort(dev->cache_flush, n, sizeof(struct yaffs_cache *),
+	     yaffs_cache_cmp, NULL);
 
-		if (cache)
-			/* Hoosterman, disk full while writing cache out. */
-			yaffs_trace(YAFFS_TRACE_ERROR,
-				"yaffs tragedy: no space during cache write");
+	for (i = 0; i < n && chunk_written > 0; i++) {
+		cache = dev->cache_flush[i];
+		if (cache->object != obj || !cache->dirty)
+			continue;
 
+		/* Write it out and free it up */
+		chunk_written =
+		    yaffs_wr_data_obj(cache->object,
+				      cache->chunk_id,
+				      cache->data,
+				      cache->n_bytes, 1);
+		if (chunk_written > 0)
+			yaffs_cache_detach(dev, cache);
 	}
 
+	if (chunk_written <= 0)
+		/* Hoosterman, disk full while writing cache out. */
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs tragedy: no space during cache write");
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1470,115 +1504,93 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
+	struct yaffs_cache *cache;
 	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+
+	if (dev->param.n_caches <= 0)
+		return;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
+		list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+			if (cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
 		if (obj)
 			yaffs_flush_file_cache(obj);
 
-	} while (obj);
+		/* Give up if the object could not be flushed completely */
+	} while (obj && !yaffs_obj_cache_dirty(obj));
 
 }
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used unlocked one, flushing its object first
+ * if it is dirty.
+ * The chunk returned is unused, attach it with yaffs_cache_attach().
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	if (dev->param.n_caches <= 0)
+		return NULL;
+
+	if (list_empty(&dev->cache_free)) {
+		list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+			if (cache->locked)
+				continue;
+
+			if (cache->dirty)
+				yaffs_flush_file_cache(cache->object);
+			else
+				yaffs_cache_detach(dev, cache);
+			break;
 		}
 	}
 
-	return NULL;
+	if (list_empty(&dev->cache_free))
+		return NULL;
+
+	return list_first_entry(&dev->cache_free, struct yaffs_cache,
+				lru_link);
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Look up a cached chunk without updating any cache state */
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
 {
+	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
-
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id)
+				return cache;
 		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	}
+	return NULL;
 }
 
 /* Find a cached chunk */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache = yaffs_lookup_chunk_cache(obj, chunk_id);
 
-				return &dev->cache[i];
-			}
-		}
-	}
-	return NULL;
+	if (cache)
+		obj->my_dev->cache_hits++;
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -1587,18 +1599,7 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move_tail(&cache->lru_link, &dev->cache_lru);
 
 		if (is_write)
 			cache->dirty = 1;
@@ -1616,7 +1617,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_detach(object->my_dev, cache);
 	}
 }
 
@@ -1625,15 +1626,14 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache, *next;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
+		list_for_each_entry_safe(cache, next, &in->cache_list,
+					 obj_link)
+			yaffs_cache_detach(dev, cache);
 	}
 }
 
@@ -1856,6 +1856,7 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		obj->variant_type = YAFFS_OBJECT_TYPE_UNKNOWN;
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
+		INIT_LIST_HEAD(&obj->cache_list);
 		INIT_LIST_HEAD(&obj->siblings);
 
 		/* Now make the directory sane */
@@ -2958,7 +2959,11 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				"yaffs: GC n_erased_blocks %d aggressive %d",
 				dev->n_erased_blocks, aggressive);
 
-			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			/* Background gc always collects a few chunks at a time
+			 * so that the caller can drop its lock in between.
+			 */
+			gc_ok = yaffs_gc_block(dev, dev->gc_block,
+					       aggressive && !background);
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks)
@@ -2977,6 +2982,8 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 /*
  * yaffs_bg_gc()
  * Garbage collects. Intended to be called from a background thread.
+ * Only a few chunks are copied per call; dev->gc_block stays set while
+ * a block is partly collected.
  * Returns non-zero if at least half the free chunks are erased.
  */
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
@@ -3568,28 +3575,24 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 		cache = yaffs_find_chunk_cache(in, chunk);
 
+		/* If we can't find the data in the cache, then load it up. */
+		if (!cache && (n_copy != dev->data_bytes_per_chunk
+			       || dev->param.inband_tags)) {
+			cache = yaffs_grab_chunk_cache(in->my_dev);
+			if (cache) {
+				yaffs_cache_attach(dev, cache, in, chunk);
+				yaffs_rd_data_obj(in, chunk, cache->data);
+				cache->n_bytes = 0;
+			}
+		}
+
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
 		 * else bypass the cache.
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk
 		    || dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
-
-				/* If we can't find the data in the cache, then load it up. */
-
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
-					cache->n_bytes = 0;
-				}
-
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3627,6 +3630,47 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * yaffs_file_rd_cached() is a read-only variant of yaffs_file_rd() that
+ * only copies out chunks already held in the short op cache, straight
+ * into the caller's buffer.  It never touches flash or the per-device
+ * temp buffers and does not load, evict or reorder caches, so several
+ * readers may run it at once under the shared gross lock.
+ * Returns n_bytes if the whole range was in the cache, else 0.
+ */
+int yaffs_file_rd_cached(struct yaffs_obj *in, u8 * buffer, loff_t offset,
+			 int n_bytes)
+{
+	int chunk;
+	u32 start;
+	int n_copy;
+	int n = n_bytes;
+	struct yaffs_cache *cache;
+	struct yaffs_dev *dev = in->my_dev;
+
+	while (n > 0) {
+		yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if ((start + n) < dev->data_bytes_per_chunk)
+			n_copy = n;
+		else
+			n_copy = dev->data_bytes_per_chunk - start;
+
+		cache = yaffs_lookup_chunk_cache(in, chunk);
+		if (!cache)
+			return 0;
+
+		memcpy(buffer, &cache->data[start], n_copy);
+
+		n -= n_copy;
+		offset += n_copy;
+		buffer += n_copy;
+	}
+
+	return n_bytes;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 		     int n_bytes, int write_trhrough)
 {
@@ -3707,12 +3751,12 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					if (cache) {
+						yaffs_cache_attach(dev, cache,
+								   in, chunk);
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+					}
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -4941,8 +4985,12 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
+		int n_buckets;
 		void *buf;
 		int cache_bytes =
 		    dev->param.n_caches * sizeof(struct yaffs_cache);
@@ -4957,17 +5005,35 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		/* About one cache chunk per hash bucket */
+		for (n_buckets = 1; n_buckets < dev->param.n_caches;)
+			n_buckets <<= 1;
+		dev->cache_hash_mask = n_buckets - 1;
+		dev->cache_hash =
+		    kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
+		dev->cache_flush =
+		    kmalloc(dev->param.n_caches * sizeof(struct yaffs_cache *),
+			    GFP_NOFS);
+		if (!dev->cache_hash || !dev->cache_flush)
+			buf = NULL;
+
+		for (i = 0; i < n_buckets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
+		INIT_LIST_HEAD(&dev->cache_lru);
+		INIT_LIST_HEAD(&dev->cache_free);
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].obj_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
@@ -5088,6 +5154,11 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			dev->cache = NULL;
 		}
 
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
+		kfree(dev->cache_flush);
+		dev->cache_flush = NULL;
+
 		kfree(dev->gc_cleanup_list);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
@@ -83,7 +83,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -108,9 +108,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash if object is set */
+	struct list_head lru_link;	/* In dev->cache_lru, else cache_free */
+	struct list_head obj_link;	/* In object->cache_list if object is set */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -408,6 +410,8 @@ struct yaffs_obj {
 
 	struct list_head hard_links;	/* all the equivalent hard linked objects */
 
+	struct list_head cache_list;	/* my chunks in the short op cache */
+
 	/* directory structure stuff */
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
@@ -506,8 +510,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES. Each holds a chunk.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -543,6 +547,13 @@ struct yaffs_param {
 	int (*read_chunk_tags_fn) (struct yaffs_dev * dev,
 				   int nand_chunk, u8 * data,
 				   struct yaffs_ext_tags * tags);
+	/* Optional. Reads just the tags of n_chunks consecutive chunks.
+	 * Used by the scan from a worker while the scan carries on, so it
+	 * must not use shared buffers or update device statistics.
+	 */
+	int (*read_tags_batch_fn) (struct yaffs_dev * dev,
+				   int nand_chunk, int n_chunks,
+				   struct yaffs_ext_tags * tags);
 	int (*bad_block_fn) (struct yaffs_dev * dev, int block_no);
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
@@ -685,7 +696,11 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Buckets keyed by object and chunk */
+	int cache_hash_mask;
+	struct list_head cache_lru;	/* In use, least recently used first */
+	struct list_head cache_free;
+	struct yaffs_cache **cache_flush;	/* Scratch for sorting a flush */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -801,6 +816,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_cached(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
+			 int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -18,13 +18,27 @@
 
 #include "yportenv.h"
 
+/* Hold and wait times of the gross lock, in nanoseconds */
+struct yaffs_lock_stats {
+	u64 wr_taken_at;	/* When the current writer got the lock */
+	u32 wr_locks;
+	u32 wr_contended;	/* Writer had to wait for the lock */
+	u64 wr_wait_ns;
+	u64 wr_hold_ns;
+	u64 wr_hold_max_ns;
+	atomic_t rd_locks;
+	atomic_t rd_misses;	/* Shared reads that fell back to a writer */
+};
+
 struct yaffs_linux_context {
 	struct list_head context_list;	/* List of these we have mounted */
 	struct yaffs_dev *dev;
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	unsigned long dirtied_at;	/* jiffies of the last change */
+	struct rw_semaphore gross_lock;	/* Gross locking semaphore */
+	struct yaffs_lock_stats lock_stats;
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
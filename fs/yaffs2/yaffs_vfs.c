@@ -98,12 +98,23 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 
+/*
+ * Seconds of idle time after the last write before the background thread
+ * writes a checkpoint, 0 to only checkpoint on sync and unmount.  A
+ * checkpoint saves a full scan on the next mount after a crash, but each
+ * one programs and later erases several blocks, so short intervals wear
+ * the NAND on devices that write a little now and then.  The default
+ * writes at most one every five minutes.
+ */
+unsigned int yaffs_bg_checkpoint = 300;
+
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_checkpoint, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -121,17 +132,56 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
+/*
+ * The gross lock is a reader/writer semaphore. Anything that may modify
+ * the device, including reads that go to flash or load the short op
+ * cache, takes it for writing. Lookups that only look at in-memory state
+ * take it shared through yaffs_gross_lock_rd().
+ */
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct yaffs_lock_stats *ls = &lc->lock_stats;
+	u64 t;
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	if (!down_write_trylock(&lc->gross_lock)) {
+		t = local_clock();
+		down_write(&lc->gross_lock);
+		ls->wr_contended++;
+		ls->wr_wait_ns += local_clock() - t;
+	}
+	ls->wr_locks++;
+	ls->wr_taken_at = local_clock();
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct yaffs_lock_stats *ls = &lc->lock_stats;
+	u64 held = local_clock() - ls->wr_taken_at;
+
+	ls->wr_hold_ns += held;
+	if (held > ls->wr_hold_max_ns)
+		ls->wr_hold_max_ns = held;
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&lc->gross_lock);
+}
+
+static void yaffs_gross_lock_rd(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs read locking %p", current);
+	down_read(&lc->gross_lock);
+	atomic_inc(&lc->lock_stats.rd_locks);
+}
+
+static void yaffs_gross_unlock_rd(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs read unlocking %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -1021,11 +1071,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_rd(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_rd(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1041,10 +1091,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_rd(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_rd(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1121,6 +1171,7 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 	struct super_block *sb = yaffs_dev_to_lc(dev)->super;
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_touch_super() sb = %p", sb);
+	yaffs_dev_to_lc(dev)->dirtied_at = jiffies;
 	if (sb)
 		sb->s_dirt = 1;
 }
@@ -1149,12 +1200,29 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	/* Serve the page from the short op cache under the shared lock if
+	 * every chunk is there.  The copy goes straight into this reader's
+	 * page, so no per-device scratch buffer is needed.  Reads that go to
+	 * flash use those buffers and may retire blocks on ECC errors, so
+	 * only they take the lock exclusively.
+	 */
+	yaffs_gross_lock_rd(dev);
+	ret = yaffs_file_rd_cached(obj, pg_buf,
+				   pg->index << PAGE_CACHE_SHIFT,
+				   PAGE_CACHE_SIZE);
+	yaffs_gross_unlock_rd(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	if (ret != PAGE_CACHE_SIZE) {
+		atomic_inc(&yaffs_dev_to_lc(dev)->lock_stats.rd_misses);
 
-	yaffs_gross_unlock(dev);
+		yaffs_gross_lock(dev);
+
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
+
+		yaffs_gross_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1462,7 +1530,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_rd(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1514,7 +1582,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_rd(dev);
 	return 0;
 }
 
@@ -1654,6 +1722,25 @@ static int yaffs_bg_thread_fn(void *data)
 			if (!dev->is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
 				gc_result = yaffs_bg_gc(dev, urgency);
+
+				/* Finish off the block being collected a few
+				 * chunks at a time, letting others in between.
+				 */
+				while (dev->gc_block > 0 && urgency > 0 &&
+				       context->bg_running &&
+				       !kthread_should_stop()) {
+					int gc_chunk = dev->gc_chunk;
+
+					yaffs_gross_unlock(dev);
+					cond_resched();
+					yaffs_gross_lock(dev);
+					if (dev->is_checkpointed)
+						break;
+					gc_result = yaffs_bg_gc(dev, urgency);
+					if (dev->gc_chunk == gc_chunk)
+						break;	/* No progress */
+				}
+
 				if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
@@ -1669,6 +1756,16 @@ static int yaffs_bg_thread_fn(void *data)
                         }
 		}
 		yaffs_gross_unlock(dev);
+
+		/* Once writes have stopped for a while, save a checkpoint so
+		 * that a crash does not need a full scan on the next mount.
+		 */
+		if (yaffs_bg_checkpoint && yaffs_bg_enable &&
+		    yaffs_auto_checkpoint && !dev->is_checkpointed &&
+		    time_after(now, context->dirtied_at +
+			       yaffs_bg_checkpoint * HZ))
+			yaffs_do_sync_fs(context->super, 1);
+
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
@@ -1698,6 +1795,7 @@ static int yaffs_bg_start(struct yaffs_dev *dev)
 		return -1;
 
 	context->bg_running = 1;
+	context->dirtied_at = jiffies;
 
 	context->bg_thread = kthread_run(yaffs_bg_thread_fn,
 					 (void *)dev, "yaffs-bg-%d",
@@ -1758,6 +1856,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -1813,6 +1912,9 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache=", 6)) {
+			options->n_caches =
+			    simple_strtoul(cur_opt + 6, NULL, 10);
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2216,6 +2318,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
 	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (!options.no_cache && options.n_caches > 0)
+		param->n_caches = options.n_caches;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2262,6 +2366,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
+		if (!param->inband_tags)
+			param->read_tags_batch_fn = nandmtd2_read_tags_batch;
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
@@ -2320,7 +2426,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -2496,6 +2602,33 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	return buf;
 }
 
+static char *yaffs_dump_dev_part2(char *buf, struct yaffs_dev *dev)
+{
+	struct yaffs_lock_stats *ls = &yaffs_dev_to_lc(dev)->lock_stats;
+	u64 hold_avg = ls->wr_hold_ns;
+
+	if (ls->wr_locks)
+		do_div(hold_avg, ls->wr_locks);
+
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "lock_wr_count......... %u\n", ls->wr_locks);
+	buf += sprintf(buf, "lock_wr_contended..... %u\n", ls->wr_contended);
+	buf += sprintf(buf, "lock_wr_wait_ns....... %llu\n",
+			(unsigned long long)ls->wr_wait_ns);
+	buf += sprintf(buf, "lock_wr_hold_ns....... %llu\n",
+			(unsigned long long)ls->wr_hold_ns);
+	buf += sprintf(buf, "lock_wr_hold_avg_ns... %llu\n",
+			(unsigned long long)hold_avg);
+	buf += sprintf(buf, "lock_wr_hold_max_ns... %llu\n",
+			(unsigned long long)ls->wr_hold_max_ns);
+	buf += sprintf(buf, "lock_rd_count......... %d\n",
+			atomic_read(&ls->rd_locks));
+	buf += sprintf(buf, "lock_rd_misses........ %d\n",
+			atomic_read(&ls->rd_misses));
+
+	return buf;
+}
+
 static int yaffs_proc_read(char *page,
 			   char **start,
 			   off_t offset, int count, int *eof, void *data)
@@ -2541,6 +2674,7 @@ static int yaffs_proc_read(char *page,
 				buf = yaffs_dump_dev_part0(buf, dev);
 			} else {
 				buf = yaffs_dump_dev_part1(buf, dev);
+				buf = yaffs_dump_dev_part2(buf, dev);
                         }
 
 			break;
@@ -954,6 +954,113 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Scan read-ahead.
+ * When the device can read a block's worth of tags in one go, the tags of
+ * the next block to be scanned are read by a worker while the current
+ * block's chunks are being put into files.
+ */
+struct yaffs_scan_ahead {
+	struct work_struct work;
+	struct completion done;
+	struct yaffs_dev *dev;
+	int block;
+	int result;
+	int pending;
+	struct yaffs_ext_tags *tags;
+};
+
+static void yaffs2_scan_ahead_worker(struct work_struct *work)
+{
+	struct yaffs_scan_ahead *sa =
+	    container_of(work, struct yaffs_scan_ahead, work);
+	struct yaffs_dev *dev = sa->dev;
+
+	sa->result = dev->param.read_tags_batch_fn(dev,
+				sa->block * dev->param.chunks_per_block -
+				dev->chunk_offset,
+				dev->param.chunks_per_block, sa->tags);
+	complete(&sa->done);
+}
+
+static void yaffs2_scan_ahead_start(struct yaffs_scan_ahead *sa, int block)
+{
+	sa->block = block;
+	sa->pending = 1;
+	INIT_COMPLETION(sa->done);
+	queue_work(system_unbound_wq, &sa->work);
+}
+
+static void yaffs2_scan_ahead_wait(struct yaffs_scan_ahead *sa)
+{
+	if (sa->pending) {
+		wait_for_completion(&sa->done);
+		sa->pending = 0;
+	}
+}
+
+static struct yaffs_scan_ahead *yaffs2_scan_ahead_alloc(struct yaffs_dev *dev)
+{
+	struct yaffs_scan_ahead *sa;
+	int i;
+
+	if (!dev->param.read_tags_batch_fn)
+		return NULL;
+
+	sa = kmalloc(2 * sizeof(struct yaffs_scan_ahead), GFP_NOFS);
+	if (!sa)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		INIT_WORK(&sa[i].work, yaffs2_scan_ahead_worker);
+		init_completion(&sa[i].done);
+		sa[i].dev = dev;
+		sa[i].pending = 0;
+		sa[i].tags = kmalloc(dev->param.chunks_per_block *
+				     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+	}
+
+	if (!sa[0].tags || !sa[1].tags) {
+		kfree(sa[0].tags);
+		kfree(sa[1].tags);
+		kfree(sa);
+		return NULL;
+	}
+
+	return sa;
+}
+
+static void yaffs2_scan_ahead_free(struct yaffs_scan_ahead *sa)
+{
+	if (!sa)
+		return;
+
+	yaffs2_scan_ahead_wait(&sa[0]);
+	yaffs2_scan_ahead_wait(&sa[1]);
+	kfree(sa[0].tags);
+	kfree(sa[1].tags);
+	kfree(sa);
+}
+
+/* Get the tags of a chunk in the block being scanned, from the read-ahead
+ * buffer if there is one, accounting for the read as if it was done here.
+ */
+static int yaffs2_scan_rd_tags(struct yaffs_dev *dev,
+			       struct yaffs_scan_ahead *sa,
+			       struct yaffs_block_info *bi, int chunk, int c,
+			       struct yaffs_ext_tags *tags)
+{
+	if (!sa || sa->result != YAFFS_OK)
+		return yaffs_rd_chunk_tags_nand(dev, chunk, NULL, tags);
+
+	dev->n_page_reads++;
+	*tags = sa->tags[c];
+	if (tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+		yaffs_handle_chunk_error(dev, bi);
+
+	return YAFFS_OK;
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -986,6 +1093,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs_scan_ahead *scan_ahead;
+	struct yaffs_scan_ahead *sa = NULL;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1086,6 +1195,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	scan_ahead = yaffs2_scan_ahead_alloc(dev);
+	if (scan_ahead && n_to_scan > 0)
+		yaffs2_scan_ahead_start(&scan_ahead[end_iter & 1],
+					block_index[end_iter].block);
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1216,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		/* Pick up this block's tags and start on the next block's */
+		if (scan_ahead) {
+			sa = &scan_ahead[block_iter & 1];
+			yaffs2_scan_ahead_wait(sa);
+			if (block_iter > start_iter)
+				yaffs2_scan_ahead_start(
+					&scan_ahead[(block_iter - 1) & 1],
+					block_index[block_iter - 1].block);
+		}
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1238,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			result = yaffs2_scan_rd_tags(dev, sa, bi, chunk, c,
+						     &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1573,6 +1697,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	}
 
+	yaffs2_scan_ahead_free(scan_ahead);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
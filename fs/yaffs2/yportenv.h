@@ -30,6 +30,8 @@
 #include <linux/stat.h>
 #include <linux/sort.h>
 #include <linux/bitops.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
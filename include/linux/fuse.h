@@ -47,6 +47,12 @@
  *  - FUSE_IOCTL_UNRESTRICTED shall now return with array of 'struct
  *    fuse_ioctl_iovec' instead of ambiguous 'struct iovec'
  *  - add FUSE_IOCTL_32BIT flag
+ *
+ * 7.16 extensions (bit numbers and layout as in later protocol versions)
+ *  - add FUSE_WRITEBACK_CACHE init flag
+ *  - add FUSE_MAX_PAGES init flag and max_pages field to fuse_init_out
+ *  - add FUSE_PASSTHROUGH init flag, FOPEN_PASSTHROUGH open flag and
+ *    passthrough_fd field to fuse_open_out
  */
 
 #ifndef _LINUX_FUSE_H
@@ -145,16 +151,22 @@ struct fuse_file_lock {
  * FOPEN_DIRECT_IO: bypass page cache for this open file
  * FOPEN_KEEP_CACHE: don't invalidate the data cache on open
  * FOPEN_NONSEEKABLE: the file is not seekable
+ * FOPEN_PASSTHROUGH: do read, write and mmap on passthrough_fd instead
  */
 #define FOPEN_DIRECT_IO		(1 << 0)
 #define FOPEN_KEEP_CACHE	(1 << 1)
 #define FOPEN_NONSEEKABLE	(1 << 2)
+#define FOPEN_PASSTHROUGH	(1 << 7)
 
 /**
  * INIT request/reply flags
  *
  * FUSE_EXPORT_SUPPORT: filesystem handles lookups of "." and ".."
  * FUSE_DONT_MASK: don't apply umask to file mode on create operations
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes
+ * FUSE_MAX_PAGES: init_out.max_pages contains the max number of req pages
+ * FUSE_PASSTHROUGH: files may be opened with FOPEN_PASSTHROUGH, only
+ *		     granted if the mounter had CAP_SYS_ADMIN
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
@@ -163,6 +175,9 @@ struct fuse_file_lock {
 #define FUSE_EXPORT_SUPPORT	(1 << 4)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_MAX_PAGES		(1 << 22)
+#define FUSE_PASSTHROUGH	(1 << 31)
 
 /**
  * CUSE INIT request/reply flags
@@ -380,7 +395,7 @@ struct fuse_create_in {
 struct fuse_open_out {
 	__u64	fh;
 	__u32	open_flags;
-	__u32	padding;
+	__s32	passthrough_fd;
 };
 
 struct fuse_release_in {
@@ -483,6 +498,10 @@ struct fuse_init_out {
 	__u16   max_background;
 	__u16   congestion_threshold;
 	__u32	max_write;
+	__u32	time_gran;
+	__u16	max_pages;
+	__u16	padding;
+	__u32	unused[8];
 };
 
 #define CUSE_INIT_INFO_MAX 4096
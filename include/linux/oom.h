@@ -70,6 +70,29 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * The lowmemorykiller keeps every thread group leader on a list per oom_adj
+ * value. Add and delete are called with tasklist_lock write-locked, update
+ * takes it itself after oom_adj has been changed.
+ */
+extern void lowmem_add_adj_bucket(struct task_struct *p);
+extern void lowmem_del_adj_bucket(struct task_struct *p);
+extern void lowmem_update_adj_bucket(struct task_struct *p);
+#else
+static inline void lowmem_add_adj_bucket(struct task_struct *p)
+{
+}
+
+static inline void lowmem_del_adj_bucket(struct task_struct *p)
+{
+}
+
+static inline void lowmem_update_adj_bucket(struct task_struct *p)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -305,6 +305,19 @@ extern void trap_init(void);
 extern void update_process_times(int user);
 extern void scheduler_tick(void);
 
+#ifdef CONFIG_CPU_FREQ
+/*
+ * Called from every scheduler tick with the runqueue clock and the total
+ * time the CPU has spent running CFS and RT tasks, both in nanoseconds.
+ */
+struct update_util_data {
+	void (*func)(struct update_util_data *data, u64 time, u64 busy_time);
+};
+
+extern void cpufreq_set_update_util_data(int cpu,
+					 struct update_util_data *data);
+#endif
+
 extern void sched_show_task(struct task_struct *p);
 
 #ifdef CONFIG_LOCKUP_DETECTOR
@@ -1280,6 +1293,9 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_adj_node;	/* see lowmem_add_adj_bucket() */
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #ifdef CONFIG_COMPAT_BRK
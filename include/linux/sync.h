@@ -37,6 +37,7 @@ struct sync_fence;
  *			  1 if b will signal before a
  *			  0 if a and b will signal at the same time
  *			 -1 if a will signabl before b
+ *			  sync_pts on a timeline must signal in this order
  * @free_pt:		called before sync_pt is freed
  * @release_obj:	called before sync_timeline is freed
  * @print_obj:		print aditional debug information about sync_timeline.
@@ -85,8 +86,10 @@ struct sync_timeline_ops {
  * @child_list_head:	list of children sync_pts for this sync_timeline
  * @child_list_lock:	lock protecting @child_list_head, destroyed, and
  *			  sync_pt.status
- * @active_list_head:	list of active (unsignaled/errored) sync_pts
- * @sync_timeline_list:	membership in global sync_timeline_list
+ * @active_list_head:	list of active (unsignaled/errored) sync_pts, kept in
+ *			  the order given by ops->compare so that signaling
+ *			  only looks at the sync_pts that have signaled
+ * @sync_timeline_list:	membership in global sync_timeline_list (debugfs only)
  */
 struct sync_timeline {
 	const struct sync_timeline_ops	*ops;
@@ -101,7 +104,9 @@ struct sync_timeline {
 	struct list_head	active_list_head;
 	spinlock_t		active_list_lock;
 
+#ifdef CONFIG_DEBUG_FS
 	struct list_head	sync_timeline_list;
+#endif
 };
 
 /**
@@ -139,9 +144,11 @@ struct sync_pt {
  * @waiter_list_head:	list of asynchronous waiters on this fence
  * @waiter_list_lock:	lock protecting @waiter_list_head and @status
  * @status:		1: signaled, 0:active, <0: error
+ * @create_time:	time the fence was created
+ * @signal_time:	time @status left 0
  *
  * @wq:			wait queue for fence signaling
- * @sync_fence_list:	membership in global fence list
+ * @sync_fence_list:	membership in global fence list (debugfs only)
  */
 struct sync_fence {
 	struct file		*file;
@@ -154,9 +161,14 @@ struct sync_fence {
 	spinlock_t		waiter_list_lock; /* also protects status */
 	int			status;
 
+	ktime_t			create_time;
+	ktime_t			signal_time;
+
 	wait_queue_head_t	wq;
 
+#ifdef CONFIG_DEBUG_FS
 	struct list_head	sync_fence_list;
+#endif
 };
 
 /**
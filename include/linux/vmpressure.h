@@ -0,0 +1,40 @@
+#ifndef _LINUX_VMPRESSURE_H
+#define _LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+/*
+ * Memory pressure levels, derived from how many of the pages scanned by
+ * page reclaim could actually be reclaimed.  See mm/vmpressure.c.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_NONE,	/* no reclaim recently */
+	VMPRESSURE_LOW,		/* reclaiming, and doing fine */
+	VMPRESSURE_MEDIUM,	/* reclaim is getting expensive */
+	VMPRESSURE_CRITICAL,	/* reclaim is barely making progress */
+	VMPRESSURE_NUM_LEVELS,
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern void vmpressure_kswapd_wake(void);
+extern int vmpressure_level(void);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+
+static inline void vmpressure_kswapd_wake(void)
+{
+}
+
+static inline int vmpressure_level(void)
+{
+	return VMPRESSURE_NONE;
+}
+#endif
+
+#endif /* _LINUX_VMPRESSURE_H */
@@ -0,0 +1,109 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cma
+
+#if !defined(_TRACE_CMA_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CMA_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cma_alloc,
+
+	TP_PROTO(const char *name, unsigned long pfn, int count,
+		unsigned int align, bool pooled, s64 latency_us),
+
+	TP_ARGS(name, pfn, count, align, pooled, latency_us),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned long, pfn)
+		__field(int, count)
+		__field(unsigned int, align)
+		__field(bool, pooled)
+		__field(s64, latency_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->pfn = pfn;
+		__entry->count = count;
+		__entry->align = align;
+		__entry->pooled = pooled;
+		__entry->latency_us = latency_us;
+	),
+
+	TP_printk("dev=%s pfn=%lx count=%d align=%u pooled=%d latency=%lldus",
+		__get_str(name),
+		__entry->pfn,
+		__entry->count,
+		__entry->align,
+		__entry->pooled,
+		__entry->latency_us)
+);
+
+DECLARE_EVENT_CLASS(cma_range_template,
+
+	TP_PROTO(unsigned long pfn, unsigned long count, int ret),
+
+	TP_ARGS(pfn, count, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, pfn)
+		__field(unsigned long, count)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->pfn = pfn;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pfn=%lx count=%lu ret=%d",
+		__entry->pfn,
+		__entry->count,
+		__entry->ret)
+);
+
+DEFINE_EVENT(cma_range_template, cma_migrate_fail,
+
+	TP_PROTO(unsigned long pfn, unsigned long count, int ret),
+
+	TP_ARGS(pfn, count, ret)
+);
+
+DEFINE_EVENT(cma_range_template, cma_pool_refill,
+
+	TP_PROTO(unsigned long pfn, unsigned long count, int ret),
+
+	TP_ARGS(pfn, count, ret)
+);
+
+TRACE_EVENT(cma_release,
+
+	TP_PROTO(unsigned long pfn, int count, bool pooled),
+
+	TP_ARGS(pfn, count, pooled),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, pfn)
+		__field(int, count)
+		__field(bool, pooled)
+	),
+
+	TP_fast_assign(
+		__entry->pfn = pfn;
+		__entry->count = count;
+		__entry->pooled = pooled;
+	),
+
+	TP_printk("pfn=%lx count=%d pooled=%d",
+		__entry->pfn,
+		__entry->count,
+		__entry->pooled)
+);
+
+#endif /* _TRACE_CMA_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
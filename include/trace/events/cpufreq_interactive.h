@@ -40,6 +40,30 @@ DEFINE_EVENT(set, cpufreq_interactive_down,
 	TP_ARGS(cpu_id, targfreq, actualfreq)
 );
 
+TRACE_EVENT(cpufreq_interactive_latency,
+	TP_PROTO(u32 cpu_id, unsigned long targfreq,
+		 unsigned long actualfreq, s64 latency_us),
+	TP_ARGS(cpu_id, targfreq, actualfreq, latency_us),
+
+	TP_STRUCT__entry(
+	    __field(          u32, cpu_id     )
+	    __field(unsigned long, targfreq   )
+	    __field(unsigned long, actualfreq )
+	    __field(          s64, latency_us )
+	   ),
+
+	TP_fast_assign(
+	    __entry->cpu_id = (u32) cpu_id;
+	    __entry->targfreq = targfreq;
+	    __entry->actualfreq = actualfreq;
+	    __entry->latency_us = latency_us;
+	),
+
+	TP_printk("cpu=%u targ=%lu actual=%lu latency=%lldus",
+	      __entry->cpu_id, __entry->targfreq,
+	      __entry->actualfreq, __entry->latency_us)
+);
+
 DECLARE_EVENT_CLASS(loadeval,
 	    TP_PROTO(unsigned long cpu_id, unsigned long load,
 		     unsigned long curfreq, unsigned long targfreq),
@@ -0,0 +1,77 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sync
+
+#if !defined(_TRACE_SYNC_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SYNC_H
+
+#include <linux/sync.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(sync_timeline_signal,
+
+	TP_PROTO(struct sync_timeline *obj, int nr_signaled),
+
+	TP_ARGS(obj, nr_signaled),
+
+	TP_STRUCT__entry(
+		__string(name, obj->name)
+		__field(int, nr_signaled)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, obj->name);
+		__entry->nr_signaled = nr_signaled;
+	),
+
+	TP_printk("name=%s nr_signaled=%d",
+		__get_str(name),
+		__entry->nr_signaled)
+);
+
+DECLARE_EVENT_CLASS(sync_fence_latency_template,
+
+	TP_PROTO(struct sync_fence *fence, s64 latency_us),
+
+	TP_ARGS(fence, latency_us),
+
+	TP_STRUCT__entry(
+		__string(name, fence->name)
+		__field(const void *, fence)
+		__field(int, status)
+		__field(s64, latency_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, fence->name);
+		__entry->fence = fence;
+		__entry->status = fence->status;
+		__entry->latency_us = latency_us;
+	),
+
+	TP_printk("name=%s fence=%p status=%d latency=%lldus",
+		__get_str(name),
+		__entry->fence,
+		__entry->status,
+		__entry->latency_us)
+);
+
+/* latency from fence creation to signal */
+DEFINE_EVENT(sync_fence_latency_template, sync_fence_signal,
+
+	TP_PROTO(struct sync_fence *fence, s64 latency_us),
+
+	TP_ARGS(fence, latency_us)
+);
+
+/* latency from fence signal to a waiter running again */
+DEFINE_EVENT(sync_fence_latency_template, sync_fence_wake,
+
+	TP_PROTO(struct sync_fence *fence, s64 latency_us),
+
+	TP_ARGS(fence, latency_us)
+);
+
+#endif /* _TRACE_SYNC_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -501,6 +501,8 @@ struct rq {
 
 	u64 clock;
 	u64 clock_task;
+	/* clock_task time spent running CFS and RT tasks, for cpufreq */
+	u64 busy_time;
 
 	atomic_t nr_iowait;
 
@@ -4094,11 +4096,42 @@ void thread_group_times(struct task_struct *p, cputime_t *ut, cputime_t *st)
  * This function gets called by the timer code, with HZ frequency.
  * We call it with interrupts disabled.
  */
+#ifdef CONFIG_CPU_FREQ
+static DEFINE_PER_CPU(struct update_util_data *, cpufreq_update_util_data);
+
+/**
+ * cpufreq_set_update_util_data - set the per-CPU utilisation hook
+ * @cpu: CPU to set the hook for
+ * @data: hook to call from the scheduler tick, or NULL to clear it
+ *
+ * The hook runs in hard interrupt context on @cpu, with the runqueue
+ * lock already dropped, so it may wake tasks.  Callers clearing the
+ * hook must synchronize_sched() before freeing @data.
+ */
+void cpufreq_set_update_util_data(int cpu, struct update_util_data *data)
+{
+	rcu_assign_pointer(per_cpu(cpufreq_update_util_data, cpu), data);
+}
+EXPORT_SYMBOL_GPL(cpufreq_set_update_util_data);
+
+static inline void cpufreq_update_util(u64 time, u64 busy_time)
+{
+	struct update_util_data *data;
+
+	data = rcu_dereference_sched(__get_cpu_var(cpufreq_update_util_data));
+	if (data)
+		data->func(data, time, busy_time);
+}
+#else
+static inline void cpufreq_update_util(u64 time, u64 busy_time) { }
+#endif
+
 void scheduler_tick(void)
 {
 	int cpu = smp_processor_id();
 	struct rq *rq = cpu_rq(cpu);
 	struct task_struct *curr = rq->curr;
+	u64 time, busy_time;
 
 	sched_clock_tick();
 
@@ -4106,8 +4139,12 @@ void scheduler_tick(void)
 	update_rq_clock(rq);
 	update_cpu_load_active(rq);
 	curr->sched_class->task_tick(rq, curr, 0);
+	time = rq->clock_task;
+	busy_time = rq->busy_time;
 	raw_spin_unlock(&rq->lock);
 
+	cpufreq_update_util(time, busy_time);
+
 	perf_event_task_tick();
 
 #ifdef CONFIG_SMP
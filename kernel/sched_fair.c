@@ -595,6 +595,10 @@ static void update_curr(struct cfs_rq *cfs_rq)
 	__update_curr(cfs_rq, curr, delta_exec);
 	curr->exec_start = now;
 
+	/* the root cfs_rq sees the runtime of every level below it */
+	if (cfs_rq == &rq_of(cfs_rq)->cfs)
+		rq_of(cfs_rq)->busy_time += delta_exec;
+
 	if (entity_is_task(curr)) {
 		struct task_struct *curtask = task_of(curr);
 
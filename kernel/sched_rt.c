@@ -662,6 +662,7 @@ static void update_curr_rt(struct rq *rq)
 
 	curr->se.sum_exec_runtime += delta_exec;
 	account_group_exec_runtime(curr, delta_exec);
+	rq->busy_time += delta_exec;
 
 	curr->se.exec_start = rq->clock_task;
 	cpuacct_charge(curr, delta_exec);
@@ -0,0 +1,121 @@
+/*
+ * LZ4 Compressor
+ *
+ * Greedy single pass compressor for the LZ4 block format, using a 4096
+ * entry hash table of the positions of the last 4 byte sequences seen.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+static inline unsigned char *lz4_put_literals(unsigned char *op,
+					      const unsigned char *anchor,
+					      size_t run)
+{
+	unsigned char *token = op++;
+
+	if (run >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, run - RUN_MASK);
+	} else {
+		*token = run << ML_BITS;
+	}
+	memcpy(op, anchor, run);
+	return op + run;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hash_table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	unsigned char *op = dst;
+	unsigned char *token;
+	unsigned int attempts = 1 << SKIPSTRENGTH;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+	hash_table[LZ4_HASH_VALUE(ip)] = 0;
+	ip++;
+
+	while (ip < mflimit) {
+		const unsigned char *ref;
+		size_t run, len;
+		u32 h = LZ4_HASH_VALUE(ip);
+
+		ref = src + hash_table[h];
+		hash_table[h] = ip - src;
+		if (ip - ref > MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			/* skip faster through data that does not compress */
+			ip += attempts++ >> SKIPSTRENGTH;
+			continue;
+		}
+		attempts = 1 << SKIPSTRENGTH;
+
+		/* catch up with the match backwards */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		run = ip - anchor;
+		token = op;
+		op = lz4_put_literals(op, anchor, run);
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+		len = ip - anchor;
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= len;
+		}
+		anchor = ip;
+
+		/* the position two bytes back is likely to start a match */
+		if (ip < mflimit)
+			hash_table[LZ4_HASH_VALUE(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	op = lz4_put_literals(op, anchor, iend - anchor);
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
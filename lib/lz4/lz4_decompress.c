@@ -0,0 +1,105 @@
+/*
+ * LZ4 Decompressor
+ *
+ * Checks every length and offset against the input and output buffers,
+ * so corrupted input makes it fail rather than overrun.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Returns false if the input ends in the middle of the length */
+static inline bool lz4_get_length(const unsigned char **ip,
+				  const unsigned char *iend, size_t *len)
+{
+	unsigned int s;
+
+	do {
+		if (unlikely(*ip >= iend))
+			return false;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return true;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dest, size_t *dest_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const iend = src + src_len;
+	unsigned char *op = dest;
+	unsigned char * const oend = dest + *dest_len;
+
+	while (ip < iend) {
+		const unsigned char *ref;
+		unsigned int token = *ip++;
+		size_t offset;
+		size_t len = token >> ML_BITS;
+
+		/* literals */
+		if (len == RUN_MASK && !lz4_get_length(&ip, iend, &len))
+			goto error;
+		if (unlikely(len > (size_t)(iend - ip) ||
+			     len > (size_t)(oend - op)))
+			goto error;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* match */
+		if (unlikely(iend - ip < 2))
+			goto error;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > (size_t)(op - dest)))
+			goto error;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && !lz4_get_length(&ip, iend, &len))
+			goto error;
+		len += MINMATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto error;
+
+		if (offset >= 8) {
+			/* 8 byte chunks never overlap their own source */
+			while (len >= 8) {
+				memcpy(op, ref, 8);
+				op += 8;
+				ref += 8;
+				len -= 8;
+			}
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* short offsets repeat a pattern, copy bytewise */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dest_len = op - dest;
+	return 0;
+
+error:
+	return -1;
+}
+EXPORT_SYMBOL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
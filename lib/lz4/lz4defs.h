@@ -0,0 +1,37 @@
+/*
+ * lz4defs.h -- definitions shared by the LZ4 compressor and decompressor
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * A sequence is a token byte, the literal run, a 16 bit little endian
+ * match offset and the match length.  The high nibble of the token holds
+ * the literal run length and the low nibble the match length minus
+ * MINMATCH; a nibble of RUN_MASK/ML_MASK is followed by bytes that are
+ * added to it, each 255 meaning another one follows.  The last sequence
+ * has literals only.
+ */
+#define MINMATCH	4
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+#define MAX_DISTANCE	0xffff
+
+/*
+ * The last match must start at least MFLIMIT bytes before the end of the
+ * input, and the last LASTLITERALS bytes are always literals.
+ */
+#define LASTLITERALS	5
+#define MFLIMIT		(8 + MINMATCH)
+
+#define LZ4_HASHLOG	12
+#define LZ4_HASH_VALUE(p)	\
+	((get_unaligned((const u32 *)(p)) * 2654435761U) >> \
+	 (32 - LZ4_HASHLOG))
+
+/* failed match searches before the search starts skipping ahead */
+#define SKIPSTRENGTH	6
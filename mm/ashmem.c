@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,7 +39,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +48,13 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects all of the above */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +65,32 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker only ever trylocks an area's mutex with ashmem_lru_lock held
+ * and drops ashmem_lru_lock before purging, so pinning or unpinning one area
+ * only waits for reclaim of that same area.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* Statistics, exported in /sys/kernel/mm/ashmem */
+static atomic_t ashmem_purged_pages = ATOMIC_INIT(0);
+static atomic_t ashmem_purged_ranges = ATOMIC_INIT(0);
+static atomic_t ashmem_shrink_busy = ATOMIC_INIT(0);
+static atomic_t ashmem_pin_calls = ATOMIC_INIT(0);
+static atomic_t ashmem_pin_contended = ATOMIC_INIT(0);
+static atomic64_t ashmem_pin_wait_ns = ATOMIC64_INIT(0);
+static atomic64_t ashmem_pin_wait_max_ns = ATOMIC64_INIT(0);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,16 +121,28 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/*
+ * Caller must hold ashmem_lru_lock.
+ */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
@@ -123,7 +152,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -159,7 +188,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +198,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +219,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +232,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +250,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +271,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +280,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +301,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +318,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,7 +361,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -346,10 +379,14 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * Each range is purged with only its own area's mutex held.  Areas that are
+ * busy are rotated to the tail of the LRU and skipped, which also keeps us
+ * from deadlocking against a pin or unpin that allocates memory.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	unsigned long busy = 0;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
@@ -357,21 +394,48 @@ static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	while (!list_empty(&ashmem_lru_list) && busy < lru_count) {
+		struct ashmem_range *range;
+		struct ashmem_area *asma;
+		struct inode *inode;
+		loff_t start, end;
+		size_t size;
+
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
+		size = range_size(range);
+
+		if (!mutex_trylock(&asma->mutex)) {
+			list_move_tail(&range->lru, &ashmem_lru_list);
+			busy += size;
+			atomic_inc(&ashmem_shrink_busy);
+			continue;
+		}
 
-		vmtruncate_range(inode, start, end);
+		/* the area cannot go away nor the range change from here on */
+		__lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
 		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
 
-		sc->nr_to_scan -= range_size(range);
+		vmtruncate_range(inode, start, end);
+		mutex_unlock(&asma->mutex);
+
+		atomic_add(size, &ashmem_purged_pages);
+		atomic_inc(&ashmem_purged_ranges);
+
+		sc->nr_to_scan -= size;
 		if (sc->nr_to_scan <= 0)
-			break;
+			return lru_count;
+
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -385,7 +449,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +464,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +472,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +486,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +495,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +512,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,7 +521,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -523,7 +587,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -558,7 +622,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -607,7 +671,24 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	atomic_inc(&ashmem_pin_calls);
+	if (!mutex_trylock(&asma->mutex)) {
+		ktime_t start = ktime_get();
+		s64 wait, max, old;
+
+		mutex_lock(&asma->mutex);
+		wait = ktime_to_ns(ktime_sub(ktime_get(), start));
+		atomic_inc(&ashmem_pin_contended);
+		atomic64_add(wait, &ashmem_pin_wait_ns);
+		max = atomic64_read(&ashmem_pin_wait_max_ns);
+		while (wait > max) {
+			old = atomic64_cmpxchg(&ashmem_pin_wait_max_ns,
+					       max, wait);
+			if (old == max)
+				break;
+			max = old;
+		}
+	}
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +702,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -693,6 +774,49 @@ static struct miscdevice ashmem_misc = {
 	.fops = &ashmem_fops,
 };
 
+#ifdef CONFIG_SYSFS
+
+#define ASHMEM_SYSFS_RO(_name, _fmt, _val) \
+	static ssize_t ashmem_##_name##_show(struct kobject *kobj, \
+				struct kobj_attribute *attr, char *buf) \
+	{ \
+		return sprintf(buf, _fmt "\n", _val); \
+	} \
+	static struct kobj_attribute ashmem_##_name##_attr = { \
+		.attr = { .name = __stringify(_name), .mode = 0444 }, \
+		.show = ashmem_##_name##_show, \
+	}
+
+ASHMEM_SYSFS_RO(lru_pages, "%lu", lru_count);
+ASHMEM_SYSFS_RO(purged_pages, "%d", atomic_read(&ashmem_purged_pages));
+ASHMEM_SYSFS_RO(purged_ranges, "%d", atomic_read(&ashmem_purged_ranges));
+ASHMEM_SYSFS_RO(shrink_busy, "%d", atomic_read(&ashmem_shrink_busy));
+ASHMEM_SYSFS_RO(pin_calls, "%d", atomic_read(&ashmem_pin_calls));
+ASHMEM_SYSFS_RO(pin_contended, "%d", atomic_read(&ashmem_pin_contended));
+ASHMEM_SYSFS_RO(pin_wait_us, "%llu",
+	div_u64(atomic64_read(&ashmem_pin_wait_ns), NSEC_PER_USEC));
+ASHMEM_SYSFS_RO(pin_wait_max_us, "%llu",
+	div_u64(atomic64_read(&ashmem_pin_wait_max_ns), NSEC_PER_USEC));
+
+static struct attribute *ashmem_attrs[] = {
+	&ashmem_lru_pages_attr.attr,
+	&ashmem_purged_pages_attr.attr,
+	&ashmem_purged_ranges_attr.attr,
+	&ashmem_shrink_busy_attr.attr,
+	&ashmem_pin_calls_attr.attr,
+	&ashmem_pin_contended_attr.attr,
+	&ashmem_pin_wait_us_attr.attr,
+	&ashmem_pin_wait_max_us_attr.attr,
+	NULL,
+};
+
+static struct attribute_group ashmem_attr_group = {
+	.attrs = ashmem_attrs,
+	.name = "ashmem",
+};
+
+#endif /* CONFIG_SYSFS */
+
 static int __init ashmem_init(void)
 {
 	int ret;
@@ -721,6 +845,11 @@ static int __init ashmem_init(void)
 
 	register_shrinker(&ashmem_shrinker);
 
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &ashmem_attr_group))
+		printk(KERN_ERR "ashmem: failed to create sysfs group\n");
+#endif
+
 	printk(KERN_INFO "ashmem: initialized\n");
 
 	return 0;
@@ -732,6 +861,10 @@ static void __exit ashmem_exit(void)
 
 	unregister_shrinker(&ashmem_shrinker);
 
+#ifdef CONFIG_SYSFS
+	sysfs_remove_group(mm_kobj, &ashmem_attr_group);
+#endif
+
 	ret = misc_deregister(&ashmem_misc);
 	if (unlikely(ret))
 		printk(KERN_ERR "ashmem: failed to unregister misc device!\n");
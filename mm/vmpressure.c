@@ -0,0 +1,285 @@
+/*
+ * Memory pressure level from page reclaim efficiency
+ *
+ * Every time shrink_zone() finishes a pass over a zone on behalf of the
+ * global LRU it reports how many pages it scanned and how many of those
+ * it managed to reclaim.  Once a window of scanned pages has been
+ * accumulated the ratio of the two gives a pressure between 0 (everything
+ * scanned was reclaimed) and 100 (nothing was), which is mapped onto a
+ * small number of levels.  kswapd being woken up very often bumps the
+ * level by one, as it means allocations keep dipping below the low
+ * watermark faster than kswapd can restore it.
+ *
+ * The level is exported in /sys/kernel/mm/vmpressure/level, which can be
+ * poll()ed for changes, and to in-kernel users through vmpressure_level().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/vmpressure.h>
+
+/* scanned pages needed for a new pressure sample */
+static unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+static unsigned int vmpressure_level_med = 60;
+static unsigned int vmpressure_level_critical = 95;
+/* kswapd wakeups per second that bump the level */
+static unsigned int vmpressure_kswapd_high = 10;
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_NONE] = "none",
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+static unsigned int vmpressure_pressure;	/* of the last window */
+static int vmpressure_cur_level = VMPRESSURE_NONE;
+static unsigned long vmpressure_stamp;		/* end of the last window */
+
+static atomic_t vmpressure_kswapd_wakes = ATOMIC_INIT(0);
+static unsigned long vmpressure_kswapd_stamp;
+static unsigned int vmpressure_kswapd_rate;	/* wakeups per second */
+
+static void vmpressure_notify_fn(struct work_struct *work);
+static DECLARE_WORK(vmpressure_work, vmpressure_notify_fn);
+
+/*
+ * A level older than a second means reclaim has stopped running, so there
+ * is no pressure left to speak of.
+ *
+ * Caller needs to hold vmpressure_lock.
+ */
+static int __vmpressure_level(void)
+{
+	if (time_after(jiffies, vmpressure_stamp + HZ))
+		return VMPRESSURE_NONE;
+	return vmpressure_cur_level;
+}
+
+int vmpressure_level(void)
+{
+	int level;
+
+	spin_lock(&vmpressure_lock);
+	level = __vmpressure_level();
+	spin_unlock(&vmpressure_lock);
+
+	return level;
+}
+EXPORT_SYMBOL_GPL(vmpressure_level);
+
+static int vmpressure_calc_level(unsigned int pressure)
+{
+	int level;
+
+	if (pressure >= vmpressure_level_critical)
+		level = VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		level = VMPRESSURE_MEDIUM;
+	else
+		level = VMPRESSURE_LOW;
+
+	if (vmpressure_kswapd_rate >= vmpressure_kswapd_high &&
+	    level < VMPRESSURE_CRITICAL)
+		level++;
+
+	return level;
+}
+
+/*
+ * Caller needs to hold vmpressure_lock.
+ */
+static void vmpressure_update_kswapd_rate(void)
+{
+	unsigned long elapsed = jiffies - vmpressure_kswapd_stamp;
+
+	if (elapsed < HZ)
+		return;
+	vmpressure_kswapd_rate = atomic_xchg(&vmpressure_kswapd_wakes, 0) *
+		HZ / elapsed;
+	vmpressure_kswapd_stamp = jiffies;
+}
+
+/**
+ * vmpressure() - account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from shrink_zone() for global LRU reclaim, by both kswapd and
+ * direct reclaimers.  Does not sleep.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned int pressure;
+	int old_level, level;
+
+	/*
+	 * Reclaim on behalf of allocations that cannot do IO, or are
+	 * restricted to lowmem, says little about how much memory is
+	 * actually available.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	if (vmpressure_scanned < vmpressure_win) {
+		spin_unlock(&vmpressure_lock);
+		return;
+	}
+
+	scanned = vmpressure_scanned;
+	reclaimed = min(vmpressure_reclaimed, scanned);
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	vmpressure_update_kswapd_rate();
+	level = vmpressure_calc_level(pressure);
+
+	old_level = __vmpressure_level();
+	vmpressure_pressure = pressure;
+	vmpressure_cur_level = level;
+	vmpressure_stamp = jiffies;
+	spin_unlock(&vmpressure_lock);
+
+	/* sysfs_notify() sleeps on a mutex that may be held by a reclaimer */
+	if (level != old_level)
+		schedule_work(&vmpressure_work);
+}
+
+void vmpressure_kswapd_wake(void)
+{
+	atomic_inc(&vmpressure_kswapd_wakes);
+}
+
+#ifdef CONFIG_SYSFS
+
+/* level pollers were last notified of, protected by vmpressure_lock */
+static int vmpressure_notified_level = VMPRESSURE_NONE;
+/* fires when the level is due to decay to none without further reclaim */
+static DECLARE_DELAYED_WORK(vmpressure_decay_work, vmpressure_notify_fn);
+
+static void vmpressure_notify_fn(struct work_struct *work)
+{
+	unsigned long decay_at;
+	bool changed;
+	int level;
+
+	spin_lock(&vmpressure_lock);
+	level = __vmpressure_level();
+	changed = level != vmpressure_notified_level;
+	vmpressure_notified_level = level;
+	decay_at = vmpressure_stamp + HZ + 1;
+	spin_unlock(&vmpressure_lock);
+
+	if (changed)
+		sysfs_notify(mm_kobj, "vmpressure", "level");
+
+	/*
+	 * The level falls back to none by itself once reclaim stops, make
+	 * sure pollers hear about that too.
+	 */
+	if (level != VMPRESSURE_NONE)
+		schedule_delayed_work(&vmpressure_decay_work,
+				      time_after(decay_at, jiffies) ?
+				      decay_at - jiffies : 1);
+}
+
+static ssize_t level_show(struct kobject *kobj, struct kobj_attribute *attr,
+			  char *buf)
+{
+	return sprintf(buf, "%s\n", vmpressure_str_levels[vmpressure_level()]);
+}
+static struct kobj_attribute level_attr = __ATTR_RO(level);
+
+static ssize_t pressure_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", vmpressure_pressure);
+}
+static struct kobj_attribute pressure_attr = __ATTR_RO(pressure);
+
+static ssize_t kswapd_rate_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", vmpressure_kswapd_rate);
+}
+static struct kobj_attribute kswapd_rate_attr = __ATTR_RO(kswapd_rate);
+
+#define VMPRESSURE_ATTR_RW(_name, _var)					\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			    struct kobj_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", (unsigned long)_var);		\
+}									\
+static ssize_t _name##_store(struct kobject *kobj,			\
+			     struct kobj_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	unsigned long val;						\
+	int err;							\
+									\
+	err = strict_strtoul(buf, 10, &val);				\
+	if (err || !val)						\
+		return -EINVAL;						\
+	_var = val;							\
+	return count;							\
+}									\
+static struct kobj_attribute _name##_attr =				\
+	__ATTR(_name, 0644, _name##_show, _name##_store)
+
+VMPRESSURE_ATTR_RW(window, vmpressure_win);
+VMPRESSURE_ATTR_RW(medium, vmpressure_level_med);
+VMPRESSURE_ATTR_RW(critical, vmpressure_level_critical);
+VMPRESSURE_ATTR_RW(kswapd_high, vmpressure_kswapd_high);
+
+static struct attribute *vmpressure_attrs[] = {
+	&level_attr.attr,
+	&pressure_attr.attr,
+	&kswapd_rate_attr.attr,
+	&window_attr.attr,
+	&medium_attr.attr,
+	&critical_attr.attr,
+	&kswapd_high_attr.attr,
+	NULL,
+};
+
+static struct attribute_group vmpressure_attr_group = {
+	.attrs = vmpressure_attrs,
+	.name = "vmpressure",
+};
+
+#else
+
+static void vmpressure_notify_fn(struct work_struct *work)
+{
+}
+
+#endif /* CONFIG_SYSFS */
+
+static int __init vmpressure_init(void)
+{
+	vmpressure_kswapd_stamp = jiffies;
+	vmpressure_stamp = jiffies - HZ - 1;
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &vmpressure_attr_group))
+		printk(KERN_ERR "vmpressure: failed to create sysfs group\n");
+#endif
+	return 0;
+}
+module_init(vmpressure_init)
@@ -43,6 +43,7 @@
 #include <linux/sysctl.h>
 #include <linux/oom.h>
 #include <linux/prefetch.h>
+#include <linux/vmpressure.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1987,6 +1988,10 @@ restart:
 	blk_finish_plug(&plug);
 	sc->nr_reclaimed += nr_reclaimed;
 
+	if (scanning_global_lru(sc))
+		vmpressure(sc->gfp_mask, sc->nr_scanned - nr_scanned,
+			   nr_reclaimed);
+
 	/*
 	 * Even if we did not try to evict anon pages at all, we want to
 	 * rebalance the anon lru active/inactive ratio.
@@ -2840,6 +2845,7 @@ void wakeup_kswapd(struct zone *zone, int order, enum zone_type classzone_idx)
 		return;
 
 	trace_mm_vmscan_wakeup_kswapd(pgdat->node_id, zone_idx(zone), order);
+	vmpressure_kswapd_wake();
 	wake_up_interruptible(&pgdat->kswapd_wait);
 }
 